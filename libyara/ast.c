@@ -126,21 +126,188 @@ VARIABLE* lookup_variable(VARIABLE* variable_list_head, const char* identifier)
 }
 
 
-int new_rule(RULE_LIST* rules, char* identifier, NAMESPACE* ns, int flags, TAG* tag_list_head, META* meta_list_head, STRING* string_list_head, TERM* precondition, TERM* condition)
+NAMESPACE* lookup_namespace(NAMESPACE* namespace_list_head, const char* name)
+{
+    NAMESPACE* ns = namespace_list_head;
+    
+    while (ns != NULL)
+    {
+        if (strcmp(ns->name, name) == 0)
+        {
+            return ns;
+        }
+            
+        ns = ns->next;
+    }
+    
+    return NULL;
+}
+
+
+/*
+    Appends a rule to the list and makes it reachable from the list's hash 
+    table, the rule's index is left as it is.
+*/
+
+int add_rule(YARA_CONTEXT* context, RULE_LIST* rules, RULE* rule)
+{
+    return insert_rule(context, rules, rule, rules->tail);
+}
+
+/*
+    Like add_rule, but puts the rule right after previous, or at the head of
+    the list if previous is NULL.
+*/
+
+int insert_rule(YARA_CONTEXT* context, RULE_LIST* rules, RULE* rule, RULE* previous)
 {
-    RULE* new_rule;
     RULE_LIST_ENTRY* entry;
+    unsigned int key;
+    
+    rules->generation++;
+    
+    if (previous == NULL)
+    {
+        rule->next = rules->head;
+        rules->head = rule;
+    }
+    else
+    {
+        rule->next = previous->next;
+        previous->next = rule;
+    }
+    
+    if (rules->tail == previous)
+        rules->tail = rule;
+    
+    key = hash(0, rule->identifier, strlen(rule->identifier));
+    key = hash(key, rule->ns->name, strlen(rule->ns->name));
+    key = key % RULE_LIST_HASH_TABLE_SIZE;
+    
+    if (rules->hash_table[key].rule == NULL)
+    {
+        rules->hash_table[key].rule = rule;
+    }
+    else
+    {
+        entry = (RULE_LIST_ENTRY*) yr_arena_alloc(context->arena, sizeof(RULE_LIST_ENTRY));
+        
+        if (entry == NULL)
+            return ERROR_INSUFICIENT_MEMORY;
+
+        entry->rule = rule;
+        entry->next = rules->hash_table[key].next;
+        rules->hash_table[key].next = entry;
+    }
+    
+    return ERROR_SUCCESS;
+}
+
 
+static void unhash_rule(RULE_LIST* rules, RULE* rule)
+{
+    RULE_LIST_ENTRY* entry;
     unsigned int key;
+    
+    key = hash(0, rule->identifier, strlen(rule->identifier));
+    key = hash(key, rule->ns->name, strlen(rule->ns->name));
+    key = key % RULE_LIST_HASH_TABLE_SIZE;
+    
+    for (entry = &rules->hash_table[key]; entry != NULL; entry = entry->next)
+    {
+        if (entry->rule == rule)
+        {
+            entry->rule = NULL;
+            break;
+        }
+    }
+}
+
+/*
+    Takes a rule out of the list and its hash table. The rule's memory stays
+    in the arena, and its index is not given to any other rule. Returns the
+    rule that preceded it, so that insert_rule can put it back in place.
+*/
+
+RULE* remove_rule(RULE_LIST* rules, RULE* rule)
+{
+    RULE* previous = NULL;
+    RULE* r;
+    
+    for (r = rules->head; r != NULL && r != rule; r = r->next)
+    {
+        previous = r;
+    }
+    
+    if (r == NULL)
+        return NULL;
+    
+    if (previous == NULL)
+        rules->head = rule->next;
+    else
+        previous->next = rule->next;
+        
+    if (rules->tail == rule)
+        rules->tail = previous;
+    
+    unhash_rule(rules, rule);
+    
+    rule->next = NULL;
+    rules->generation++;
+    
+    return previous;
+}
+
+/*
+    Like remove_rule for all the rules whose index is not set in the keep 
+    bitmap, in a single pass over the list.
+*/
+
+void retain_rules(RULE_LIST* rules, unsigned int* keep)
+{
+    RULE* previous = NULL;
+    RULE* rule = rules->head;
+    RULE* next;
+    
+    while (rule != NULL)
+    {
+        next = rule->next;
+        
+        if (BITMAP_TEST(keep, rule->index))
+        {
+            previous = rule;
+        }
+        else
+        {
+            if (previous == NULL)
+                rules->head = next;
+            else
+                previous->next = next;
+            
+            unhash_rule(rules, rule);
+            rule->next = NULL;
+        }
+        
+        rule = next;
+    }
+    
+    rules->tail = previous;
+    rules->generation++;
+}
+
+
+int new_rule(YARA_CONTEXT* context, RULE_LIST* rules, char* identifier, NAMESPACE* ns, int flags, TAG* tag_list_head, META* meta_list_head, STRING* string_list_head, TERM* precondition, TERM* condition)
+{
+    RULE* new_rule;
     int result = ERROR_SUCCESS;
 
     if (lookup_rule(rules, identifier, ns) == NULL)  /* do not allow rules with the same identifier */
     {
-        new_rule = (RULE*) yr_malloc(sizeof(RULE));
+        new_rule = (RULE*) yr_arena_alloc(context->arena, sizeof(RULE));
     
-        if (new_rule != NULL)
+        if (new_rule != NULL && (new_rule->identifier = yr_arena_strdup(context->arena, identifier)) != NULL)
         {
-            new_rule->identifier = identifier;
+            new_rule->index = rules->count++;
 			new_rule->ns = ns;
             new_rule->flags = flags;
 			new_rule->tag_list_head = tag_list_head;
@@ -148,38 +315,8 @@ int new_rule(RULE_LIST* rules, char* identifier, NAMESPACE* ns, int flags, TAG*
             new_rule->string_list_head = string_list_head;
             new_rule->precondition = precondition;
             new_rule->condition = condition;
-            new_rule->next = NULL;
-            
-            if (rules->head == NULL && rules->tail == NULL)  /* list is empty */
-            {
-                rules->head = new_rule;
-                rules->tail = new_rule;
-            }
-            else
-            {
-                rules->tail->next = new_rule;
-                rules->tail = new_rule;
-            }			
-            
-            key = hash(0, identifier, strlen(identifier));
-            key = hash(key, ns->name, strlen(ns->name));
-            key = key % RULE_LIST_HASH_TABLE_SIZE;
             
-            if (rules->hash_table[key].rule == NULL)
-            {
-                rules->hash_table[key].rule = new_rule;
-            }
-            else
-            {
-                entry = (RULE_LIST_ENTRY*) yr_malloc(sizeof(RULE_LIST_ENTRY));
-                
-                if (entry == NULL)
-                    return ERROR_INSUFICIENT_MEMORY;
-
-                entry->rule = new_rule;
-                entry->next = rules->hash_table[key].next;
-                rules->hash_table[key].next = entry;
-            }
+            result = add_rule(context, rules, new_rule);
         }
         else
         {
@@ -225,14 +362,11 @@ int new_hex_string( YARA_CONTEXT* context,
     
     //assert(charstr[0] == '{' && charstr[len - 1] == '}');
     
-    *hexstr = hex = (unsigned char*) yr_malloc(len / 2);
-    *maskstr = mask = (unsigned char*) yr_malloc(len);
+    *hexstr = hex = (unsigned char*) yr_arena_alloc(context->arena, len / 2);
+    *maskstr = mask = (unsigned char*) yr_arena_alloc(context->arena, len);
     
     if (hex == NULL || mask == NULL)
     {
-        if (hex) yr_free(hex);
-        if (mask) yr_free(mask);
-        
         return ERROR_INSUFICIENT_MEMORY;
     }
     
@@ -455,8 +589,6 @@ int new_hex_string( YARA_CONTEXT* context,
     
     if (result != ERROR_SUCCESS)
     {
-        yr_free(*hexstr);
-        yr_free(*maskstr); 
         *hexstr = NULL;
         *maskstr = NULL;
     }
@@ -465,6 +597,25 @@ int new_hex_string( YARA_CONTEXT* context,
 }
 
 
+/*
+    Compiled regular expressions are not allocated from the context's arena,
+    they are remembered here to be freed when the context is destroyed.
+*/
+
+int remember_regexp(YARA_CONTEXT* context, REGEXP* re)
+{
+    REGEXP_LIST_ENTRY* entry = (REGEXP_LIST_ENTRY*) yr_arena_alloc(context->arena, sizeof(REGEXP_LIST_ENTRY));
+    
+    if (entry == NULL)
+        return ERROR_INSUFICIENT_MEMORY;
+        
+    entry->re = re;
+    entry->next = context->regexps;
+    context->regexps = entry;
+    
+    return ERROR_SUCCESS;
+}
+
 int new_text_string(    YARA_CONTEXT* context, 
                         SIZED_STRING* charstr, 
                         int flags, 
@@ -480,7 +631,7 @@ int new_text_string(    YARA_CONTEXT* context,
     //assert(charstr && hexstr && regexp && length);
     
     *length = charstr->length;
-    *hexstr = yr_malloc(charstr->length);
+    *hexstr = yr_arena_alloc(context->arena, charstr->length);
     
     if (*hexstr == NULL)
     {
@@ -500,6 +651,10 @@ int new_text_string(    YARA_CONTEXT* context,
         {
              result = ERROR_INVALID_REGULAR_EXPRESSION;
         }
+        else
+        {
+             result = remember_regexp(context, re);
+        }
     }
     else
     {
@@ -520,18 +675,25 @@ int new_string( YARA_CONTEXT* context,
     STRING* new_string;
     int result = ERROR_SUCCESS;
         
-    new_string = (STRING*) yr_malloc(sizeof(STRING));
+    new_string = (STRING*) yr_arena_alloc(context->arena, sizeof(STRING));
     
     if(new_string != NULL)
     {
         if (!(flags & STRING_FLAGS_WIDE))
             flags |= STRING_FLAGS_ASCII;
         
-        new_string->identifier = identifier;
+        new_string->identifier = yr_arena_strdup(context->arena, identifier);
         new_string->flags = flags;
         new_string->next = NULL;
         new_string->matches_head = NULL;
         new_string->matches_tail = NULL;
+        new_string->matches = NULL;
+        new_string->matches_count = 0;
+        new_string->matches_capacity = 0;
+        new_string->matches_dropped = 0;
+        new_string->region_start = 0;
+        new_string->region_end = 0;
+        new_string->index = context->strings_count++;
         
         if (flags & STRING_FLAGS_HEXADECIMAL)
         {
@@ -542,9 +704,13 @@ int new_string( YARA_CONTEXT* context,
             result = new_text_string(context, charstr, flags, &new_string->string, &new_string->re, &new_string->length);
         }
         
+        if (new_string->identifier == NULL)
+        {
+            result = ERROR_INSUFICIENT_MEMORY;
+        }
+        
         if (result != ERROR_SUCCESS)
         {
-            yr_free(new_string);
             new_string = NULL;
         }   
     }
@@ -557,12 +723,12 @@ int new_string( YARA_CONTEXT* context,
     return result;
 }
 
-int new_simple_term(int type, TERM** term)
+int new_simple_term(YARA_CONTEXT* context, int type, TERM** term)
 {
     TERM* new_term;
     int result = ERROR_SUCCESS;
     
-    new_term = (TERM*) yr_malloc(sizeof(TERM));
+    new_term = (TERM*) yr_arena_alloc(context->arena, sizeof(TERM));
     
     if (new_term != NULL)
     {
@@ -577,12 +743,12 @@ int new_simple_term(int type, TERM** term)
     return result;	
 }
 
-int new_unary_operation(int type, TERM* op, TERM_UNARY_OPERATION** term)
+int new_unary_operation(YARA_CONTEXT* context, int type, TERM* op, TERM_UNARY_OPERATION** term)
 {
     TERM_UNARY_OPERATION* new_term;
     int result = ERROR_SUCCESS;
     
-    new_term = (TERM_UNARY_OPERATION*) yr_malloc(sizeof(TERM_UNARY_OPERATION));
+    new_term = (TERM_UNARY_OPERATION*) yr_arena_alloc(context->arena, sizeof(TERM_UNARY_OPERATION));
     
     if (new_term != NULL)
     {
@@ -598,12 +764,12 @@ int new_unary_operation(int type, TERM* op, TERM_UNARY_OPERATION** term)
     return result;
 }
 
-int new_binary_operation(int type, TERM* op1, TERM* op2, TERM_BINARY_OPERATION** term)
+int new_binary_operation(YARA_CONTEXT* context, int type, TERM* op1, TERM* op2, TERM_BINARY_OPERATION** term)
 {
     TERM_BINARY_OPERATION* new_term;
     int result = ERROR_SUCCESS;
     
-    new_term = (TERM_BINARY_OPERATION*) yr_malloc(sizeof(TERM_BINARY_OPERATION));
+    new_term = (TERM_BINARY_OPERATION*) yr_arena_alloc(context->arena, sizeof(TERM_BINARY_OPERATION));
     
     if (new_term != NULL)
     {
@@ -620,12 +786,12 @@ int new_binary_operation(int type, TERM* op1, TERM* op2, TERM_BINARY_OPERATION**
     return result;
 }
 
-int new_ternary_operation(int type, TERM* op1, TERM* op2, TERM* op3, TERM_TERNARY_OPERATION** term)
+int new_ternary_operation(YARA_CONTEXT* context, int type, TERM* op1, TERM* op2, TERM* op3, TERM_TERNARY_OPERATION** term)
 {
     TERM_TERNARY_OPERATION* new_term;
     int result = ERROR_SUCCESS;
     
-    new_term = (TERM_TERNARY_OPERATION*) yr_malloc(sizeof(TERM_TERNARY_OPERATION));
+    new_term = (TERM_TERNARY_OPERATION*) yr_arena_alloc(context->arena, sizeof(TERM_TERNARY_OPERATION));
     
     if (new_term != NULL)
     {
@@ -643,12 +809,12 @@ int new_ternary_operation(int type, TERM* op1, TERM* op2, TERM* op3, TERM_TERNAR
     return result;
 }
 
-int new_constant(size_t constant, TERM_CONST** term)
+int new_constant(YARA_CONTEXT* context, size_t constant, TERM_CONST** term)
 {
     TERM_CONST* new_term;
     int result = ERROR_SUCCESS;
     
-    new_term = (TERM_CONST*) yr_malloc(sizeof(TERM_CONST));
+    new_term = (TERM_CONST*) yr_arena_alloc(context->arena, sizeof(TERM_CONST));
 
     if (new_term != NULL)
     {
@@ -664,8 +830,29 @@ int new_constant(size_t constant, TERM_CONST** term)
     return result;
 }
 
+int new_rule_reference(YARA_CONTEXT* context, RULE* rule, TERM_RULE** term)
+{
+    TERM_RULE* new_term;
+    int result = ERROR_SUCCESS;
+    
+    new_term = (TERM_RULE*) yr_arena_alloc(context->arena, sizeof(TERM_RULE));
 
-int new_string_identifier(int type, STRING* defined_strings, char* identifier, TERM_STRING** term)
+    if (new_term != NULL)
+    {
+        new_term->type = TERM_TYPE_RULE;
+        new_term->rule = rule;
+    }
+    else
+    {
+        result = ERROR_INSUFICIENT_MEMORY;
+    }
+    
+    *term = new_term;
+    return result;
+}
+
+
+int new_string_identifier(YARA_CONTEXT* context, int type, STRING* defined_strings, char* identifier, TERM_STRING** term)
 {
     TERM_STRING* new_term = NULL;
     STRING* string;
@@ -688,8 +875,18 @@ int new_string_identifier(int type, STRING* defined_strings, char* identifier, T
 			{
 				string->flags &= ~STRING_FLAGS_FAST_MATCH;
 			}
+			
+			/* 
+			   "at" and "in" set the string's region once their operands 
+			   are known, any other use needs the string searched everywhere
+			*/
+			if (type != TERM_TYPE_STRING_AT &&
+			    type != TERM_TYPE_STRING_IN_RANGE)
+			{
+			    string->flags |= STRING_FLAGS_UNCONSTRAINED;
+			}
 	
-            new_term = (TERM_STRING*) yr_malloc(sizeof(TERM_STRING));
+            new_term = (TERM_STRING*) yr_arena_alloc(context->arena, sizeof(TERM_STRING));
 
             if (new_term != NULL)
             {
@@ -705,7 +902,7 @@ int new_string_identifier(int type, STRING* defined_strings, char* identifier, T
     }
     else  /* anonymous strings */
     {
-        new_term = (TERM_STRING*) yr_malloc(sizeof(TERM_STRING));
+        new_term = (TERM_STRING*) yr_arena_alloc(context->arena, sizeof(TERM_STRING));
 
         if (new_term != NULL)
         {
@@ -719,6 +916,146 @@ int new_string_identifier(int type, STRING* defined_strings, char* identifier, T
     return result;
 }
 
+/*
+    Called for every "$a at <expr>" and "$a in (<expr>..<expr>)" found in a 
+    condition. If the bounds are constants the string's region is extended to
+    include them, otherwise the string can't be constrained to a region.
+*/
+
+void set_string_region(STRING* string, TERM* min, TERM* max)
+{
+    size_t lo, hi;
+    
+    if (string == NULL)
+        return;
+    
+    if (min == NULL || max == NULL || 
+        min->type != TERM_TYPE_CONST || 
+        max->type != TERM_TYPE_CONST)
+    {
+        string->flags |= STRING_FLAGS_UNCONSTRAINED;
+        return;
+    }
+    
+    lo = ((TERM_CONST*) min)->value;
+    hi = ((TERM_CONST*) max)->value;
+    
+    if (lo > hi)
+        return;    /* the condition can't be satisfied anyway */
+    
+    if (string->flags & STRING_FLAGS_REGION)
+    {
+        if (lo < string->region_start)
+            string->region_start = lo;
+        
+        if (hi > string->region_end)
+            string->region_end = hi;
+    }
+    else
+    {
+        string->region_start = lo;
+        string->region_end = hi;
+        string->flags |= STRING_FLAGS_REGION;
+    }
+}
+
+int popcount(unsigned int x)
+{
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0F0F0F0F;
+    
+    return (x * 0x01010101) >> 24;
+}
+
+/*
+    Computes the bitmap of a set from its list of string terms. Strings of a 
+    rule get consecutive indexes, so the bitmap only needs to span the few 
+    words where the rule's strings are. It's computed again when the indexes
+    change because the rules were merged into another context.
+*/
+
+int fill_string_set(YARA_CONTEXT* context, TERM_STRING_SET* term)
+{
+    TERM_STRING* t;
+    unsigned int min_index, max_index;
+    unsigned int words, word, i;
+    
+    min_index = term->head->string->index;
+    max_index = min_index;
+    
+    term->items = 0;
+    term->count = 0;
+    
+    for (t = term->head; t != NULL; t = t->next)
+    {
+        if (t->string->index < min_index)
+            min_index = t->string->index;
+            
+        if (t->string->index > max_index)
+            max_index = t->string->index;
+        
+        term->items++;
+    }
+    
+    words = max_index / BITMAP_WORD_BITS - min_index / BITMAP_WORD_BITS + 1;
+    
+    if (term->bits == NULL || words > term->words)
+    {
+        term->bits = (unsigned int*) yr_arena_alloc(context->arena, words * sizeof(unsigned int));
+    
+        if (term->bits == NULL)
+            return ERROR_INSUFICIENT_MEMORY;
+    }
+    
+    term->first_word = min_index / BITMAP_WORD_BITS;
+    term->words = words;
+    
+    memset(term->bits, 0, term->words * sizeof(unsigned int));
+    
+    for (t = term->head; t != NULL; t = t->next)
+    {
+        word = t->string->index / BITMAP_WORD_BITS - term->first_word;
+        term->bits[word] |= 1U << (t->string->index % BITMAP_WORD_BITS);
+    }
+    
+    for (i = 0; i < term->words; i++)
+    {
+        term->count += POPCOUNT(term->bits[i]);
+    }
+    
+    return ERROR_SUCCESS;
+}
+
+/*
+    Builds the set used by "of" and "for..of" from a list of string terms.
+*/
+
+int new_string_set(YARA_CONTEXT* context, TERM_STRING* string_list_head, TERM_STRING_SET** term)
+{
+    TERM_STRING_SET* new_term;
+    int result;
+    
+    *term = NULL;
+    
+    new_term = (TERM_STRING_SET*) yr_arena_alloc(context->arena, sizeof(TERM_STRING_SET));
+    
+    if (new_term == NULL)
+        return ERROR_INSUFICIENT_MEMORY;
+        
+    new_term->type = TERM_TYPE_STRING_SET;
+    new_term->head = string_list_head;
+    new_term->bits = NULL;
+    new_term->words = 0;
+    
+    result = fill_string_set(context, new_term);
+    
+    if (result == ERROR_SUCCESS)
+        *term = new_term;
+    
+    return result;
+}
+
 
 int new_variable(YARA_CONTEXT* context, char* identifier, TERM_VARIABLE** term)
 {
@@ -730,7 +1067,7 @@ int new_variable(YARA_CONTEXT* context, char* identifier, TERM_VARIABLE** term)
     
     if (variable != NULL) /* external variable should be defined */
     {    
-        new_term = (TERM_VARIABLE*) yr_malloc(sizeof(TERM_VARIABLE));
+        new_term = (TERM_VARIABLE*) yr_arena_alloc(context->arena, sizeof(TERM_VARIABLE));
 
         if (new_term != NULL)
         {
@@ -753,34 +1090,150 @@ int new_variable(YARA_CONTEXT* context, char* identifier, TERM_VARIABLE** term)
     return result;    
 }
 
-TERM* vector_first(TERM_ITERABLE* self, EVALUATION_FUNCTION evaluate, EVALUATION_CONTEXT* context)
+/*
+    Calls visitor for term and then for every term below it, stopping at the
+    first call that doesn't return ERROR_SUCCESS and returning its result.
+*/
+
+int walk_term(TERM* term, TERM_VISITOR visitor, void* data)
+{
+    int result;
+    int i;
+    
+    if (term == NULL)
+        return ERROR_SUCCESS;
+    
+    result = visitor(term, data);
+    
+    if (result != ERROR_SUCCESS)
+        return result;
+    
+    switch(term->type)
+    {
+    case TERM_TYPE_STRING_AT:
+        return walk_term(((TERM_STRING*) term)->offset, visitor, data);
+        
+    case TERM_TYPE_STRING_OFFSET:
+        return walk_term(((TERM_STRING*) term)->index, visitor, data);
+        
+    case TERM_TYPE_STRING_IN_RANGE:
+        return walk_term(((TERM_STRING*) term)->range, visitor, data);
+    
+    case TERM_TYPE_AND:
+    case TERM_TYPE_OR:
+    case TERM_TYPE_ADD:
+    case TERM_TYPE_SUB:
+    case TERM_TYPE_MUL:
+    case TERM_TYPE_DIV:
+    case TERM_TYPE_MOD:
+    case TERM_TYPE_GT:
+    case TERM_TYPE_LT:
+    case TERM_TYPE_GE:
+    case TERM_TYPE_LE:
+    case TERM_TYPE_EQ:
+    case TERM_TYPE_OF:
+    case TERM_TYPE_NOT_EQ:
+    case TERM_TYPE_SHIFT_LEFT:
+    case TERM_TYPE_SHIFT_RIGHT:
+    case TERM_TYPE_BITWISE_OR:
+    case TERM_TYPE_BITWISE_XOR:
+    case TERM_TYPE_BITWISE_AND:
+    
+        result = walk_term(((TERM_BINARY_OPERATION*) term)->op1, visitor, data);
+        
+        if (result == ERROR_SUCCESS)
+            result = walk_term(((TERM_BINARY_OPERATION*) term)->op2, visitor, data);
+            
+        return result;
+        
+    case TERM_TYPE_NOT:
+    case TERM_TYPE_BITWISE_NOT:
+    case TERM_TYPE_INT8_AT_OFFSET:
+    case TERM_TYPE_INT16_AT_OFFSET:
+    case TERM_TYPE_INT32_AT_OFFSET:
+    case TERM_TYPE_UINT8_AT_OFFSET:
+    case TERM_TYPE_UINT16_AT_OFFSET:
+    case TERM_TYPE_UINT32_AT_OFFSET:
+        return walk_term(((TERM_UNARY_OPERATION*) term)->op, visitor, data);
+        
+    case TERM_TYPE_STRING_FOR:
+    
+        result = walk_term(((TERM_TERNARY_OPERATION*) term)->op1, visitor, data);
+        
+        if (result == ERROR_SUCCESS)
+            result = walk_term(((TERM_TERNARY_OPERATION*) term)->op2, visitor, data);
+            
+        if (result == ERROR_SUCCESS)
+            result = walk_term(((TERM_TERNARY_OPERATION*) term)->op3, visitor, data);
+            
+        return result;
+        
+    case TERM_TYPE_RANGE:
+    
+        result = walk_term(((TERM_RANGE*) term)->min, visitor, data);
+        
+        if (result == ERROR_SUCCESS)
+            result = walk_term(((TERM_RANGE*) term)->max, visitor, data);
+            
+        return result;
+        
+    case TERM_TYPE_VECTOR:
+    
+        for (i = 0; i < ((TERM_VECTOR*) term)->count && result == ERROR_SUCCESS; i++)
+        {
+            result = walk_term(((TERM_VECTOR*) term)->items[i], visitor, data);
+        }
+        
+        return result;
+        
+    case TERM_TYPE_INTEGER_FOR:
+    
+        result = walk_term(((TERM_INTEGER_FOR*) term)->count, visitor, data);
+        
+        if (result == ERROR_SUCCESS)
+            result = walk_term((TERM*) ((TERM_INTEGER_FOR*) term)->items, visitor, data);
+            
+        if (result == ERROR_SUCCESS)
+            result = walk_term(((TERM_INTEGER_FOR*) term)->expression, visitor, data);
+            
+        return result;
+    }
+    
+    return ERROR_SUCCESS;
+}
+
+
+int vector_first(TERM_ITERABLE* self, EVALUATION_FUNCTION evaluate, EVALUATION_CONTEXT* context, long long* cursor, long long* value)
 {
     TERM_VECTOR* vector = (TERM_VECTOR*) self;
-    vector->current = 0;
-    return vector->items[0];
+    
+    *cursor = 0;
+    *value = evaluate(vector->items[0], context);
+    
+    return TRUE;
 }
 
-TERM* vector_next(TERM_ITERABLE* self, EVALUATION_FUNCTION evaluate, EVALUATION_CONTEXT* context)
+int vector_next(TERM_ITERABLE* self, EVALUATION_FUNCTION evaluate, EVALUATION_CONTEXT* context, long long* cursor, long long* value)
 {
     TERM_VECTOR* vector = (TERM_VECTOR*) self;
-    TERM* result = NULL;
     
-    if (vector->current < vector->count - 1)
+    if (*cursor < vector->count - 1)
     {
-        vector->current++;
-        result = vector->items[vector->current];
+        (*cursor)++;
+        *value = evaluate(vector->items[*cursor], context);
+        return TRUE;
     }
     
-    return result;
+    return FALSE;
 }
 
 
-int new_vector(TERM_VECTOR** term)
+int new_vector(YARA_CONTEXT* context, TERM_VECTOR** term)
 {
     TERM_VECTOR* new_term;
     int result = ERROR_SUCCESS;
     
-    new_term = (TERM_VECTOR*) yr_malloc(sizeof(TERM_VECTOR));
+    new_term = (TERM_VECTOR*) yr_arena_alloc(context->arena, sizeof(TERM_VECTOR));
     
     if (new_term != NULL)
     {
@@ -788,7 +1241,6 @@ int new_vector(TERM_VECTOR** term)
         new_term->first = vector_first;
         new_term->next = vector_next;
         new_term->count = 0;
-        new_term->current = 0;
         new_term->items[0] = NULL;
     }
     else
@@ -820,36 +1272,40 @@ int add_term_to_vector(TERM_VECTOR* vector, TERM* term)
 }
 
 
-TERM* range_first(TERM_ITERABLE* self, EVALUATION_FUNCTION evaluate, EVALUATION_CONTEXT* context)
+int range_first(TERM_ITERABLE* self, EVALUATION_FUNCTION evaluate, EVALUATION_CONTEXT* context, long long* cursor, long long* value)
 {
     TERM_RANGE* range = (TERM_RANGE*) self;
-    range->current->value = evaluate(range->min, context);
-    return (TERM*) range->current;
+    
+    *cursor = evaluate(range->min, context);
+    *value = *cursor;
+    
+    return TRUE;
 }
 
 
-TERM* range_next(TERM_ITERABLE* self, EVALUATION_FUNCTION evaluate, EVALUATION_CONTEXT* context)
+int range_next(TERM_ITERABLE* self, EVALUATION_FUNCTION evaluate, EVALUATION_CONTEXT* context, long long* cursor, long long* value)
 {
     TERM_RANGE* range = (TERM_RANGE*) self;
 
-    if (range->current->value < evaluate(range->max, context))
+    if (*cursor < evaluate(range->max, context))
     {
-        range->current->value++;
-        return (TERM*) range->current;
+        (*cursor)++;
+        *value = *cursor;
+        return TRUE;
     }
     else
     {
-        return NULL;
+        return FALSE;
     }
 }
 
 
-int new_range(TERM* min, TERM* max, TERM_RANGE** term)
+int new_range(YARA_CONTEXT* context, TERM* min, TERM* max, TERM_RANGE** term)
 {
     TERM_RANGE* new_term = NULL;
     int result = ERROR_SUCCESS;
     
-    new_term = (TERM_RANGE*) yr_malloc(sizeof(TERM_RANGE));
+    new_term = (TERM_RANGE*) yr_arena_alloc(context->arena, sizeof(TERM_RANGE));
     
     if (new_term != NULL)
     {
@@ -858,8 +1314,6 @@ int new_range(TERM* min, TERM* max, TERM_RANGE** term)
         new_term->next = range_next;
         new_term->min = min;
         new_term->max = max;
-        
-        result = new_constant(0, &new_term->current);
     }
     else
     {
@@ -871,136 +1325,3 @@ int new_range(TERM* min, TERM* max, TERM_RANGE** term)
 }
 
 
-/* 
-	free_term(TERM* term)
-
-	Frees a term. If the term depends on other terms they are also freed. Notice that
-	some terms hold references to STRING or VARIABLE structures, but these 
-	structures are freed by yr_destroy_context not by this function.
-	
-*/
-
-void free_term(TERM* term)
-{
-    TERM_STRING* next;
-    TERM_STRING* tmp;
-    int i, count;
-
-    switch(term->type)
-    {
-    case TERM_TYPE_STRING:
-    
-        next = ((TERM_STRING*) term)->next;
-    
-        while (next != NULL)
-        {
-            tmp = next->next;
-            yr_free(next);
-            next = tmp;     
-        }
-    
-        break;
-    
-	case TERM_TYPE_STRING_AT:
-	
-		free_term(((TERM_STRING*)term)->offset);
-		break;
-		
-	case TERM_TYPE_STRING_OFFSET:
-
-    	free_term(((TERM_STRING*)term)->index);
-    	break;
-	
-	case TERM_TYPE_STRING_IN_RANGE:
-	
-        free_term(((TERM_STRING*)term)->range);
-        break;
-        
-	case TERM_TYPE_STRING_IN_SECTION_BY_NAME:
-	    
-	    yr_free(((TERM_STRING*)term)->section_name);
-		break;
-		
-    case TERM_TYPE_STRING_MATCH:
-
-        regex_free(&(((TERM_STRING_OPERATION*)term)->re));
-        break;
-
-	case TERM_TYPE_STRING_CONTAINS:
-		yr_free(((TERM_STRING_OPERATION*)term)->string);
-		break;
-                    
-    case TERM_TYPE_AND:          
-    case TERM_TYPE_OR:
-    case TERM_TYPE_ADD:
-    case TERM_TYPE_SUB:      
-    case TERM_TYPE_MUL:
-    case TERM_TYPE_DIV:  
-    case TERM_TYPE_MOD:
-    case TERM_TYPE_GT:       
-    case TERM_TYPE_LT:
-    case TERM_TYPE_GE:       
-    case TERM_TYPE_LE:
-    case TERM_TYPE_EQ:
-    case TERM_TYPE_OF:
-    case TERM_TYPE_NOT_EQ:
-    case TERM_TYPE_SHIFT_LEFT:
-    case TERM_TYPE_SHIFT_RIGHT:
-    case TERM_TYPE_BITWISE_OR:
-    case TERM_TYPE_BITWISE_XOR:
-    case TERM_TYPE_BITWISE_AND:
-    
-        free_term(((TERM_BINARY_OPERATION*)term)->op1);
-        free_term(((TERM_BINARY_OPERATION*)term)->op2);
-        break;        
-                  
-    case TERM_TYPE_NOT:
-    case TERM_TYPE_BITWISE_NOT:
-    case TERM_TYPE_INT8_AT_OFFSET:
-    case TERM_TYPE_INT16_AT_OFFSET:
-    case TERM_TYPE_INT32_AT_OFFSET:  
-    case TERM_TYPE_UINT8_AT_OFFSET:
-    case TERM_TYPE_UINT16_AT_OFFSET:
-    case TERM_TYPE_UINT32_AT_OFFSET:
-    
-        free_term(((TERM_UNARY_OPERATION*)term)->op);
-        break;
-        
-    case TERM_TYPE_RANGE:
-    
-        free_term(((TERM_RANGE*)term)->min);
-        free_term(((TERM_RANGE*)term)->max);
-        free_term((TERM*) ((TERM_RANGE*)term)->current);
-        break;
-        
-    case TERM_TYPE_VECTOR:
-    
-        count = ((TERM_VECTOR*)term)->count;
-        
-        for (i = 0; i < count; i++)
-        {
-            free_term(((TERM_VECTOR*)term)->items[i]);
-        }
-        
-        break;
-        
-    case TERM_TYPE_INTEGER_FOR:
-    
-        free_term(((TERM_INTEGER_FOR*)term)->count);
-        free_term(((TERM_INTEGER_FOR*)term)->expression);
-        free_term((TERM*) ((TERM_INTEGER_FOR*)term)->items);
-        break;
-        
-    case TERM_TYPE_STRING_FOR:
-
-        free_term(((TERM_TERNARY_OPERATION*)term)->op1);
-        free_term(((TERM_TERNARY_OPERATION*)term)->op2);
-        free_term(((TERM_TERNARY_OPERATION*)term)->op3);          
-        break;
-    }
-    
-    yr_free(term);
-}
-
-
-
@@ -88,6 +88,7 @@ limitations under the License.
 #define TERM_TYPE_BITWISE_XOR                        44
 #define TERM_TYPE_MOD                                45
 #define TERM_TYPE_STRING_EQUALS                      46
+#define TERM_TYPE_STRING_SET                         47
 
 
 #define MAX_VECTOR_SIZE                              64
@@ -102,6 +103,14 @@ typedef struct _TERM_CONST
 } TERM_CONST;
 
 
+typedef struct _TERM_RULE
+{
+    int             type;
+    RULE*           rule;
+
+} TERM_RULE;
+
+
 typedef struct _TERM_STRING_CONST
 {
     int             type;
@@ -139,7 +148,13 @@ typedef struct _TERM_TERNARY_OPERATION
 
 struct _TERM_ITERABLE;
 
-typedef TERM* (*ITERATOR)(struct _TERM_ITERABLE* self, EVALUATION_FUNCTION evaluate, EVALUATION_CONTEXT* context);
+/* 
+    Iterators put the value of the next item in value and return FALSE when 
+    there are no more items. Where they are is kept by the caller in cursor,
+    so the same term can be iterated by several evaluations at once.
+*/
+
+typedef int (*ITERATOR)(struct _TERM_ITERABLE* self, EVALUATION_FUNCTION evaluate, EVALUATION_CONTEXT* context, long long* cursor, long long* value);
 
 
 typedef struct _TERM_ITERABLE
@@ -158,7 +173,6 @@ typedef struct _TERM_RANGE
     ITERATOR        next;
     TERM*           min;
     TERM*           max;
-    TERM_CONST*     current;
     
 } TERM_RANGE;
 
@@ -169,7 +183,6 @@ typedef struct _TERM_VECTOR
     ITERATOR        first;
     ITERATOR        next;
     int             count;
-    int             current;
     TERM*           items[MAX_VECTOR_SIZE];
 
 } TERM_VECTOR;
@@ -203,6 +216,40 @@ typedef struct _TERM_STRING
 } TERM_STRING;
 
 
+#define BITMAP_WORD_BITS        32
+
+#define BITMAP_WORDS(n)         (((n) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+#define BITMAP_TEST(b, i)       ((b)[(i) / BITMAP_WORD_BITS] & (1U << ((i) % BITMAP_WORD_BITS)))
+#define BITMAP_SET(b, i)        ((b)[(i) / BITMAP_WORD_BITS] |= 1U << ((i) % BITMAP_WORD_BITS))
+#define BITMAP_CLEAR(b, i)      ((b)[(i) / BITMAP_WORD_BITS] &= ~(1U << ((i) % BITMAP_WORD_BITS)))
+
+#if defined(__GNUC__)
+#define POPCOUNT(x)             __builtin_popcount(x)
+#else
+#define POPCOUNT(x)             popcount(x)
+#endif
+
+
+typedef struct _TERM_STRING_SET
+{
+    int             type;
+    TERM_STRING*    head;           /* the strings as they were enumerated */
+    int             items;          /* number of terms in the list above */
+    int             count;          /* number of distinct strings in the set */
+    
+    /* 
+        the set as a bitmap, covering "words" words of the found strings 
+        bitmap starting at "first_word"
+    */
+    
+    unsigned int    first_word;
+    unsigned int    words;
+    unsigned int*   bits;
+
+} TERM_STRING_SET;
+
+
 typedef struct _TERM_VARIABLE
 { 
     int        type;
@@ -226,29 +273,53 @@ typedef struct _TERM_STRING_OPERATION
 
 
 
-int new_rule(RULE_LIST* rules, char* identifier, NAMESPACE* ns, int flags, TAG* tag_list_head, META* meta_list_head, STRING* string_list_head, TERM* precondition, TERM* condition);
+int new_rule(YARA_CONTEXT* context, RULE_LIST* rules, char* identifier, NAMESPACE* ns, int flags, TAG* tag_list_head, META* meta_list_head, STRING* string_list_head, TERM* precondition, TERM* condition);
+
+int add_rule(YARA_CONTEXT* context, RULE_LIST* rules, RULE* rule);
+
+int insert_rule(YARA_CONTEXT* context, RULE_LIST* rules, RULE* rule, RULE* previous);
+
+RULE* remove_rule(RULE_LIST* rules, RULE* rule);
+
+void retain_rules(RULE_LIST* rules, unsigned int* keep);
+
+int remember_regexp(YARA_CONTEXT* context, REGEXP* re);
 
 int new_string(YARA_CONTEXT* context, char* identifier, SIZED_STRING* charstr, int flags, STRING** string);
 
-int new_simple_term(int type, TERM** term);
+int new_simple_term(YARA_CONTEXT* context, int type, TERM** term);
+
+int new_unary_operation(YARA_CONTEXT* context, int type, TERM* op1, TERM_UNARY_OPERATION** term);
+
+int new_binary_operation(YARA_CONTEXT* context, int type, TERM* op1, TERM* op2, TERM_BINARY_OPERATION** term);
+
+int new_ternary_operation(YARA_CONTEXT* context, int type, TERM* op1, TERM* op2, TERM* op3, TERM_TERNARY_OPERATION** term);
 
-int new_unary_operation(int type, TERM* op1, TERM_UNARY_OPERATION** term);
+int new_constant(YARA_CONTEXT* context, size_t constant, TERM_CONST** term);
 
-int new_binary_operation(int type, TERM* op1, TERM* op2, TERM_BINARY_OPERATION** term);
+int new_rule_reference(YARA_CONTEXT* context, RULE* rule, TERM_RULE** term);
 
-int new_ternary_operation(int type, TERM* op1, TERM* op2, TERM* op3, TERM_TERNARY_OPERATION** term);
+int new_string_identifier(YARA_CONTEXT* context, int type, STRING* defined_strings, char* identifier, TERM_STRING** term);
 
-int new_constant(size_t constant, TERM_CONST** term);
+int new_string_set(YARA_CONTEXT* context, TERM_STRING* string_list_head, TERM_STRING_SET** term);
 
-int new_string_identifier(int type, STRING* defined_strings, char* identifier, TERM_STRING** term);
+int fill_string_set(YARA_CONTEXT* context, TERM_STRING_SET* term);
+
+int popcount(unsigned int x);
+
+void set_string_region(STRING* string, TERM* min, TERM* max);
 
 int new_variable(YARA_CONTEXT* context, char* identifier, TERM_VARIABLE** term);
 
-int new_range(TERM* min, TERM* max, TERM_RANGE** term);
+int new_range(YARA_CONTEXT* context, TERM* min, TERM* max, TERM_RANGE** term);
 
-int new_vector(TERM_VECTOR** term);
+int new_vector(YARA_CONTEXT* context, TERM_VECTOR** term);
 
 int add_term_to_vector(TERM_VECTOR* vector, TERM* term);
 
+typedef int (*TERM_VISITOR)(TERM* term, void* data);
+
+int walk_term(TERM* term, TERM_VISITOR visitor, void* data);
+
 #endif
 
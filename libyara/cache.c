@@ -0,0 +1,686 @@
+/*
+Copyright (c) 2007. Victor M. Alvarez [plusvic@gmail.com].
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+
+#ifndef WIN32
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "ast.h"
+#include "cache.h"
+#include "mem.h"
+#include "scan.h"
+
+
+/*
+    Content hash, this is XXH64 with seed 0. Words are read in host byte
+    order, which is fine because the cache is meant to be shared by processes
+    running in the same machine.
+*/
+
+#define PRIME64_1       11400714785074694791ULL
+#define PRIME64_2       14029467366897019727ULL
+#define PRIME64_3       1609587929392839161ULL
+#define PRIME64_4       9650029242287828579ULL
+#define PRIME64_5       2870177450012600261ULL
+
+#define ROTL64(x, r)    (((x) << (r)) | ((x) >> (64 - (r))))
+
+
+unsigned long long read64(const unsigned char* p)
+{
+    unsigned long long value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+unsigned int read32(const unsigned char* p)
+{
+    unsigned int value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+unsigned long long hash_round(unsigned long long acc, unsigned long long input)
+{
+    acc += input * PRIME64_2;
+    acc = ROTL64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+unsigned long long hash_merge(unsigned long long acc, unsigned long long value)
+{
+    acc ^= hash_round(0, value);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+unsigned long long hash_data(const unsigned char* data, size_t size)
+{
+    const unsigned char* p = data;
+    const unsigned char* end = data + size;
+    unsigned long long v1, v2, v3, v4;
+    unsigned long long h;
+
+    if (size >= 32)
+    {
+        v1 = PRIME64_1 + PRIME64_2;
+        v2 = PRIME64_2;
+        v3 = 0;
+        v4 = 0 - PRIME64_1;
+
+        while (p + 32 <= end)
+        {
+            v1 = hash_round(v1, read64(p));
+            v2 = hash_round(v2, read64(p + 8));
+            v3 = hash_round(v3, read64(p + 16));
+            v4 = hash_round(v4, read64(p + 24));
+            p += 32;
+        }
+
+        h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+        h = hash_merge(h, v1);
+        h = hash_merge(h, v2);
+        h = hash_merge(h, v3);
+        h = hash_merge(h, v4);
+    }
+    else
+    {
+        h = PRIME64_5;
+    }
+
+    h += (unsigned long long) size;
+
+    while (p + 8 <= end)
+    {
+        h ^= hash_round(0, read64(p));
+        h = ROTL64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+
+    if (p + 4 <= end)
+    {
+        h ^= (unsigned long long) read32(p) * PRIME64_1;
+        h = ROTL64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end)
+    {
+        h ^= (*p) * PRIME64_5;
+        h = ROTL64(h, 11) * PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+
+/*
+    The ruleset fingerprint is a FNV-1a hash of everything in the compiled
+    rules that can change the result of a scan: rules and their flags, the
+    strings with their modifiers and the conditions, term by term, as well as
+    the limits on the matches kept, which decide what string counts are seen
+    by the conditions. Rules using external variables don't depend only on 
+    the scanned data, so they can't be fingerprinted.
+*/
+
+#define FNV_OFFSET_BASIS        14695981039346656037ULL
+#define FNV_PRIME               1099511628211ULL
+
+#define RULE_FLAGS_FINGERPRINT  (RULE_FLAGS_PRIVATE | RULE_FLAGS_GLOBAL | RULE_FLAGS_REQUIRE_EXECUTABLE | RULE_FLAGS_REQUIRE_FILE)
+
+
+typedef struct _LOOP_VARIABLE
+{
+    VARIABLE*               variable;
+    struct _LOOP_VARIABLE*  next;
+
+} LOOP_VARIABLE;
+
+
+void fingerprint_bytes(unsigned long long* fingerprint, const void* data, size_t size)
+{
+    const unsigned char* p = (const unsigned char*) data;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+    {
+        *fingerprint ^= p[i];
+        *fingerprint *= FNV_PRIME;
+    }
+}
+
+void fingerprint_integer(unsigned long long* fingerprint, size_t value)
+{
+    fingerprint_bytes(fingerprint, &value, sizeof(value));
+}
+
+void fingerprint_string(unsigned long long* fingerprint, const char* string)
+{
+    if (string == NULL)
+        string = "";
+
+    fingerprint_bytes(fingerprint, string, strlen(string) + 1);
+}
+
+void fingerprint_string_reference(unsigned long long* fingerprint, STRING* string)
+{
+    /* anonymous references inside "for .. of" loops have no string */
+    fingerprint_integer(fingerprint, (string != NULL) ? string->index : (size_t) -1);
+}
+
+size_t hex_mask_length(const unsigned char* mask)
+{
+    size_t i = 0;
+
+    while (mask[i] != MASK_END)
+    {
+        if (mask[i] == MASK_EXACT_SKIP)
+            i += 2;
+        else if (mask[i] == MASK_RANGE_SKIP)
+            i += 3;
+        else
+            i++;
+    }
+
+    return i + 1;
+}
+
+int fingerprint_term(TERM* term, LOOP_VARIABLE* loop_variables, unsigned long long* fingerprint)
+{
+    TERM_STRING* term_string;
+    LOOP_VARIABLE loop_variable;
+    LOOP_VARIABLE* lv;
+    int i;
+
+    if (term == NULL)
+    {
+        fingerprint_integer(fingerprint, (size_t) -1);
+        return TRUE;
+    }
+
+    fingerprint_integer(fingerprint, term->type);
+
+    switch(term->type)
+    {
+    case TERM_TYPE_CONST:
+        fingerprint_integer(fingerprint, ((TERM_CONST*) term)->value);
+        return TRUE;
+
+    case TERM_TYPE_FILESIZE:
+    case TERM_TYPE_ENTRYPOINT:
+        return TRUE;
+
+    case TERM_TYPE_RULE:
+        fingerprint_string(fingerprint, ((TERM_RULE*) term)->rule->identifier);
+        fingerprint_string(fingerprint, ((TERM_RULE*) term)->rule->ns->name);
+        return TRUE;
+
+    case TERM_TYPE_STRING:
+    case TERM_TYPE_STRING_COUNT:
+
+        term_string = (TERM_STRING*) term;
+
+        while (term_string != NULL)
+        {
+            fingerprint_string_reference(fingerprint, term_string->string);
+            term_string = term_string->next;
+        }
+
+        return TRUE;
+
+    case TERM_TYPE_STRING_AT:
+        fingerprint_string_reference(fingerprint, ((TERM_STRING*) term)->string);
+        return fingerprint_term(((TERM_STRING*) term)->offset, loop_variables, fingerprint);
+
+    case TERM_TYPE_STRING_OFFSET:
+        fingerprint_string_reference(fingerprint, ((TERM_STRING*) term)->string);
+        return fingerprint_term(((TERM_STRING*) term)->index, loop_variables, fingerprint);
+
+    case TERM_TYPE_STRING_IN_RANGE:
+        fingerprint_string_reference(fingerprint, ((TERM_STRING*) term)->string);
+        return fingerprint_term(((TERM_STRING*) term)->range, loop_variables, fingerprint);
+
+    case TERM_TYPE_STRING_IN_SECTION_BY_NAME:
+        fingerprint_string_reference(fingerprint, ((TERM_STRING*) term)->string);
+        fingerprint_string(fingerprint, ((TERM_STRING*) term)->section_name);
+        return TRUE;
+
+    case TERM_TYPE_STRING_IN_SECTION_BY_INDEX:
+        fingerprint_string_reference(fingerprint, ((TERM_STRING*) term)->string);
+        fingerprint_integer(fingerprint, ((TERM_STRING*) term)->section_index);
+        return TRUE;
+
+    case TERM_TYPE_AND:
+    case TERM_TYPE_OR:
+    case TERM_TYPE_ADD:
+    case TERM_TYPE_SUB:
+    case TERM_TYPE_MUL:
+    case TERM_TYPE_DIV:
+    case TERM_TYPE_MOD:
+    case TERM_TYPE_GT:
+    case TERM_TYPE_LT:
+    case TERM_TYPE_GE:
+    case TERM_TYPE_LE:
+    case TERM_TYPE_EQ:
+    case TERM_TYPE_OF:
+    case TERM_TYPE_NOT_EQ:
+    case TERM_TYPE_SHIFT_LEFT:
+    case TERM_TYPE_SHIFT_RIGHT:
+    case TERM_TYPE_BITWISE_OR:
+    case TERM_TYPE_BITWISE_XOR:
+    case TERM_TYPE_BITWISE_AND:
+        return fingerprint_term(((TERM_BINARY_OPERATION*) term)->op1, loop_variables, fingerprint) &&
+               fingerprint_term(((TERM_BINARY_OPERATION*) term)->op2, loop_variables, fingerprint);
+
+    case TERM_TYPE_NOT:
+    case TERM_TYPE_BITWISE_NOT:
+    case TERM_TYPE_INT8_AT_OFFSET:
+    case TERM_TYPE_INT16_AT_OFFSET:
+    case TERM_TYPE_INT32_AT_OFFSET:
+    case TERM_TYPE_UINT8_AT_OFFSET:
+    case TERM_TYPE_UINT16_AT_OFFSET:
+    case TERM_TYPE_UINT32_AT_OFFSET:
+        return fingerprint_term(((TERM_UNARY_OPERATION*) term)->op, loop_variables, fingerprint);
+
+    case TERM_TYPE_STRING_FOR:
+        return fingerprint_term(((TERM_TERNARY_OPERATION*) term)->op1, loop_variables, fingerprint) &&
+               fingerprint_term(((TERM_TERNARY_OPERATION*) term)->op2, loop_variables, fingerprint) &&
+               fingerprint_term(((TERM_TERNARY_OPERATION*) term)->op3, loop_variables, fingerprint);
+
+    case TERM_TYPE_STRING_SET:
+        return fingerprint_term((TERM*) ((TERM_STRING_SET*) term)->head, loop_variables, fingerprint);
+
+    case TERM_TYPE_RANGE:
+        return fingerprint_term(((TERM_RANGE*) term)->min, loop_variables, fingerprint) &&
+               fingerprint_term(((TERM_RANGE*) term)->max, loop_variables, fingerprint);
+
+    case TERM_TYPE_VECTOR:
+
+        fingerprint_integer(fingerprint, ((TERM_VECTOR*) term)->count);
+
+        for (i = 0; i < ((TERM_VECTOR*) term)->count; i++)
+        {
+            if (!fingerprint_term(((TERM_VECTOR*) term)->items[i], loop_variables, fingerprint))
+                return FALSE;
+        }
+
+        return TRUE;
+
+    case TERM_TYPE_INTEGER_FOR:
+
+        /* the loop variable is defined like an external one, but it's fine to use it in the loop */
+
+        loop_variable.variable = ((TERM_INTEGER_FOR*) term)->variable;
+        loop_variable.next = loop_variables;
+
+        fingerprint_string(fingerprint, loop_variable.variable->identifier);
+
+        return fingerprint_term(((TERM_INTEGER_FOR*) term)->count, loop_variables, fingerprint) &&
+               fingerprint_term((TERM*) ((TERM_INTEGER_FOR*) term)->items, loop_variables, fingerprint) &&
+               fingerprint_term(((TERM_INTEGER_FOR*) term)->expression, &loop_variable, fingerprint);
+
+    case TERM_TYPE_VARIABLE:
+
+        for (lv = loop_variables; lv != NULL; lv = lv->next)
+        {
+            if (lv->variable == ((TERM_VARIABLE*) term)->variable)
+            {
+                fingerprint_string(fingerprint, lv->variable->identifier);
+                return TRUE;
+            }
+        }
+
+        return FALSE;
+    }
+
+    /* string operations on external variables and anything unknown */
+
+    return FALSE;
+}
+
+int compute_rules_fingerprint(YARA_CONTEXT* context, unsigned long long* fingerprint)
+{
+    RULE* rule;
+    STRING* string;
+
+    *fingerprint = FNV_OFFSET_BASIS;
+
+    fingerprint_integer(fingerprint, context->fast_match);
+    fingerprint_integer(fingerprint, context->max_string_matches);
+    fingerprint_integer(fingerprint, context->match_memory_limit);
+
+    for (rule = context->rule_list.head; rule != NULL; rule = rule->next)
+    {
+        fingerprint_string(fingerprint, rule->identifier);
+        fingerprint_string(fingerprint, rule->ns->name);
+        fingerprint_integer(fingerprint, rule->flags & RULE_FLAGS_FINGERPRINT);
+
+        for (string = rule->string_list_head; string != NULL; string = string->next)
+        {
+            fingerprint_string(fingerprint, string->identifier);
+            fingerprint_integer(fingerprint, string->flags & ~STRING_FLAGS_FOUND);
+            fingerprint_integer(fingerprint, string->length);
+            fingerprint_bytes(fingerprint, string->string, string->length);
+
+            if (IS_HEX(string))
+                fingerprint_bytes(fingerprint, string->mask, hex_mask_length(string->mask));
+        }
+
+        if (!fingerprint_term(rule->precondition, NULL, fingerprint) ||
+            !fingerprint_term(rule->condition, NULL, fingerprint))
+        {
+            return ERROR_UNCACHEABLE_RULES;
+        }
+    }
+
+    return ERROR_SUCCESS;
+}
+
+
+#ifdef WIN32
+
+int cache_open(const char* cache_path, YARA_CONTEXT* context, RESULT_CACHE** cache)
+{
+    *cache = NULL;
+    return ERROR_COULD_NOT_MAP_FILE;
+}
+
+void cache_close(RESULT_CACHE* cache)
+{
+}
+
+int cache_lookup(RESULT_CACHE* cache, unsigned long long hash, size_t size, YARA_SCANNER* scanner)
+{
+    return FALSE;
+}
+
+void cache_store(RESULT_CACHE* cache, unsigned long long hash, size_t size, YARA_SCANNER* scanner)
+{
+}
+
+#else
+
+#if defined(__GNUC__)
+#define MEMORY_BARRIER()        __sync_synchronize()
+#else
+#define MEMORY_BARRIER()
+#endif
+
+size_t cache_entry_size(unsigned int words)
+{
+    size_t size = offsetof(CACHE_ENTRY, bits) + 2 * words * sizeof(unsigned int);
+
+    return (size + 7) & ~((size_t) 7);
+}
+
+CACHE_ENTRY* cache_slot(RESULT_CACHE* cache, unsigned long long hash)
+{
+    size_t slot = (size_t) (hash & (CACHE_SLOTS - 1));
+
+    return (CACHE_ENTRY*) (cache->data + sizeof(CACHE_HEADER) + slot * cache_entry_size(cache->words));
+}
+
+/*
+    Entries may be written by several processes at the same time, a torn
+    entry is detected by its checksum and treated as a miss. The checksum is
+    never zero so empty entries are always misses.
+*/
+
+unsigned int cache_entry_checksum(CACHE_ENTRY* entry, unsigned int words)
+{
+    unsigned long long h;
+
+    h = hash_data((unsigned char*) entry->bits, 2 * words * sizeof(unsigned int));
+    h ^= hash_round(entry->hash, entry->size);
+    h = (unsigned int) (h ^ (h >> 32));
+
+    return (h != 0) ? (unsigned int) h : 1;
+}
+
+int cache_open(const char* cache_path, YARA_CONTEXT* context, RESULT_CACHE** cache)
+{
+    RESULT_CACHE* new_cache;
+    CACHE_HEADER header;
+    CACHE_HEADER current_header;
+    struct stat st;
+    RULE* rule;
+    size_t size;
+    int result;
+    int fd;
+
+    *cache = NULL;
+
+    memset(&header, 0, sizeof(header));
+
+    result = compute_rules_fingerprint(context, &header.fingerprint);
+
+    if (result != ERROR_SUCCESS)
+        return result;
+
+    for (rule = context->rule_list.head; rule != NULL; rule = rule->next)
+        header.rules_count++;
+
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.slots_count = CACHE_SLOTS;
+    header.entry_size = (unsigned int) cache_entry_size(BITMAP_WORDS(header.rules_count));
+
+    size = sizeof(CACHE_HEADER) + (size_t) CACHE_SLOTS * header.entry_size;
+
+    fd = open(cache_path, O_RDWR | O_CREAT, 0644);
+
+    if (fd == -1)
+        return ERROR_COULD_NOT_OPEN_FILE;
+
+    /*
+        other processes could be opening the same file, the first one taking
+        the lock resets it if it was built for some other ruleset
+    */
+
+    flock(fd, LOCK_EX);
+
+    if (fstat(fd, &st) != 0 ||
+        st.st_size != (off_t) size ||
+        pread(fd, &current_header, sizeof(current_header), 0) != sizeof(current_header) ||
+        memcmp(&current_header, &header, sizeof(header)) != 0)
+    {
+        if (ftruncate(fd, 0) != 0 ||
+            ftruncate(fd, size) != 0 ||
+            pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        {
+            flock(fd, LOCK_UN);
+            close(fd);
+            return ERROR_COULD_NOT_MAP_FILE;
+        }
+    }
+
+    flock(fd, LOCK_UN);
+
+    new_cache = (RESULT_CACHE*) yr_malloc(sizeof(RESULT_CACHE));
+
+    if (new_cache == NULL)
+    {
+        close(fd);
+        return ERROR_INSUFICIENT_MEMORY;
+    }
+
+    new_cache->data = (unsigned char*) mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (new_cache->data == MAP_FAILED)
+    {
+        yr_free(new_cache);
+        close(fd);
+        return ERROR_COULD_NOT_MAP_FILE;
+    }
+
+    new_cache->file = fd;
+    new_cache->size = size;
+    new_cache->rules_count = header.rules_count;
+    new_cache->words = BITMAP_WORDS(header.rules_count);
+
+    *cache = new_cache;
+
+    return ERROR_SUCCESS;
+}
+
+void cache_close(RESULT_CACHE* cache)
+{
+    munmap(cache->data, cache->size);
+    close(cache->file);
+
+    yr_free(cache);
+}
+
+/*
+    Entries are copied to the scanner before using them, so that scanners
+    sharing the cache don't see each other's half written entries. Returns
+    NULL if there's no memory for the copy.
+*/
+
+CACHE_ENTRY* scanner_cache_entry(RESULT_CACHE* cache, YARA_SCANNER* scanner)
+{
+    size_t size = cache_entry_size(cache->words);
+    CACHE_ENTRY* entry;
+
+    if (scanner->cache_entry_size < size)
+    {
+        entry = (CACHE_ENTRY*) yr_malloc(size);
+
+        if (entry == NULL)
+            return NULL;
+
+        yr_free(scanner->cache_entry);
+
+        scanner->cache_entry = entry;
+        scanner->cache_entry_size = size;
+    }
+
+    return scanner->cache_entry;
+}
+
+/*
+    Looks for the result of scanning some content with the given hash and
+    size, on a hit the scanner's rules get the flags they had after scanning
+    it and its failed preconditions are restored. Returns TRUE on a hit.
+    Like a scan, it must be preceded by clear_marks.
+*/
+
+int cache_lookup(RESULT_CACHE* cache, unsigned long long hash, size_t size, YARA_SCANNER* scanner)
+{
+    CACHE_ENTRY* slot = cache_slot(cache, hash);
+    CACHE_ENTRY* entry;
+    unsigned int* failed_precondition;
+    unsigned int i;
+    RULE* rule;
+
+    if (slot->checksum == 0 || slot->hash != hash || slot->size != size)
+        return FALSE;
+
+    entry = scanner_cache_entry(cache, scanner);
+
+    if (entry == NULL)
+        return FALSE;
+
+    memcpy(entry, slot, cache_entry_size(cache->words));
+
+    if (entry->checksum != cache_entry_checksum(entry, cache->words) ||
+        entry->hash != hash || entry->size != size)
+    {
+        return FALSE;
+    }
+
+    failed_precondition = entry->bits + cache->words;
+
+    for (rule = scanner->rule_list_head, i = 0; rule != NULL && i < cache->rules_count; rule = rule->next, i++)
+    {
+        if (entry->bits[i / BITMAP_WORD_BITS] & (1U << (i % BITMAP_WORD_BITS)))
+        {
+            rule->flags |= RULE_FLAGS_MATCH;
+            scanner->touched_rules[scanner->touched_rules_count++] = rule;
+        }
+
+        if (failed_precondition[i / BITMAP_WORD_BITS] & (1U << (i % BITMAP_WORD_BITS)))
+            BITMAP_SET(scanner->failed_preconditions, rule->index);
+    }
+
+    /* rules were added after opening the cache */
+
+    return (rule == NULL && i == cache->rules_count);
+}
+
+void cache_store(RESULT_CACHE* cache, unsigned long long hash, size_t size, YARA_SCANNER* scanner)
+{
+    CACHE_ENTRY* slot = cache_slot(cache, hash);
+    CACHE_ENTRY* entry = scanner_cache_entry(cache, scanner);
+    unsigned int* failed_precondition;
+    unsigned int i;
+    RULE* rule;
+
+    if (entry == NULL)
+        return;
+
+    memset(entry, 0, cache_entry_size(cache->words));
+
+    entry->hash = hash;
+    entry->size = size;
+
+    failed_precondition = entry->bits + cache->words;
+
+    for (rule = scanner->rule_list_head, i = 0; rule != NULL && i < cache->rules_count; rule = rule->next, i++)
+    {
+        if (rule->flags & RULE_FLAGS_MATCH)
+            entry->bits[i / BITMAP_WORD_BITS] |= 1U << (i % BITMAP_WORD_BITS);
+
+        if (BITMAP_TEST(scanner->failed_preconditions, rule->index))
+            failed_precondition[i / BITMAP_WORD_BITS] |= 1U << (i % BITMAP_WORD_BITS);
+    }
+    
+    /* rules were added after opening the cache */
+    
+    if (rule != NULL || i != cache->rules_count)
+        return;
+
+    entry->checksum = cache_entry_checksum(entry, cache->words);
+
+    /* invalidate the slot while it's being written */
+
+    slot->checksum = 0;
+    MEMORY_BARRIER();
+
+    slot->hash = hash;
+    slot->size = size;
+    slot->reserved = 0;
+    memcpy(slot->bits, entry->bits, 2 * cache->words * sizeof(unsigned int));
+
+    MEMORY_BARRIER();
+    slot->checksum = entry->checksum;
+}
+
+#endif
+
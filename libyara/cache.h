@@ -0,0 +1,82 @@
+/*
+Copyright (c) 2007. Victor M. Alvarez [plusvic@gmail.com].
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include "yara.h"
+
+#define CACHE_MAGIC             0x43524159      /* "YARC" */
+#define CACHE_VERSION           1
+#define CACHE_SLOTS             65536           /* must be a power of two */
+
+/*
+    The cache file starts with a header followed by CACHE_SLOTS fixed size
+    entries. Each entry holds the result of scanning some content: one bit
+    per rule telling if it matched and one bit telling if its precondition
+    failed, which is everything needed to invoke the callback again in the
+    same way. Entries are direct mapped by content hash.
+*/
+
+typedef struct _CACHE_HEADER
+{
+    unsigned int        magic;
+    unsigned int        version;
+    unsigned long long  fingerprint;
+    unsigned int        rules_count;
+    unsigned int        slots_count;
+    unsigned int        entry_size;
+    unsigned int        reserved;
+
+} CACHE_HEADER;
+
+
+typedef struct _CACHE_ENTRY
+{
+    unsigned long long  hash;
+    unsigned long long  size;
+    unsigned int        checksum;       /* zero for empty entries */
+    unsigned int        reserved;
+    unsigned int        bits[1];        /* match bitmap followed by failed precondition bitmap */
+
+} CACHE_ENTRY;
+
+
+typedef struct _RESULT_CACHE
+{
+    int                 file;
+    unsigned char*      data;
+    size_t              size;
+    unsigned int        rules_count;
+    unsigned int        words;          /* words in each of the entry's bitmaps */
+
+} RESULT_CACHE;
+
+
+unsigned long long hash_data(const unsigned char* data, size_t size);
+
+int compute_rules_fingerprint(YARA_CONTEXT* context, unsigned long long* fingerprint);
+
+int cache_open(const char* cache_path, YARA_CONTEXT* context, RESULT_CACHE** cache);
+
+void cache_close(RESULT_CACHE* cache);
+
+int cache_lookup(RESULT_CACHE* cache, unsigned long long hash, size_t size, YARA_SCANNER* scanner);
+
+void cache_store(RESULT_CACHE* cache, unsigned long long hash, size_t size, YARA_SCANNER* scanner);
+
+#endif
+
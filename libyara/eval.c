@@ -18,12 +18,21 @@ limitations under the License.
 #include "ast.h"
 #include "eval.h"
 #include "regex.h"
+#include "exe.h"
+#include "mem.h"
+#include "proc.h"
+#include "scan.h"
 
 #include <string.h>
+#include <stdlib.h>
 
 #define UNDEFINED           0xFABADAFABADALL
 #define IS_UNDEFINED(x)     ((x) == UNDEFINED)
 
+/* bytes read from the start of a process region looking for its entry point */
+
+#define ENTRY_POINT_HEADER_SIZE     4096
+
 typedef unsigned char uint8;
 typedef unsigned short uint16;
 typedef unsigned int uint32;
@@ -31,17 +40,18 @@ typedef char int8;
 typedef short int16;
 typedef int int32;
 
-#define function_read(type, tsize) long long read_##type##tsize(MEMORY_BLOCK* block, size_t offset) \
+#define function_read(type, tsize) long long read_##type##tsize(EVALUATION_CONTEXT* context, size_t offset) \
 { \
-    while (block != NULL) \
+    MEMORY_BLOCK* block = find_block(context, offset); \
+    type##tsize value; \
+    if (block != NULL && \
+        block->size >= tsize/8 && \
+        offset < block->base + block->size - (tsize/8 - 1)) \
     { \
-        if (offset >= block->base && \
-            block->size >= tsize/8 && \
-	    offset < block->base + block->size - (tsize/8 - 1)) \
-        { \
+        if (block->data != NULL) \
             return *((type##tsize *) (block->data + offset - block->base)); \
-        } \
-        block = block->next; \
+        if (read_process_memory(context->process, offset, (unsigned char*) &value, tsize/8) == tsize/8) \
+            return value; \
     } \
     return UNDEFINED; \
 };
@@ -63,6 +73,173 @@ typedef int int32;
         return op1 operator op2;\
         
 
+
+int compare_blocks(const void* a, const void* b)
+{
+    size_t base_a = (*(MEMORY_BLOCK**) a)->base;
+    size_t base_b = (*(MEMORY_BLOCK**) b)->base;
+    
+    if (base_a < base_b)
+        return -1;
+    else if (base_a > base_b)
+        return 1;
+    else
+        return 0;
+}
+
+/*
+    Builds an array with the memory blocks sorted by base address. When there's 
+    a single block, as is the case when scanning files, the index points to the
+    mem_block field itself and nothing is allocated.
+*/
+
+int build_block_index(MEMORY_BLOCK* first_block, EVALUATION_CONTEXT* context)
+{
+    MEMORY_BLOCK* block;
+    unsigned int count = 0;
+    unsigned int i;
+    int sorted = TRUE;
+    
+    context->mem_block = first_block;
+    context->last_block = NULL;
+    
+    for (block = first_block; block != NULL; block = block->next)
+    {
+        if (block->next != NULL && block->next->base < block->base)
+            sorted = FALSE;
+            
+        count++;
+    }
+    
+    if (count <= 1)
+    {
+        context->blocks = &context->mem_block;
+        context->blocks_count = count;
+        return ERROR_SUCCESS;
+    }
+    
+    context->blocks = (MEMORY_BLOCK**) yr_malloc(count * sizeof(MEMORY_BLOCK*));
+    
+    if (context->blocks == NULL)
+    {
+        context->blocks_count = 0;
+        return ERROR_INSUFICIENT_MEMORY;
+    }
+    
+    for (block = first_block, i = 0; block != NULL; block = block->next, i++)
+    {
+        context->blocks[i] = block;
+    }
+    
+    if (!sorted)
+    {
+        qsort(context->blocks, count, sizeof(MEMORY_BLOCK*), compare_blocks);
+    }
+    
+    context->blocks_count = count;
+    
+    return ERROR_SUCCESS;
+}
+
+void free_block_index(EVALUATION_CONTEXT* context)
+{
+    if (context->blocks != NULL && context->blocks != &context->mem_block)
+    {
+        yr_free(context->blocks);
+    }
+    
+    context->blocks = NULL;
+    context->blocks_count = 0;
+    context->last_block = NULL;
+}
+
+/*
+    Returns the block containing the given offset, or NULL if it isn't inside
+    any block. Consecutive reads usually fall in the same block, so the last
+    block found is checked before doing a binary search.
+*/
+
+MEMORY_BLOCK* find_block(EVALUATION_CONTEXT* context, size_t offset)
+{
+    MEMORY_BLOCK* block = context->last_block;
+    unsigned int lo, hi, mid;
+    
+    if (block != NULL && offset >= block->base && offset - block->base < block->size)
+        return block;
+    
+    lo = 0;
+    hi = context->blocks_count;
+    
+    /* find the last block whose base is lower or equal than offset */
+    
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        
+        if (context->blocks[mid]->base <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    if (lo == 0)
+        return NULL;
+        
+    block = context->blocks[lo - 1];
+    
+    if (offset - block->base >= block->size)
+        return NULL;
+        
+    context->last_block = block;
+        
+    return block;
+}
+
+/*
+    The entry point is only looked for the first time a condition asks for it,
+    most rules don't use it and looking for it means parsing the headers of 
+    every block.
+*/
+
+unsigned long long get_entry_point(EVALUATION_CONTEXT* context)
+{
+    MEMORY_BLOCK* block;
+    unsigned char header[ENTRY_POINT_HEADER_SIZE];
+    size_t length;
+    
+    if (context->entry_point_computed)
+        return context->entry_point;
+    
+    block = context->mem_block;
+    
+    while (block != NULL && context->entry_point == 0)
+    {
+        if (block->data == NULL)
+        {
+            /* a region of the process being scanned, its headers are read from it */
+            
+            length = (block->size < sizeof(header)) ? block->size : sizeof(header);
+            length = read_process_memory(context->process, block->base, header, length);
+            
+            context->entry_point = get_entry_point_address(header, length, block->base);
+        }
+        else if (context->scanning_process_memory)
+        {
+            context->entry_point = get_entry_point_address(block->data, block->size, block->base);
+        }
+        else
+        {
+            context->entry_point = get_entry_point_offset(block->data, block->size);
+        }
+        
+        block = block->next;
+    }
+    
+    context->entry_point_computed = TRUE;
+    
+    return context->entry_point;
+}
+
 function_read(uint, 8)
 function_read(uint, 16)
 function_read(uint, 32)
@@ -71,6 +248,51 @@ function_read(int, 16)
 function_read(int, 32)
 
 
+/*
+    Returns the index of the first match of the string whose offset is greater
+    or equal than the given one, or matches_count if there's no such match. 
+    Matches are sorted by offset at the end of the scan, so a binary search 
+    can be used here.
+*/
+
+unsigned int lower_bound_match(STRING* string, size_t offset)
+{
+    unsigned int lo = 0;
+    unsigned int hi = string->matches_count;
+    unsigned int mid;
+    
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        
+        if (string->matches[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    return lo;
+}
+
+
+/*
+    Returns the variable holding the value of the given one for this 
+    evaluation, which is the variable itself unless it was bound.
+*/
+
+VARIABLE* bound_variable(EVALUATION_CONTEXT* context, VARIABLE* variable)
+{
+    VARIABLE_BINDING* binding;
+    
+    for (binding = context->bindings; binding != NULL; binding = binding->next)
+    {
+        if (binding->variable == variable)
+            return &binding->value;
+    }
+    
+    return variable;
+}
+
 
 long long evaluate(TERM* term, EVALUATION_CONTEXT* context)
 {
@@ -84,7 +306,12 @@ long long evaluate(TERM* term, EVALUATION_CONTEXT* context)
 	int ovector[3];
 	int rc;
 	
+    long long cursor;
+    long long value;
+	
     STRING* string;
+    VARIABLE* variable;
+    VARIABLE_BINDING binding;
     STRING* saved_anonymous_string;
 	
 	TERM_CONST* term_const = ((TERM_CONST*) term);
@@ -97,11 +324,11 @@ long long evaluate(TERM* term, EVALUATION_CONTEXT* context)
 	
     TERM_INTEGER_FOR* term_integer_for;
 	
-	MATCH* match;
-    TERM* item;
+    int more;
     TERM_RANGE* range;
     TERM_ITERABLE* items;
 	TERM_STRING* t;
+	TERM_STRING_SET* string_set;
 	
 	switch(term->type)
 	{
@@ -112,10 +339,10 @@ long long evaluate(TERM* term, EVALUATION_CONTEXT* context)
 		return context->file_size;
 		
 	case TERM_TYPE_ENTRYPOINT:
-		return context->entry_point;
+		return get_entry_point(context);
 		
 	case TERM_TYPE_RULE:
-		return evaluate(term_binary->op1, context);
+		return evaluate_rule(SCANNER_RULE(context->scanner, ((TERM_RULE*) term)->rule), context);
 		
 	case TERM_TYPE_STRING:
 	
@@ -125,7 +352,7 @@ long long evaluate(TERM* term, EVALUATION_CONTEXT* context)
 	    }
 	    else
 	    {
-            string = term_string->string;
+            string = SCANNER_STRING(context->scanner, term_string->string);
 	    }
 	    	
 		return string->flags & STRING_FLAGS_FOUND;
@@ -138,24 +365,16 @@ long long evaluate(TERM* term, EVALUATION_CONTEXT* context)
         }
         else
         {
-            string = term_string->string;
+            string = SCANNER_STRING(context->scanner, term_string->string);
         }
 	
 		if (string->flags & STRING_FLAGS_FOUND)
 		{	
 			offs = evaluate(term_string->offset, context);
-								
-			match = string->matches_head;
 			
-			while (match != NULL)
-			{
-				if (match->offset == offs)
-					return 1;
-					
-				match = match->next;
-			}
-			
-			return 0;				
+			i = lower_bound_match(string, offs);
+								
+			return (i < string->matches_count && string->matches[i].offset == offs);
 		}
 		else return 0;
 		
@@ -167,7 +386,7 @@ long long evaluate(TERM* term, EVALUATION_CONTEXT* context)
         }
         else
         {
-            string = term_string->string;
+            string = SCANNER_STRING(context->scanner, term_string->string);
         }
 	
 		if (string->flags & STRING_FLAGS_FOUND)
@@ -180,17 +399,9 @@ long long evaluate(TERM* term, EVALUATION_CONTEXT* context)
             if (IS_UNDEFINED(lo_bound) || IS_UNDEFINED(hi_bound))
                 return 0;
 				
-			match = string->matches_head;
-
-			while (match != NULL)
-			{
-				if (match->offset >= lo_bound && match->offset <= hi_bound)
-					return 1;
+			i = lower_bound_match(string, lo_bound);
 
-				match = match->next;
-			}
-
-			return 0;				
+			return (i < string->matches_count && string->matches[i].offset <= hi_bound);
 		}
 		else return 0;
 		
@@ -199,30 +410,19 @@ long long evaluate(TERM* term, EVALUATION_CONTEXT* context)
 		
 	case TERM_TYPE_STRING_COUNT:
 	
-		i = 0;
-		
 		if (term_string->string == NULL) /* it's an anonymous string */
         {
             string = context->current_string;
         }
         else
         {
-            string = term_string->string;
+            string = SCANNER_STRING(context->scanner, term_string->string);
         }
         
-		match = string->matches_head;
-		
-		while (match != NULL)
-		{
-			i++;
-			match = match->next;
-		}
-		
-		return i;
+		return string->matches_count + string->matches_dropped;
 		
 	case TERM_TYPE_STRING_OFFSET:
 	
-        i = 1;
 	    index = evaluate(term_string->index, context);
 	
     	if (term_string->string == NULL) /* it's an anonymous string */
@@ -231,23 +431,13 @@ long long evaluate(TERM* term, EVALUATION_CONTEXT* context)
         }
         else
         {
-            string = term_string->string;
+            string = SCANNER_STRING(context->scanner, term_string->string);
         }
 	
-        match = string->matches_head;
+        if (IS_UNDEFINED(index) || index < 1 || index > string->matches_count)
+            return UNDEFINED;
         
-		while (match != NULL && i < index)
-		{
-			match = match->next;
-            i++;
-		}
-		
-		if (match != NULL && i == index)
-		{
-		    return match->offset; 
-		}   
-
-        return UNDEFINED;
+        return string->matches[index - 1].offset;
 
 
 	case TERM_TYPE_AND:
@@ -325,39 +515,41 @@ long long evaluate(TERM* term, EVALUATION_CONTEXT* context)
 		
 	case TERM_TYPE_OF:
 			
-		t = (TERM_STRING*) term_binary->op2;
+		string_set = (TERM_STRING_SET*) term_binary->op2;
 		needed = evaluate(term_binary->op1, context);
         satisfied = 0;
-        i = 0;	
-						
-		while (t != NULL)
-		{
-			if (evaluate((TERM*) t, context)) 
-			{
-				satisfied++;
-			}	
-						
-			t = t->next;
-            i++;
-		} 
-		
-		if (needed == 0)  /* needed == 0 means ALL*/
-            needed = i;
+        
+        if (needed == 0)  /* needed == 0 means ALL*/
+            needed = string_set->count;
+        
+        if (context->found_strings != NULL)
+        {
+            for (i = 0; i < string_set->words && satisfied < needed; i++)
+            {
+                satisfied += POPCOUNT(string_set->bits[i] & context->found_strings[string_set->first_word + i]);
+            }
+        }
         
         return (satisfied >= needed);
 		
 	case TERM_TYPE_STRING_FOR:
 
-        t = (TERM_STRING*) term_ternary->op2;
+        string_set = (TERM_STRING_SET*) term_ternary->op2;
+        t = string_set->head;
 		
 		needed = evaluate(term_ternary->op1, context);		
         satisfied = 0;
         i = 0;
+        
+        if (needed == 0)  /* needed == 0 means ALL*/
+            needed = string_set->items;
 
-		while (t != NULL)
+        /* stop as soon as the result is known for sure */
+        
+		while (t != NULL && satisfied < needed && satisfied + string_set->items - i >= needed)
 		{
             saved_anonymous_string = context->current_string;
-            context->current_string = t->string;
+            context->current_string = SCANNER_STRING(context->scanner, t->string);
             	    
 			if (evaluate(term_ternary->op3, context)) 
 			{
@@ -369,9 +561,6 @@ long long evaluate(TERM* term, EVALUATION_CONTEXT* context)
 			t = t->next;	
             i++;
 		} 
-		
-		if (needed == 0)  /* needed == 0 means ALL*/
-            needed = i;
         
         return (satisfied >= needed);
 	
@@ -384,21 +573,31 @@ long long evaluate(TERM* term, EVALUATION_CONTEXT* context)
         satisfied = 0;
         i = 0;    
         
-        item = items->first(items, evaluate, context);
+        /* the variable is bound instead of set, other scanners could be evaluating the same rule */
+        
+        binding.variable = term_integer_for->variable;
+        binding.value = *term_integer_for->variable;
+        binding.next = context->bindings;
+        
+        context->bindings = &binding;
         
-        while (item != NULL)
+        more = items->first(items, evaluate, context, &cursor, &value);
+        
+        while (more)
         {                
-            term_integer_for->variable->integer = evaluate(item, context);
+            binding.value.integer = value;
                                            
             if (evaluate(term_integer_for->expression, context)) 
 			{
 				satisfied++;
 			}
 						
-            item = items->next(items, evaluate, context);
+            more = items->next(items, evaluate, context, &cursor, &value);
             i++;	
         }
         
+        context->bindings = binding.next;
+        
         if (needed == 0)  /* needed == 0 means ALL*/
             needed = i;
         
@@ -406,63 +605,96 @@ long long evaluate(TERM* term, EVALUATION_CONTEXT* context)
     
     case TERM_TYPE_UINT8_AT_OFFSET:
 
-        return read_uint8(context->mem_block, evaluate(term_unary->op, context));
+        return read_uint8(context, evaluate(term_unary->op, context));
 
     case TERM_TYPE_UINT16_AT_OFFSET:
         
-        return read_uint16(context->mem_block, evaluate(term_unary->op, context));
+        return read_uint16(context, evaluate(term_unary->op, context));
         
     case TERM_TYPE_UINT32_AT_OFFSET:
 
-        return read_uint32(context->mem_block, evaluate(term_unary->op, context));
+        return read_uint32(context, evaluate(term_unary->op, context));
         
     case TERM_TYPE_INT8_AT_OFFSET:
 
-        return read_int8(context->mem_block, evaluate(term_unary->op, context));
+        return read_int8(context, evaluate(term_unary->op, context));
 
     case TERM_TYPE_INT16_AT_OFFSET:
 
-        return read_int16(context->mem_block, evaluate(term_unary->op, context));
+        return read_int16(context, evaluate(term_unary->op, context));
 
     case TERM_TYPE_INT32_AT_OFFSET:
 
-        return read_int32(context->mem_block, evaluate(term_unary->op, context));  
+        return read_int32(context, evaluate(term_unary->op, context));  
         
     case TERM_TYPE_VARIABLE:
     
-        if (term_variable->variable->type == VARIABLE_TYPE_STRING)
+        variable = bound_variable(context, term_variable->variable);
+    
+        if (variable->type == VARIABLE_TYPE_STRING)
         {
-            return ( term_variable->variable->string != NULL && *term_variable->variable->string != '\0');
+            return ( variable->string != NULL && *variable->string != '\0');
         }
-        else if (term_variable->variable->type == VARIABLE_TYPE_BOOLEAN)
+        else if (variable->type == VARIABLE_TYPE_BOOLEAN)
         {
-            return term_variable->variable->boolean;
+            return variable->boolean;
         }
         else
         {
-            return term_variable->variable->integer;
+            return variable->integer;
         }
 
     case TERM_TYPE_STRING_EQUALS:
+    
+        variable = bound_variable(context, term_string_operation->variable);
+        
         if (term_string_operation->compare_modifier == STRING_FLAGS_NO_CASE) 
-            return strcasecmp(term_string_operation->variable->string, term_string_operation->string) == 0;
+            return strcasecmp(variable->string, term_string_operation->string) == 0;
         else
-            return strcmp(term_string_operation->variable->string, term_string_operation->string) == 0;
+            return strcmp(variable->string, term_string_operation->string) == 0;
         
     case TERM_TYPE_STRING_MATCH:
+    
+        variable = bound_variable(context, term_string_operation->variable);
+        
         rc = regex_exec(&(term_string_operation->re),
                         FALSE,
-                        term_string_operation->variable->string,
-                        strlen(term_string_operation->variable->string));
+                        variable->string,
+                        strlen(variable->string));
         return (rc >= 0);
 
 	case TERM_TYPE_STRING_CONTAINS:
+	
+        variable = bound_variable(context, term_string_operation->variable);
+        
         if (term_string_operation->compare_modifier == STRING_FLAGS_NO_CASE) 
-            return (strcasestr(term_string_operation->variable->string, term_string_operation->string) != NULL);
+            return (strcasestr(variable->string, term_string_operation->string) != NULL);
         else
-            return (strstr(term_string_operation->variable->string, term_string_operation->string) != NULL);
+            return (strstr(variable->string, term_string_operation->string) != NULL);
      	
 	default:
 		return 0;
 	}
 }
+
+/*
+    Evaluates the rule's condition only once per scan, further references to 
+    the rule from other rules' conditions just read the result, which is kept
+    in the scanner's copy of the rule. Rules can only reference rules declared
+    before them, so the rule list is already sorted in dependency order and 
+    referenced rules are usually evaluated by the time they are needed.
+*/
+
+int evaluate_rule(RULE* rule, EVALUATION_CONTEXT* context)
+{
+    if (!(rule->flags & RULE_FLAGS_EVALUATED))
+    {
+        if (evaluate(rule->condition, context))
+            rule->flags |= RULE_FLAGS_CONDITION_TRUE;
+        
+        rule->flags |= RULE_FLAGS_EVALUATED;
+        context->scanner->touched_rules[context->scanner->touched_rules_count++] = rule;
+    }
+    
+    return (rule->flags & RULE_FLAGS_CONDITION_TRUE) != 0;
+}
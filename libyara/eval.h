@@ -19,20 +19,74 @@ limitations under the License.
 
 #include "yara.h"
 
+/* 
+    Values given to variables while evaluating, without changing the shared 
+    VARIABLE itself: the loop variable of each "for" being evaluated and the 
+    variables that depend on what is being scanned, like file_path. The 
+    latest binding of a variable is the first one in the list.
+*/
+
+typedef struct _VARIABLE_BINDING
+{
+    VARIABLE*                   variable;
+    VARIABLE                    value;
+    struct _VARIABLE_BINDING*   next;
+    
+} VARIABLE_BINDING;
+
 typedef struct _EVALUATION_CONTEXT
 {
 	unsigned long long    file_size;
 	unsigned long long    entry_point;
+	
+	int             entry_point_computed;
+	int             scanning_process_memory;
 
     MEMORY_BLOCK*   mem_block;
     RULE*           rule;
     STRING*         current_string;
+    
+    /* 
+        blocks sorted by base address, used by integer reads to locate the 
+        block containing a given offset without walking the whole list
+    */
+    
+    MEMORY_BLOCK**  blocks;
+    unsigned int    blocks_count;
+    MEMORY_BLOCK*   last_block;
+    
+    /* 
+        the process being scanned, its blocks have no data and integers are 
+        read from the process itself
+    */
+    
+    struct _PROCESS_MEMORY* process;
+    
+    /* 
+        bitmap of the strings found in the scan, it's NULL while no string 
+        could have been found yet, as when evaluating preconditions
+    */
+    
+    unsigned int*   found_strings;
+    
+    /* 
+        the scanner holding the rules and strings marked by the scan, rules
+        and strings in the terms are the context's and are looked up there
+    */
+    
+    struct _YARA_SCANNER* scanner;
+    
+    VARIABLE_BINDING* bindings;
 
 } EVALUATION_CONTEXT;
 
 typedef long long (*EVALUATION_FUNCTION)(TERM* term, EVALUATION_CONTEXT* context);
 
 long long evaluate(TERM* term, EVALUATION_CONTEXT* context);
+int evaluate_rule(RULE* rule, EVALUATION_CONTEXT* context);
+
+int build_block_index(MEMORY_BLOCK* first_block, EVALUATION_CONTEXT* context);
+void free_block_index(EVALUATION_CONTEXT* context);
 
 #endif
 
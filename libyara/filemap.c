@@ -26,6 +26,8 @@ limitations under the License.
 
 #include "filemap.h"
 
+#define MAP_PREFETCH_SIZE       (16 * 1024 * 1024)
+
 #ifdef WIN32
 
 //
@@ -93,24 +95,40 @@ void unmap_file(MAPPED_FILE* pmapped_file)
 
 int map_file(const char* file_path, MAPPED_FILE* pmapped_file)
 {
-    struct stat fstat;
+    int fd;
 
     if (file_path == NULL)
         return ERROR_INVALID_ARGUMENT;
-        
-    if (stat(file_path,&fstat) != 0 || S_ISDIR(fstat.st_mode)) 
-    {
-        return ERROR_COULD_NOT_OPEN_FILE;
-    }
  
-    pmapped_file->file = open(file_path, O_RDONLY);
+    fd = open(file_path, O_RDONLY);
     
-    if (pmapped_file->file == -1) 
+    if (fd == -1) 
     { 
         return ERROR_COULD_NOT_OPEN_FILE;
     }
 
-    pmapped_file->size = fstat.st_size;
+    return map_file_descriptor(fd, pmapped_file);
+}
+
+/*
+    Maps a file that is already open, saving the path lookups done by 
+    map_file when the caller has opened the file relative to a directory. 
+    The descriptor is owned by the mapped file from now on, it's closed by 
+    unmap_file or here if the mapping fails.
+*/
+
+int map_file_descriptor(int fd, MAPPED_FILE* pmapped_file)
+{
+    struct stat fstat_buffer;
+
+    if (fstat(fd, &fstat_buffer) != 0 || S_ISDIR(fstat_buffer.st_mode)) 
+    {
+        close(fd);
+        return ERROR_COULD_NOT_OPEN_FILE;
+    }
+
+    pmapped_file->file = fd;
+    pmapped_file->size = fstat_buffer.st_size;
 
     if (pmapped_file->size == 0)
     {
@@ -125,6 +143,22 @@ int map_file(const char* file_path, MAPPED_FILE* pmapped_file)
         close(pmapped_file->file);
         return ERROR_COULD_NOT_MAP_FILE;
     }
+    
+    /* 
+        the file is scanned from start to end, let the kernel read ahead 
+        aggressively and start reading the beginning of the file right now 
+        instead of waiting for the first page faults
+    */
+    
+    #ifdef MADV_SEQUENTIAL
+    madvise(pmapped_file->data, pmapped_file->size, MADV_SEQUENTIAL);
+    #endif
+    
+    #ifdef MADV_WILLNEED
+    madvise(pmapped_file->data, 
+            pmapped_file->size < MAP_PREFETCH_SIZE ? pmapped_file->size : MAP_PREFETCH_SIZE, 
+            MADV_WILLNEED);
+    #endif
 
     return ERROR_SUCCESS;
 }
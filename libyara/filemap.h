@@ -39,4 +39,8 @@ typedef struct _MAPPED_FILE
 
 int map_file(const char* file_path, MAPPED_FILE* pmapped_file);
 
+#ifndef WIN32
+int map_file_descriptor(int fd, MAPPED_FILE* pmapped_file);
+#endif
+
 void unmap_file(MAPPED_FILE* pmapped_file);
@@ -201,6 +201,9 @@ STRING* reduce_strings( yyscan_t yyscanner,
                         STRING* string_list_head, 
                         STRING* string);
 
+TERM* reduce_string_set(   yyscan_t yyscanner,
+                            TERM* string_list_head);
+                            
 TERM* reduce_string_enumeration(    yyscan_t yyscanner,
                                     TERM* string_list_head, 
                                     TERM* string_identifier);
@@ -612,8 +615,8 @@ integer_enumeration : expression
 
 
                  
-string_set  : '(' string_enumeration ')'                                { $$ = $2; }
-            | _THEM_                                                    { $$ = reduce_string_with_wildcard(yyscanner, yr_strdup("$*")); }
+string_set  : '(' string_enumeration ')'                                { $$ = reduce_string_set(yyscanner, $2); }
+            | _THEM_                                                    { $$ = reduce_string_set(yyscanner, reduce_string_with_wildcard(yyscanner, yr_strdup("$*"))); }
             ;                           
                             
 string_enumeration  : string_enumeration_item
@@ -754,7 +757,7 @@ int reduce_rule_declaration(    yyscan_t yyscanner,
     STRING*         string;
     YARA_CONTEXT*   context = yyget_extra(yyscanner);
 
-    context->last_result = new_rule(&context->rule_list, 
+    context->last_result = new_rule(context, &context->rule_list, 
                                     identifier, 
                                     context->current_namespace, 
                                     flags | context->current_rule_flags, 
@@ -792,6 +795,8 @@ int reduce_rule_declaration(    yyscan_t yyscanner,
     
     context->current_rule_flags = 0;  
     context->current_rule_strings = NULL;
+    
+    yr_free(identifier);
 
     return context->last_result;
 }
@@ -825,8 +830,9 @@ STRING* reduce_string_declaration(  yyscan_t yyscanner,
     }
     
     yr_free(str);
+    yr_free(identifier);
 
-    if (context->fast_match)
+    if (context->fast_match && string != NULL)
     {
         string->flags |= STRING_FLAGS_FAST_MATCH;
     }
@@ -867,11 +873,11 @@ META* reduce_meta_declaration(  yyscan_t yyscanner,
     META*           meta = NULL;
     YARA_CONTEXT*   context = yyget_extra(yyscanner);
     
-    meta = yr_malloc(sizeof(META));
+    meta = yr_arena_alloc(context->arena, sizeof(META));
     
     if (meta != NULL)
     {
-        meta->identifier = identifier;
+        meta->identifier = yr_arena_strdup(context->arena, identifier);
         meta->type = type;
         
         if (type == META_TYPE_INTEGER)
@@ -884,7 +890,7 @@ META* reduce_meta_declaration(  yyscan_t yyscanner,
         }
         else
         {
-            meta->string = yr_strdup(string_value->c_string);
+            meta->string = yr_arena_strdup(context->arena, string_value->c_string);
             yr_free(string_value);
         }    
     }
@@ -893,6 +899,8 @@ META* reduce_meta_declaration(  yyscan_t yyscanner,
         context->last_result = ERROR_INSUFICIENT_MEMORY;
     }
     
+    yr_free(identifier);
+    
     return meta;  
 }
 
@@ -928,11 +936,11 @@ TAG* reduce_tags(   yyscan_t yyscanner,
 
     if (lookup_tag(tag_list_head, identifier) == NULL) /* no tags with the same identifier */
     {
-        tag = yr_malloc(sizeof(TAG));
+        tag = yr_arena_alloc(context->arena, sizeof(TAG));
         
         if (tag != NULL)
         {
-            tag->identifier = identifier;
+            tag->identifier = yr_arena_strdup(context->arena, identifier);
             tag->next = tag_list_head;  
             context->last_result = ERROR_SUCCESS;
         }
@@ -941,6 +949,8 @@ TAG* reduce_tags(   yyscan_t yyscanner,
             context->last_result = ERROR_INSUFICIENT_MEMORY;
         }
         
+        yr_free(identifier);
+        
         return tag;
     }
     else
@@ -948,6 +958,7 @@ TAG* reduce_tags(   yyscan_t yyscanner,
         strncpy(context->last_error_extra_info, identifier, sizeof(context->last_error_extra_info));
         context->last_error_extra_info[sizeof(context->last_error_extra_info)-1] = 0;
         context->last_result = ERROR_DUPLICATE_TAG_IDENTIFIER;
+        yr_free(identifier);
         return NULL;
     }
 }
@@ -957,7 +968,7 @@ TERM* reduce_filesize(yyscan_t yyscanner)
     YARA_CONTEXT* context = yyget_extra(yyscanner);
     TERM* term = NULL;
     
-    context->last_result = new_simple_term(TERM_TYPE_FILESIZE, &term); 
+    context->last_result = new_simple_term(context, TERM_TYPE_FILESIZE, &term); 
     context->current_rule_flags |= RULE_FLAGS_REQUIRE_FILE;
     return (TERM*) term;    
 }
@@ -967,7 +978,7 @@ TERM* reduce_entrypoint(yyscan_t yyscanner)
     YARA_CONTEXT* context = yyget_extra(yyscanner);
     TERM* term = NULL;
     
-    context->last_result = new_simple_term(TERM_TYPE_ENTRYPOINT, &term);
+    context->last_result = new_simple_term(context, TERM_TYPE_ENTRYPOINT, &term);
     context->current_rule_flags |= RULE_FLAGS_REQUIRE_EXECUTABLE;
     return (TERM*) term;    
 }
@@ -979,15 +990,15 @@ TERM* reduce_term(yyscan_t yyscanner, int type, TERM* op1, TERM* op2, TERM* op3)
     
     if (op2 == NULL && op3 == NULL)
     {
-        context->last_result = new_unary_operation(type, op1, (TERM_UNARY_OPERATION**) &term);
+        context->last_result = new_unary_operation(context, type, op1, (TERM_UNARY_OPERATION**) &term);
     }
     else if (op3 == NULL)
     {
-        context->last_result = new_binary_operation(type, op1, op2, (TERM_BINARY_OPERATION**) &term);
+        context->last_result = new_binary_operation(context, type, op1, op2, (TERM_BINARY_OPERATION**) &term);
     }
     else
     {
-        context->last_result = new_ternary_operation(type, op1, op2, op3, (TERM_TERNARY_OPERATION**) &term);
+        context->last_result = new_ternary_operation(context, type, op1, op2, op3, (TERM_TERNARY_OPERATION**) &term);
     }
     
     return (TERM*) term;
@@ -999,7 +1010,7 @@ TERM* reduce_constant(  yyscan_t yyscanner,
     YARA_CONTEXT* context = yyget_extra(yyscanner);
     TERM_CONST* term = NULL;
     
-    context->last_result = new_constant(constant, &term); 
+    context->last_result = new_constant(context, constant, &term); 
     return (TERM*) term;
 }
 
@@ -1011,7 +1022,7 @@ TERM* reduce_string(    yyscan_t yyscanner,
     
     if (valid_string_identifier(identifier, context)) 
     {  
-        context->last_result = new_string_identifier(TERM_TYPE_STRING, context->current_rule_strings, identifier, &term);       
+        context->last_result = new_string_identifier(context, TERM_TYPE_STRING, context->current_rule_strings, identifier, &term);       
      
         if (context->last_result != ERROR_SUCCESS)
         {
@@ -1046,7 +1057,7 @@ TERM* reduce_string_with_wildcard(  yyscan_t yyscanner,
     {
         if (strncmp(string->identifier, identifier, len) == 0)
         {
-            context->last_result = new_string_identifier(TERM_TYPE_STRING, context->current_rule_strings, string->identifier, &term);
+            context->last_result = new_string_identifier(context, TERM_TYPE_STRING, context->current_rule_strings, string->identifier, &term);
             
             if (context->last_result != ERROR_SUCCESS)
                 break;
@@ -1074,7 +1085,7 @@ TERM* reduce_string_at( yyscan_t yyscanner,
     
     if (valid_string_identifier(identifier, context))  
     {  
-        context->last_result = new_string_identifier(TERM_TYPE_STRING_AT, context->current_rule_strings, identifier, &term);       
+        context->last_result = new_string_identifier(context, TERM_TYPE_STRING_AT, context->current_rule_strings, identifier, &term);       
      
         if (context->last_result != ERROR_SUCCESS)
         {
@@ -1084,6 +1095,7 @@ TERM* reduce_string_at( yyscan_t yyscanner,
         else
         {
             term->offset = offset;
+            set_string_region(term->string, offset, offset);
         }  
     }
     
@@ -1100,7 +1112,7 @@ TERM* reduce_string_in_range(   yyscan_t yyscanner,
     
     if (valid_string_identifier(identifier, context)) 
     {
-        context->last_result = new_string_identifier(TERM_TYPE_STRING_IN_RANGE, context->current_rule_strings, identifier, &term);
+        context->last_result = new_string_identifier(context, TERM_TYPE_STRING_IN_RANGE, context->current_rule_strings, identifier, &term);
     
         if (context->last_result != ERROR_SUCCESS)
         {
@@ -1110,6 +1122,9 @@ TERM* reduce_string_in_range(   yyscan_t yyscanner,
         else
         {
             term->range = range;
+            
+            if (range != NULL)
+                set_string_region(term->string, ((TERM_RANGE*) range)->min, ((TERM_RANGE*) range)->max);
         }
     }
     
@@ -1125,7 +1140,7 @@ TERM* reduce_string_in_section_by_name( yyscan_t yyscanner,
     
     if (valid_string_identifier(identifier, context))
     {
-        context->last_result = new_string_identifier(TERM_TYPE_STRING_IN_SECTION_BY_NAME, context->current_rule_strings, identifier, &term);
+        context->last_result = new_string_identifier(context, TERM_TYPE_STRING_IN_SECTION_BY_NAME, context->current_rule_strings, identifier, &term);
     
         if (context->last_result != ERROR_SUCCESS)
         {
@@ -1134,7 +1149,7 @@ TERM* reduce_string_in_section_by_name( yyscan_t yyscanner,
         }
         else
         {
-            term->section_name = yr_strdup(section_name->c_string);
+            term->section_name = yr_arena_strdup(context->arena, section_name->c_string);
         }
     }   
     
@@ -1151,7 +1166,7 @@ TERM* reduce_string_count(  yyscan_t yyscanner,
     
     if (valid_string_identifier(identifier, context))
     {
-        context->last_result = new_string_identifier(TERM_TYPE_STRING_COUNT, context->current_rule_strings, identifier, &term);
+        context->last_result = new_string_identifier(context, TERM_TYPE_STRING_COUNT, context->current_rule_strings, identifier, &term);
             
         if (context->last_result != ERROR_SUCCESS)
         {
@@ -1173,7 +1188,7 @@ TERM* reduce_string_offset( yyscan_t yyscanner,
 
     if (valid_string_identifier(identifier, context))
     {
-        context->last_result = new_string_identifier(TERM_TYPE_STRING_OFFSET, context->current_rule_strings, identifier, &term);
+        context->last_result = new_string_identifier(context, TERM_TYPE_STRING_OFFSET, context->current_rule_strings, identifier, &term);
     
         if (context->last_result != ERROR_SUCCESS)
         {
@@ -1201,7 +1216,7 @@ TERM* reduce_identifier(    yyscan_t yyscanner,
         
     if (rule != NULL)
     {
-        context->last_result = new_binary_operation(TERM_TYPE_RULE, rule->condition, NULL, (TERM_BINARY_OPERATION**) &term);        
+        context->last_result = new_rule_reference(context, rule, (TERM_RULE**) &term);
     }
     else
     {
@@ -1225,6 +1240,20 @@ TERM* reduce_string_enumeration(    yyscan_t yyscanner,
     return string_identifier;
 }
 
+TERM* reduce_string_set(   yyscan_t yyscanner,
+                            TERM* string_list_head)
+{
+    YARA_CONTEXT* context = yyget_extra(yyscanner);
+    TERM_STRING_SET* term = NULL;
+    
+    if (string_list_head != NULL)
+    {
+        context->last_result = new_string_set(context, (TERM_STRING*) string_list_head, &term);
+    }
+    
+    return (TERM*) term;
+}
+
 TERM* reduce_string_operation( yyscan_t yyscanner,
                                         int type,
                                         char* identifier,
@@ -1244,7 +1273,7 @@ TERM* reduce_string_operation( yyscan_t yyscanner,
     {
         if (variable->type == VARIABLE_TYPE_STRING)
         {    
-            term = (TERM_STRING_OPERATION*) yr_malloc(sizeof(TERM_STRING_OPERATION));
+            term = (TERM_STRING_OPERATION*) yr_arena_alloc(context->arena, sizeof(TERM_STRING_OPERATION));
             
             if (term != NULL)
             {
@@ -1261,14 +1290,17 @@ TERM* reduce_string_operation( yyscan_t yyscanner,
                                       sizeof(context->last_error_extra_info),
                                       &erroffset) <= 0)
                     {
-                        yr_free(term);
                         term = NULL;
                         context->last_result = ERROR_INVALID_REGULAR_EXPRESSION;
                     }
+                    else
+                    {
+                        context->last_result = remember_regexp(context, &(term->re));
+                    }
                 }
                 else
                 {
-                    term->string = yr_strdup(string->c_string);
+                    term->string = yr_arena_strdup(context->arena, string->c_string);
                 }
                                 
                 yr_free(string);             
@@ -1312,7 +1344,7 @@ TERM* reduce_integer_enumeration(   yyscan_t yyscanner,
     }
     else
     {
-        context->last_result = new_vector(&vector);
+        context->last_result = new_vector(context, &vector);
         
         if (context->last_result == ERROR_SUCCESS)
             context->last_result = add_term_to_vector(vector, term1);
@@ -1336,7 +1368,7 @@ TERM* reduce_integer_for(   yyscan_t yyscanner,
     
     variable = lookup_variable(context->variables, identifier);
     
-    term = (TERM_INTEGER_FOR*) yr_malloc(sizeof(TERM_INTEGER_FOR));
+    term = (TERM_INTEGER_FOR*) yr_arena_alloc(context->arena, sizeof(TERM_INTEGER_FOR));
     
     if (term != NULL)
     {
@@ -1363,7 +1395,7 @@ TERM* reduce_range( yyscan_t yyscanner,
     YARA_CONTEXT* context = yyget_extra(yyscanner);
     TERM_RANGE* term = NULL;
     
-    context->last_result = new_range(min, max, &term);
+    context->last_result = new_range(context, min, max, &term);
              
     return (TERM*) term;    
 }
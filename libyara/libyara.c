@@ -16,7 +16,12 @@ limitations under the License.
 
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
+#include <pthread.h>
+#include <sched.h>
+
+#include "cache.h"
 #include "filemap.h"
 #include "mem.h"
 #include "eval.h"
@@ -27,75 +32,142 @@ limitations under the License.
 #include "regex.h"
 #include "yara.h"
 #include "scan.h"
+#include "ast.h"
 
 #ifdef WIN32
 #define snprintf _snprintf
 #endif
 
 // global thread variables
-pthread_mutex_t match_lock;
 int thread_count = 1; // default to using a single cpu/core
-int scan_by_line = FALSE;
 
-void threaded_scan(void * args) 
+/* 
+    process memory is scanned in chunks of this size, consecutive chunks of a 
+    region overlap by the longest span of the strings, see yr_scanner_scan_proc
+*/
+
+#define PROCESS_CHUNK_SIZE      0x400000
+
+/*
+    Returns the offset where the record starting at start ends, the record 
+    includes its delimiter.
+*/
+
+size_t record_end(YARA_CONTEXT* context, unsigned char* buffer, size_t buffer_size, size_t start)
+{
+    unsigned char* delimiter;
+    
+    if (context->record_size > 0)
+        return (buffer_size - start > context->record_size) ? start + context->record_size : buffer_size;
+    
+    delimiter = (unsigned char*) memchr(buffer + start, context->record_delimiter, buffer_size - start);
+    
+    return (delimiter != NULL) ? (size_t) (delimiter - buffer) + 1 : buffer_size;
+}
+
+/*
+    Searches the strings starting at the offsets of the block assigned to 
+    the thread. When scanning records the search is bounded by the record 
+    each offset belongs to, so anchors, fullword checks and matches of 
+    variable length see the record as if it was scanned alone, and the last 
+    byte of each record is not searched, as the last one of a block.
+*/
+
+void* threaded_scan(void * args) 
 {
     THREADED_SCAN_ARGS * tscan_args = (THREADED_SCAN_ARGS *)args;
     int i;
     int error;
 
     MEMORY_BLOCK * block = tscan_args->block;
-    YARA_CONTEXT * context = tscan_args->context;
+    YARA_SCANNER * scanner = tscan_args->scanner;
+    YARA_CONTEXT * context = scanner->context;
+    
+    size_t start = 0;
+    size_t end = block->size;
+    
+    if (tscan_args->records)
+        end = record_end(context, block->data, block->size, 0);
 
-    for (i = tscan_args->thread_index; i < block->size - 1; i += thread_count)
-    {		    
+    for (i = tscan_args->thread_index; i < tscan_args->limit; i += tscan_args->threads_count)
+    {
+        while (i >= end)
+        {
+            start = end;
+            end = record_end(context, block->data, block->size, start);
+        }
+        
+        if (i + 1 >= end)
+            continue;
+        
         /* search for normal strings */	
         error = find_matches(   block->data[i], 
                                 block->data[i + 1], 
                                 block->data + i, 
-                                block->size - i, 
+                                end - i, 
                                 block->base + i, 
                                 STRING_FLAGS_HEXADECIMAL | STRING_FLAGS_ASCII, 
-                                i, 
-                                context);
+                                i - start, 
+                                scanner);
     
         if (error != ERROR_SUCCESS)
-            pthread_exit(NULL);
-            //return error;
+            return NULL;
     
         /* search for wide strings */
-        if ((block->data[i + 1] == 0) && (block->size > 3) && (i < block->size - 3) && (block->data[i + 3] == 0))
+        if ((block->data[i + 1] == 0) && (end - i > 3) && (block->data[i + 3] == 0))
         {
             error = find_matches(   block->data[i], 
                                     block->data[i + 2], 
                                     block->data + i, 
-                                    block->size - i, 
+                                    end - i, 
                                     block->base + i, 
                                     STRING_FLAGS_WIDE, 
-                                    i, 
-                                    context);
+                                    i - start, 
+                                    scanner);
         
             if (error != ERROR_SUCCESS)
-                pthread_exit(NULL);
-                //return error;
+                return NULL;
         }	
     }
-
-    pthread_exit(NULL);
+    
+    return NULL;
 }
 
 void yr_init()
 {
     yr_heap_alloc();
+    init_scan_tables();
 }
 
 YARA_CONTEXT* yr_create_context()
 {
     YARA_CONTEXT* context = (YARA_CONTEXT*) yr_malloc(sizeof(YARA_CONTEXT));
     
+    if (context == NULL)
+        return NULL;
+    
+    context->arena = yr_arena_create();
+    
+    if (context->arena == NULL)
+    {
+        yr_free(context);
+        return NULL;
+    }
+    
+    context->regexps = NULL;
     context->rule_list.head = NULL;
     context->rule_list.tail = NULL;
-    context->hash_table.non_hashed_strings = NULL;
+    context->rule_list.count = 0;
+    context->hash_table.offsets = NULL;
+    context->hash_table.entries = NULL;
+    context->hash_table.entries_count = 0;
+    context->hash_table.descriptors = NULL;
+    context->hash_table.descriptors_count = 0;
+    context->hash_table.owners = NULL;
     context->hash_table.populated = FALSE;
+    context->delta_table = context->hash_table;
+    context->indexed_rules = 0;
+    context->delta_rules = 0;
     context->errors = 0;
     context->error_report_function = NULL;
     context->last_error = ERROR_SUCCESS;
@@ -106,16 +178,28 @@ YARA_CONTEXT* yr_create_context()
     context->current_rule_strings = NULL;
     context->current_rule_flags = 0;
     context->inside_for = 0;
+    context->strings_count = 0;
+    context->namespaces_count = 0;
 	context->namespaces = NULL;
 	context->variables = NULL;
     context->allow_includes = TRUE;
 	context->current_namespace = yr_create_namespace(context, "default");
 	context->fast_match = FALSE;
-    context->scanning_process_memory = FALSE;
+    context->result_cache = NULL;
+    context->version = NULL;
+    context->record_delimiter = -1;
+    context->record_size = 0;
+    context->scanner = NULL;
+    context->search_threads = 0;
+    context->region_flags = REGION_FLAGS_READ;
+    context->region_path = NULL;
+    context->process_timeout = 0;
+    context->process_memory_limit = 0;
+    context->max_string_matches = DEFAULT_MAX_STRING_MATCHES;
+    context->match_memory_limit = 0;
+    context->warning_function = NULL;
 
     memset(context->rule_list.hash_table, 0, sizeof(context->rule_list.hash_table));
-    memset(context->hash_table.hashed_strings_2b, 0, sizeof(context->hash_table.hashed_strings_2b));
-    memset(context->hash_table.hashed_strings_1b, 0, sizeof(context->hash_table.hashed_strings_1b));
 
     // initialize predefined variables
     yr_define_string_variable(context, PREDEFINED_VAR_FILE_PATH, "");
@@ -125,112 +209,29 @@ YARA_CONTEXT* yr_create_context()
     
 }
 
+/*
+    Everything built when compiling the rules is freed along with the 
+    context's arena, only the compiled regular expressions, the scanner used
+    by the yr_scan_* functions and the external variables are freed one by 
+    one. Scanners created with yr_create_scanner must be destroyed before.
+*/
+
 void yr_destroy_context(YARA_CONTEXT* context)
 {
-    RULE* rule;
-    RULE* next_rule;
-    STRING* string;
-    STRING* next_string;
-    META* meta;
-    META* next_meta;
-    MATCH* match;
-    MATCH* next_match;
-	TAG* tag;
-	TAG* next_tag;
-	NAMESPACE* ns;
-	NAMESPACE* next_ns;
+    REGEXP_LIST_ENTRY* regexp;
     VARIABLE* variable;
 	VARIABLE* next_variable;
-    RULE_LIST_ENTRY* rule_list_entry;
-    RULE_LIST_ENTRY* next_rule_list_entry;
-	
-    int i;
     
-    rule = context->rule_list.head;
+    for (regexp = context->regexps; regexp != NULL; regexp = regexp->next)
+    {
+        regex_free(regexp->re);
+    }
     
-    while (rule != NULL)
-    {        
-        next_rule = rule->next;
-        
-        string = rule->string_list_head;
-        
-        while (string != NULL)
-        {
-            next_string = string->next;
-            
-			yr_free(string->identifier);
-            yr_free(string->string);
-            
-            if (IS_HEX(string))
-            {   
-                yr_free(string->mask);
-            }
-            else if (IS_REGEXP(string))
-            {
-                regex_free(&(string->re));
-            }
-            
-            match = string->matches_head;
-            
-            while (match != NULL)
-            {
-                next_match = match->next;
-                yr_free(match->data);
-                yr_free(match);
-                match = next_match;
-            }
-            
-            yr_free(string);
-            string = next_string;
-        }
-
-		tag = rule->tag_list_head;
-
-		while (tag != NULL)
-		{
-			next_tag = tag->next;
-			
-			yr_free(tag->identifier);
-			yr_free(tag);
-			
-			tag = next_tag;
-		}
-		
-		meta = rule->meta_list_head;
-
-		while (meta != NULL)
-		{
-			next_meta = meta->next;
-			
-			if (meta->type == META_TYPE_STRING)
-			{
-                yr_free(meta->string);
-			}
-			
-			yr_free(meta->identifier);
-			yr_free(meta);
-			
-			meta = next_meta;
-		}
-        
-        free_term(rule->condition);
-        yr_free(rule->identifier);    
-        yr_free(rule);
-        rule = next_rule;
+    if (context->scanner != NULL)
+    {
+        yr_destroy_scanner(context->scanner);
     }
 	
-	ns = context->namespaces;
-
-	while(ns != NULL)
-	{
-		next_ns = ns->next;
-		
-		yr_free(ns->name);
-		yr_free(ns);
-		
-		ns = next_ns;
-	}
-	
 	variable = context->variables;
 
 	while(variable != NULL)
@@ -253,32 +254,23 @@ void yr_destroy_context(YARA_CONTEXT* context)
         yr_pop_file_name(context);
     }
     
-    for(i = 0; i < RULE_LIST_HASH_TABLE_SIZE; i++)
-    {
-        rule_list_entry = context->rule_list.hash_table[i].next;
-        
-        while(rule_list_entry != NULL)
-        {
-            next_rule_list_entry = rule_list_entry->next;
-            yr_free(rule_list_entry);
-            
-            rule_list_entry = next_rule_list_entry;
-        }
-    }
+    yr_close_result_cache(context);
+    free_hash_table(&context->hash_table);
+    free_hash_table(&context->delta_table);
+    yr_arena_destroy(context->arena);
     
-    clear_hash_table(&context->hash_table);
 	yr_free(context);
 }
 
 
 NAMESPACE* yr_create_namespace(YARA_CONTEXT* context, const char* name)
 {
-	NAMESPACE* ns = yr_malloc(sizeof(NAMESPACE));
+	NAMESPACE* ns = yr_arena_alloc(context->arena, sizeof(NAMESPACE));
 	
 	if (ns != NULL)
 	{
-		ns->name = yr_strdup(name);
-		ns->global_rules_satisfied = FALSE;
+		ns->name = yr_arena_strdup(context->arena, name);
+		ns->index = context->namespaces_count++;
 		ns->next = context->namespaces;
 		context->namespaces = ns;
 	}
@@ -507,295 +499,2331 @@ int yr_compile_string(const char* rules_string, YARA_CONTEXT* context)
     return parse_rules_string(rules_string, context);
 }
 
-int yr_scan_mem_blocks(MEMORY_BLOCK* block, YARA_CONTEXT* context, YARACALLBACK callback, void* user_data)
-{
-    int error;
-    int global_rules_satisfied;
-	unsigned int i;	
-	int is_executable;
-    int is_file;
-    int all_preconditions_failed = TRUE;
-	
-	RULE* rule;
-	NAMESPACE* ns;
-	EVALUATION_CONTEXT eval_context;
-
-    // thread variables
-    pthread_t * threads = NULL;
-	
-	if (block->size < 2)
-        return ERROR_SUCCESS;
-
-	if (!context->hash_table.populated)
-	{
-        populate_hash_table(&context->hash_table, &context->rule_list);
-	}
-	
-	eval_context.file_size = block->size;
-    eval_context.mem_block = block;
-    eval_context.entry_point = 0;
-	
-    is_executable = is_pe(block->data, block->size) || is_elf(block->data, block->size) || context->scanning_process_memory;
-    is_file = !context->scanning_process_memory;
+/*
+    What merge_term needs to know about the merge. Before applying the 
+    changes it's only checked that no variable's identifier is the name of a
+    rule in context, as it would have been a reference to that rule if 
+    compiled there.
+*/
 
-    yr_define_boolean_variable(context, PREDEFINED_VAR_IS_EXECUTABLE, is_executable);
+typedef struct _MERGE_STATE
+{
+    YARA_CONTEXT*   context;
+    YARA_CONTEXT*   other;
+    NAMESPACE*      ns;
+    int             apply;
+    
+} MERGE_STATE;
 
-	clear_marks(&context->rule_list);
 
-    // evaluate precondition for each rule
-	rule = context->rule_list.head;
-    while (rule != NULL)
+int merge_variable(MERGE_STATE* state, VARIABLE** variable)
+{
+    VARIABLE* found;
+    VARIABLE** link;
+    
+    if (*variable == NULL)
+        return ERROR_SUCCESS;
+    
+    if (!state->apply)
     {
-        if (rule->precondition != NULL)
-            if (evaluate(rule->precondition, &eval_context) == 0) 
-                rule->flags |= RULE_FLAGS_FAILED_PRECONDITION;
-            else
-                all_preconditions_failed = FALSE;
-        else
-            all_preconditions_failed = FALSE;
-
-        rule = rule->next;
+        if (lookup_rule(&state->context->rule_list, (*variable)->identifier, state->ns) != NULL)
+        {
+            strncpy(state->context->last_error_extra_info, (*variable)->identifier, sizeof(state->context->last_error_extra_info) - 1);
+            state->context->last_error_extra_info[sizeof(state->context->last_error_extra_info)-1] = 0;
+            return ERROR_AMBIGUOUS_IDENTIFIER;
+        }
+        
+        return ERROR_SUCCESS;
     }
-
-    // if all the preconditions failed then we're done
-    if (all_preconditions_failed)
+    
+    found = lookup_variable(state->context->variables, (*variable)->identifier);
+    
+    if (found != NULL)
     {
-        //printf("all preconditions failed\n");
+        *variable = found;
         return ERROR_SUCCESS;
     }
-	
-	while (block != NULL)
-	{
-	    if (eval_context.entry_point == 0)
-	    {
-	        if (context->scanning_process_memory)
-	        {
-	            eval_context.entry_point = get_entry_point_address(block->data, block->size, block->base);
-	        }
-	        else
-	        {
-	            eval_context.entry_point = get_entry_point_offset(block->data, block->size);
-            }
-        }
-
-        pthread_mutex_init(&match_lock, NULL);
-        
-        // array to store thread handles
-        threads = (pthread_t *)malloc(sizeof(pthread_t) * thread_count);
-
-        for (i = 0; i < thread_count && i < block->size - 1; i++) 
-        {
-            THREADED_SCAN_ARGS * args = (THREADED_SCAN_ARGS *)malloc(sizeof(THREADED_SCAN_ARGS));
-            args->thread_index = i;
-            args->block = block;
-            args->context = context;
-
-            //attr = pth_attr_new();
-            //pth_attr_set(attr, PTH_ATTR_NAME, "threaded_scanner");
-            //pth_attr_set(attr, PTH_ATTR_STACK_SIZE, 64 * 1024);
-            //pth_attr_set(attr, PTH_ATTR_JOINABLE, FALSE);
-            pthread_create(&threads[i], NULL, threaded_scan, args);
-        }
-
-        // wait for all the threads to finish
-        for (i = 0; i < thread_count; i++)
+    
+    /* not defined in context, like loop variables, move it there */
+    
+    for (link = &state->other->variables; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == *variable)
         {
-            pthread_join(threads[i], NULL);
+            *link = (*variable)->next;
+            break;
         }
-    	
-        block = block->next;
     }
-	
-	rule = context->rule_list.head;
-	
-	/* initialize global rules flag for all namespaces */
-	
-	ns = context->namespaces;
-	
-	while(ns != NULL)
-	{
-		ns->global_rules_satisfied = TRUE;
-		ns = ns->next;
-	}
-	
-	/* evaluate global rules */
-	
-	while (rule != NULL)
-	{	
-		if (rule->flags & RULE_FLAGS_GLOBAL)
-		{
-            if (! (rule->flags & RULE_FLAGS_FAILED_PRECONDITION))
-            {
-                eval_context.rule = rule;
-                
-                if (evaluate(rule->condition, &eval_context))
-                {
-                    rule->flags |= RULE_FLAGS_MATCH;
-                }
-                else
-                {
-                    rule->ns->global_rules_satisfied = FALSE;
-                }
-                
-                if (!(rule->flags & RULE_FLAGS_PRIVATE))
-                {
-                    if (callback(rule, user_data) != 0)
-                    {
-                        return ERROR_CALLBACK_ERROR;
-                    }
-                }
-            }
-		}
-			
-		rule = rule->next;
-	}
-	
-	/* evaluate the rest of the rules rules */
-
-	rule = context->rule_list.head;
-	
-	while (rule != NULL)
-	{
-		/* 
-		   skip global rules, privates rules, rules that don't need to be
-		   evaluated due to some global rule unsatisfied in it's namespace,
-           and rules that have failed the precondition
-		*/
-		
-		if (rule->flags & RULE_FLAGS_GLOBAL || rule->flags & RULE_FLAGS_PRIVATE || !rule->ns->global_rules_satisfied
-            || rule->flags & RULE_FLAGS_FAILED_PRECONDITION)  
-		{
-			rule = rule->next;
-			continue;
-		}
-
-	  
-		if ((is_executable  || !(rule->flags & RULE_FLAGS_REQUIRE_EXECUTABLE)) &&
-		    (is_file        || !(rule->flags & RULE_FLAGS_REQUIRE_FILE)))
-		{
-		    eval_context.rule = rule;
-		    
-		    if (evaluate(rule->condition, &eval_context))
-    		{
-                rule->flags |= RULE_FLAGS_MATCH;
-    		}
-		}
-		
-		switch (callback(rule, user_data))
-		{
-		    case CALLBACK_ABORT:
-                return ERROR_SUCCESS;
-                
-            case CALLBACK_ERROR:
-                return ERROR_CALLBACK_ERROR;
-		}
-		
-		rule = rule->next;
-	}
-	
-	return ERROR_SUCCESS;
+    
+    (*variable)->next = state->context->variables;
+    state->context->variables = *variable;
+    
+    return ERROR_SUCCESS;
 }
 
-int yr_scan_mem(unsigned char* buffer, size_t buffer_size, YARA_CONTEXT* context, YARACALLBACK callback, void* user_data)
+
+int merge_term(TERM* term, void* data)
 {
-    MEMORY_BLOCK block;
+    MERGE_STATE* state = (MERGE_STATE*) data;
     
-    block.data = buffer;
-    block.size = buffer_size;
-    block.base = 0;
-    block.next = NULL;
+    switch(term->type)
+    {
+    case TERM_TYPE_STRING_SET:
+    
+        /* the strings got new indexes, the bitmap must follow them */
+    
+        if (state->apply)
+            return fill_string_set(state->context, (TERM_STRING_SET*) term);
+            
+        break;
+        
+    case TERM_TYPE_INTEGER_FOR:
+    
+        /* the loop variable itself is never taken for a rule */
+    
+        if (state->apply)
+            return merge_variable(state, &((TERM_INTEGER_FOR*) term)->variable);
+            
+        break;
+        
+    case TERM_TYPE_VARIABLE:
+        return merge_variable(state, &((TERM_VARIABLE*) term)->variable);
+        
+    case TERM_TYPE_STRING_MATCH:
+    case TERM_TYPE_STRING_CONTAINS:
+    case TERM_TYPE_STRING_EQUALS:
+    
+        if (state->apply)
+            return merge_variable(state, &((TERM_STRING_OPERATION*) term)->variable);
+            
+        break;
+    }
     
-    return yr_scan_mem_blocks(&block, context, callback, user_data);
+    return ERROR_SUCCESS;
 }
 
-int yr_scan_file(const char* file_path, YARA_CONTEXT* context, YARACALLBACK callback, void* user_data)
-{
-	MAPPED_FILE mfile;
-	int result;
-    char * start = NULL;
-    char * stop = NULL;
-
-    result = map_file(file_path, &mfile);
-	
-	if (result == ERROR_SUCCESS)
-	{
-        yr_define_string_variable(context, PREDEFINED_VAR_FILE_PATH, file_path);
+/*
+    Moves the rules compiled in other into context, leaving them as if they 
+    had been compiled in context after the rules it already has. Their rules
+    and strings are numbered again, their variables are replaced by the ones
+    with the same identifier in context and their memory is handed to the 
+    arena of context. This lets independent rule files be compiled in 
+    parallel, each in a context of its own, and merged afterwards.
+    
+    Both contexts must have the same external variables defined, and other
+    must not have been used for scanning. Nothing is moved if a rule of other
+    is already in context or if other uses as a variable an identifier that
+    is a rule in context; compiling those rules in context instead reports 
+    the right error or produces the right reference. Afterwards other has 
+    no rules but it must still be destroyed.
+    
+    Once the rules start being moved it can only fail for lack of memory.
+    The rules moved until then stay in context and the others are dropped, 
+    so context can't be given those rules again and is better destroyed.
+*/
 
-        // default is to scan the entire file
-        if (! scan_by_line)
-        {
-            result = yr_scan_mem(mfile.data, mfile.size, context, callback, user_data);
-            unmap_file(&mfile);
+int yr_merge_context(YARA_CONTEXT* context, YARA_CONTEXT* other)
+{
+    RULE* rule;
+    RULE* next_rule;
+    STRING* string;
+    NAMESPACE* ns;
+    REGEXP_LIST_ENTRY* regexp;
+    MERGE_STATE state;
+    
+    unsigned int rules_base = context->rule_list.count;
+    unsigned int strings_base = context->strings_count;
+    int result = ERROR_SUCCESS;
+    
+    state.context = context;
+    state.other = other;
+    state.apply = FALSE;
+    
+    for (rule = other->rule_list.head; rule != NULL && result == ERROR_SUCCESS; rule = rule->next)
+    {
+        state.ns = rule->ns;
+        
+        if (lookup_rule(&context->rule_list, rule->identifier, rule->ns) != NULL)
+        {
+            strncpy(context->last_error_extra_info, rule->identifier, sizeof(context->last_error_extra_info) - 1);
+            context->last_error_extra_info[sizeof(context->last_error_extra_info)-1] = 0;
+            result = ERROR_DUPLICATE_RULE_IDENTIFIER;
+        }
+        
+        if (result == ERROR_SUCCESS)
+            result = walk_term(rule->precondition, merge_term, &state);
+        
+        if (result == ERROR_SUCCESS)
+            result = walk_term(rule->condition, merge_term, &state);
+    }
+    
+    if (result != ERROR_SUCCESS)
+    {
+        context->last_error = result;
+        return result;
+    }
+    
+    state.apply = TRUE;
+    rule = other->rule_list.head;
+    
+    while (rule != NULL && result == ERROR_SUCCESS)
+    {
+        next_rule = rule->next;
+        ns = lookup_namespace(context->namespaces, rule->ns->name);
+        
+        if (ns == NULL)
+            ns = yr_create_namespace(context, rule->ns->name);
+            
+        if (ns == NULL)
+        {
+            result = ERROR_INSUFICIENT_MEMORY;
+            break;
+        }
+        
+        rule->ns = ns;
+        rule->index += rules_base;
+        
+        for (string = rule->string_list_head; string != NULL; string = string->next)
+        {
+            string->index += strings_base;
+        }
+        
+        state.ns = ns;
+        result = walk_term(rule->precondition, merge_term, &state);
+        
+        if (result == ERROR_SUCCESS)
+            result = walk_term(rule->condition, merge_term, &state);
+        
+        if (result == ERROR_SUCCESS)
+            result = add_rule(context, &context->rule_list, rule);
+        
+        rule = next_rule;
+    }
+    
+    context->rule_list.count += other->rule_list.count;
+    context->strings_count += other->strings_count;
+    
+    if (other->regexps != NULL)
+    {
+        for (regexp = other->regexps; regexp->next != NULL; regexp = regexp->next);
+        
+        regexp->next = context->regexps;
+        context->regexps = other->regexps;
+    }
+    
+    yr_arena_merge(context->arena, other->arena);
+    
+    other->regexps = NULL;
+    other->rule_list.head = NULL;
+    other->rule_list.tail = NULL;
+    other->rule_list.count = 0;
+    other->strings_count = 0;
+    other->namespaces = NULL;
+    other->current_namespace = NULL;
+    
+    free_hash_table(&other->hash_table);
+    free_hash_table(&other->delta_table);
+    
+    memset(other->rule_list.hash_table, 0, sizeof(other->rule_list.hash_table));
+    
+    if (result != ERROR_SUCCESS)
+        context->last_error = result;
+    
+    return result;
+}
+
+
+int references_rule(TERM* term, void* data)
+{
+    if (term->type == TERM_TYPE_RULE && ((TERM_RULE*) term)->rule == (RULE*) data)
+        return ERROR_RULE_REFERENCED;
+        
+    return ERROR_SUCCESS;
+}
+
+/*
+    Tells if any rule other than the given one has it in its precondition or
+    condition, in which case it can't be taken out of the rule list.
+*/
+
+int is_rule_referenced(YARA_CONTEXT* context, RULE* rule)
+{
+    RULE* r;
+    
+    for (r = context->rule_list.head; r != NULL; r = r->next)
+    {
+        if (r != rule && 
+            (walk_term(r->precondition, references_rule, rule) != ERROR_SUCCESS ||
+             walk_term(r->condition, references_rule, rule) != ERROR_SUCCESS))
+        {
+            strncpy(context->last_error_extra_info, rule->identifier, sizeof(context->last_error_extra_info) - 1);
+            context->last_error_extra_info[sizeof(context->last_error_extra_info)-1] = 0;
+            context->last_error = ERROR_RULE_REFERENCED;
+            return TRUE;
+        }
+    }
+    
+    return FALSE;
+}
+
+
+RULE* find_rule(YARA_CONTEXT* context, const char* ns, const char* identifier)
+{
+    NAMESPACE* rule_ns = lookup_namespace(context->namespaces, ns);
+    RULE* rule = NULL;
+    
+    if (rule_ns != NULL)
+        rule = lookup_rule(&context->rule_list, identifier, rule_ns);
+    
+    if (rule == NULL)
+    {
+        strncpy(context->last_error_extra_info, identifier, sizeof(context->last_error_extra_info) - 1);
+        context->last_error_extra_info[sizeof(context->last_error_extra_info)-1] = 0;
+        context->last_error = ERROR_UNDEFINED_IDENTIFIER;
+    }
+    
+    return rule;
+}
+
+/*
+    Compiles rules_string in namespace ns. If it has errors the rules compiled 
+    from it before the first one are taken out again, leaving the rule list 
+    as it was.
+*/
+
+int compile_rules_in_namespace(YARA_CONTEXT* context, const char* ns, const char* rules_string)
+{
+    NAMESPACE* current_namespace = context->current_namespace;
+    RULE* tail = context->rule_list.tail;
+    RULE* rule;
+    RULE* next_rule;
+    int errors = context->errors;
+    
+    context->current_namespace = lookup_namespace(context->namespaces, ns);
+    
+    if (context->current_namespace == NULL)
+        context->current_namespace = yr_create_namespace(context, ns);
+    
+    if (context->current_namespace == NULL)
+    {
+        context->current_namespace = current_namespace;
+        return ERROR_INSUFICIENT_MEMORY;
+    }
+    
+    yr_compile_string(rules_string, context);
+    
+    context->current_namespace = current_namespace;
+    
+    if (context->errors == errors)
+        return ERROR_SUCCESS;
+        
+    rule = (tail != NULL) ? tail->next : context->rule_list.head;
+    
+    while (rule != NULL)
+    {
+        next_rule = rule->next;
+        remove_rule(&context->rule_list, rule);
+        rule = next_rule;
+    }
+    
+    return context->last_error;
+}
+
+/*
+    Functions for changing the rules of a context that may have been used for
+    scanning already. The strings of the rules added are put in the delta 
+    table the next time the context is used for scanning, and the ones of the 
+    rules removed are taken out of the hash tables, so the strings of the 
+    other rules are not indexed again. The result cache is closed if the 
+    rules change.
+    
+    The context can't be scanning while its rules are changed. Rules that
+    are referenced by other rules can't be removed or replaced. The rules of 
+    contexts published in a YARA_RULES are changed with yr_update_rules.
+*/
+
+static int add_rules(YARA_CONTEXT* context, const char* ns, const char* rules_string)
+{
+    int result = compile_rules_in_namespace(context, ns, rules_string);
+    
+    if (result == ERROR_SUCCESS)
+        yr_close_result_cache(context);
+        
+    return result;
+}
+
+
+static int delete_rule(YARA_CONTEXT* context, const char* ns, const char* identifier)
+{
+    RULE* rule = find_rule(context, ns, identifier);
+    
+    if (rule == NULL)
+        return ERROR_UNDEFINED_IDENTIFIER;
+    
+    if (is_rule_referenced(context, rule))
+        return ERROR_RULE_REFERENCED;
+        
+    remove_rule(&context->rule_list, rule);
+    unindex_rule(context, rule);
+    yr_close_result_cache(context);
+    
+    return ERROR_SUCCESS;
+}
+
+/*
+    Replaces a rule by the ones in rules_string, which usually is a new 
+    version of the same rule. If rules_string has errors the old rule is 
+    kept where it was in the rule list.
+*/
+
+static int replace_rule(YARA_CONTEXT* context, const char* ns, const char* identifier, const char* rules_string)
+{
+    RULE* rule = find_rule(context, ns, identifier);
+    RULE* previous;
+    int result;
+    
+    if (rule == NULL)
+        return ERROR_UNDEFINED_IDENTIFIER;
+    
+    if (is_rule_referenced(context, rule))
+        return ERROR_RULE_REFERENCED;
+    
+    previous = remove_rule(&context->rule_list, rule);
+    
+    result = compile_rules_in_namespace(context, ns, rules_string);
+    
+    if (result == ERROR_SUCCESS)
+    {
+        unindex_rule(context, rule);
+        yr_close_result_cache(context);
+    }
+    else if (insert_rule(context, &context->rule_list, rule, previous) != ERROR_SUCCESS)
+    {
+        unindex_rule(context, rule);
+        yr_close_result_cache(context);
+    }
+    
+    return result;
+}
+
+
+int yr_add_rules(YARA_CONTEXT* context, const char* ns, const char* rules_string)
+{
+    if (context->version != NULL)
+        return ERROR_INVALID_ARGUMENT;
+        
+    return add_rules(context, ns, rules_string);
+}
+
+
+int yr_remove_rule(YARA_CONTEXT* context, const char* ns, const char* identifier)
+{
+    if (context->version != NULL)
+        return ERROR_INVALID_ARGUMENT;
+        
+    return delete_rule(context, ns, identifier);
+}
+
+
+int yr_replace_rule(YARA_CONTEXT* context, const char* ns, const char* identifier, const char* rules_string)
+{
+    if (context->version != NULL)
+        return ERROR_INVALID_ARGUMENT;
+        
+    return replace_rule(context, ns, identifier, rules_string);
+}
+
+/*
+    Rules being kept by yr_select_rules, the ones whose references weren't 
+    followed yet are in the stack.
+*/
+
+typedef struct _SELECTION
+{
+    unsigned int*   keep;                   /* bitmap indexed by rule->index */
+    RULE**          stack;
+    unsigned int    stack_count;
+    
+} SELECTION;
+
+
+void keep_rule(SELECTION* selection, RULE* rule)
+{
+    if (!BITMAP_TEST(selection->keep, rule->index))
+    {
+        BITMAP_SET(selection->keep, rule->index);
+        selection->stack[selection->stack_count++] = rule;
+    }
+}
+
+
+int keep_referenced_rule(TERM* term, void* data)
+{
+    if (term->type == TERM_TYPE_RULE)
+        keep_rule((SELECTION*) data, ((TERM_RULE*) term)->rule);
+        
+    return ERROR_SUCCESS;
+}
+
+
+int is_in_list(const char** list, const char* name)
+{
+    if (list == NULL)
+        return FALSE;
+    
+    while (*list != NULL)
+    {
+        if (strcmp(*list, name) == 0)
+            return TRUE;
+            
+        list++;
+    }
+    
+    return FALSE;
+}
+
+
+int is_selected(RULE* rule, const char** tags, const char** identifiers, const char** namespaces)
+{
+    const char** tag;
+    
+    if (is_in_list(identifiers, rule->identifier) || is_in_list(namespaces, rule->ns->name))
+        return TRUE;
+    
+    for (tag = tags; tag != NULL && *tag != NULL; tag++)
+    {
+        if (lookup_tag(rule->tag_list_head, *tag) != NULL)
+            return TRUE;
+    }
+    
+    return FALSE;
+}
+
+/*
+    Keeps only the rules having one of the tags, one of the identifiers or 
+    belonging to one of the namespaces, taking the others out of the context 
+    before it's used for scanning, so their strings are neither indexed nor 
+    searched. Each list is terminated by NULL and can be NULL itself. The 
+    rules referenced by the ones kept are kept too, and so are the global 
+    rules in their namespaces, as they decide if the rules kept match.
+*/
+
+int yr_select_rules(YARA_CONTEXT* context, const char** tags, const char** identifiers, const char** namespaces)
+{
+    SELECTION selection;
+    NAMESPACE** selected_namespaces;
+    RULE* rule;
+    
+    unsigned int selected_namespaces_count = 0;
+    unsigned int kept = 0;
+    unsigned int rules_count = 0;
+    unsigned int i;
+    
+    if (tags == NULL && identifiers == NULL && namespaces == NULL)
+        return ERROR_SUCCESS;
+    
+    for (rule = context->rule_list.head; rule != NULL; rule = rule->next)
+    {
+        rules_count++;
+    }
+    
+    selection.keep = (unsigned int*) yr_malloc(BITMAP_WORDS(context->rule_list.count + 1) * sizeof(unsigned int));
+    selection.stack = (RULE**) yr_malloc((rules_count + 1) * sizeof(RULE*));
+    selection.stack_count = 0;
+    selected_namespaces = (NAMESPACE**) yr_malloc((rules_count + 1) * sizeof(NAMESPACE*));
+    
+    if (selection.keep == NULL || selection.stack == NULL || selected_namespaces == NULL)
+    {
+        yr_free(selection.keep);
+        yr_free(selection.stack);
+        yr_free(selected_namespaces);
+        return ERROR_INSUFICIENT_MEMORY;
+    }
+    
+    memset(selection.keep, 0, BITMAP_WORDS(context->rule_list.count + 1) * sizeof(unsigned int));
+    
+    for (rule = context->rule_list.head; rule != NULL; rule = rule->next)
+    {
+        if (!is_selected(rule, tags, identifiers, namespaces))
+            continue;
+            
+        keep_rule(&selection, rule);
+        
+        for (i = 0; i < selected_namespaces_count && selected_namespaces[i] != rule->ns; i++);
+        
+        if (i == selected_namespaces_count)
+            selected_namespaces[selected_namespaces_count++] = rule->ns;
+    }
+    
+    /* rules can only reference rules in their namespace */
+    
+    for (rule = context->rule_list.head; rule != NULL; rule = rule->next)
+    {
+        if (!(rule->flags & RULE_FLAGS_GLOBAL))
+            continue;
+            
+        for (i = 0; i < selected_namespaces_count && selected_namespaces[i] != rule->ns; i++);
+        
+        if (i < selected_namespaces_count)
+            keep_rule(&selection, rule);
+    }
+    
+    while (selection.stack_count > 0)
+    {
+        rule = selection.stack[--selection.stack_count];
+        kept++;
+        
+        walk_term(rule->precondition, keep_referenced_rule, &selection);
+        walk_term(rule->condition, keep_referenced_rule, &selection);
+    }
+    
+    if (kept < rules_count)
+    {
+        retain_rules(&context->rule_list, selection.keep);
+        
+        /* the hash tables are populated again before the next scan */
+        
+        free_hash_table(&context->hash_table);
+        free_hash_table(&context->delta_table);
+        yr_close_result_cache(context);
+    }
+    
+    yr_free(selection.keep);
+    yr_free(selection.stack);
+    yr_free(selected_namespaces);
+    
+    return ERROR_SUCCESS;
+}
+
+/*
+    A version of a YARA_RULES is a context with the rules and a scanner on it 
+    for each slot, so that threads scanning at the same time with different 
+    slots share the compiled rules. The handle holds a reference to its 
+    current version and each scan one to the version it started with, the 
+    version is destroyed when the last one is released.
+    
+    Scans take their reference without a lock. A scan pins the version it
+    read in its slot before taking the reference, and checks that it is still
+    the current one afterwards. The handle's reference to a replaced version 
+    is dropped only when no slot has it pinned, so the version can't be 
+    destroyed between being read and being referenced.
+    
+    The rules of a published version are never changed, yr_update_rules 
+    changes a spare version instead, see below.
+*/
+
+typedef struct _RULES_VERSION
+{
+    YARA_CONTEXT*       context;
+    YARA_SCANNER**      scanners;           /* one for each slot */
+    int                 slots;
+    int                 references;
+    
+} RULES_VERSION;
+
+/*
+    A change made by yr_update_rules, see update_context.
+*/
+
+typedef struct _RULES_UPDATE
+{
+    char*               ns;
+    char*               identifier;         /* NULL for adding rules */
+    char*               rules_string;       /* NULL for removing a rule */
+    
+} RULES_UPDATE;
+
+
+struct _YARA_RULES
+{
+    pthread_mutex_t     lock;               /* serializes publishing and updating */
+    RULES_VERSION*      current;
+    RULES_VERSION**     pins;               /* one for each slot */
+    int                 slots;
+    
+    RULES_VERSION*      spare;              /* the previous version, if it can be updated */
+    RULES_UPDATE*       pending;            /* the last update, made to current but not to spare */
+};
+
+
+void free_version(RULES_VERSION* version)
+{
+    int i;
+    
+    for (i = 0; i < version->slots; i++)
+        yr_destroy_scanner(version->scanners[i]);
+    
+    version->context->version = NULL;
+    
+    yr_free(version->scanners);
+    yr_free(version);
+}
+
+
+void release_version(RULES_VERSION* version)
+{
+    YARA_CONTEXT* context;
+    
+    if (version == NULL || ATOMIC_DECREMENT(&version->references) > 0)
+        return;
+    
+    context = version->context;
+    
+    free_version(version);
+    yr_destroy_context(context);
+}
+
+
+RULES_VERSION* create_version(YARA_CONTEXT* context, int slots)
+{
+    RULES_VERSION* version;
+    int i;
+    
+    version = (RULES_VERSION*) yr_malloc(sizeof(RULES_VERSION));
+    
+    if (version == NULL)
+        return NULL;
+        
+    version->scanners = (YARA_SCANNER**) yr_malloc(slots * sizeof(YARA_SCANNER*));
+    
+    if (version->scanners == NULL)
+    {
+        yr_free(version);
+        return NULL;
+    }
+    
+    for (i = 0; i < slots; i++)
+    {
+        version->scanners[i] = yr_create_scanner(context);
+        
+        if (version->scanners[i] == NULL)
+        {
+            while (--i >= 0)
+                yr_destroy_scanner(version->scanners[i]);
+                
+            yr_free(version->scanners);
+            yr_free(version);
+            return NULL;
+        }
+    }
+    
+    version->context = context;
+    version->slots = slots;
+    version->references = 1;                /* the handle's */
+    
+    context->version = version;
+    
+    return version;
+}
+
+
+void free_update(RULES_UPDATE* update)
+{
+    if (update == NULL)
+        return;
+        
+    yr_free(update->ns);
+    yr_free(update->identifier);
+    yr_free(update->rules_string);
+    yr_free(update);
+}
+
+/*
+    Makes version the current one, waiting for the scans that read the 
+    previous one before it was replaced to take their reference, which is a 
+    matter of a few instructions. Returns the previous version, the handle's 
+    reference to it is passed to the caller. Called with the lock held.
+*/
+
+RULES_VERSION* swap_version(YARA_RULES* rules, RULES_VERSION* version)
+{
+    RULES_VERSION* previous = rules->current;
+    int i;
+    
+    ATOMIC_STORE(&rules->current, version);
+    
+    for (i = 0; i < rules->slots; i++)
+    {
+        while (previous != NULL && ATOMIC_LOAD(&rules->pins[i]) == previous)
+            sched_yield();
+    }
+    
+    return previous;
+}
+
+
+YARA_RULES* yr_create_rules(int slots)
+{
+    YARA_RULES* rules;
+    int i;
+    
+    if (slots < 1)
+        return NULL;
+    
+    rules = (YARA_RULES*) yr_malloc(sizeof(YARA_RULES));
+    
+    if (rules == NULL)
+        return NULL;
+        
+    rules->pins = (RULES_VERSION**) yr_malloc(slots * sizeof(RULES_VERSION*));
+    
+    if (rules->pins == NULL)
+    {
+        yr_free(rules);
+        return NULL;
+    }
+    
+    for (i = 0; i < slots; i++)
+        rules->pins[i] = NULL;
+    
+    pthread_mutex_init(&rules->lock, NULL);
+    rules->current = NULL;
+    rules->slots = slots;
+    rules->spare = NULL;
+    rules->pending = NULL;
+    
+    return rules;
+}
+
+/*
+    Destroys the handle, versions still in use by some scan are destroyed 
+    when the scan releases them.
+*/
+
+void yr_destroy_rules(YARA_RULES* rules)
+{
+    release_version(rules->current);
+    release_version(rules->spare);
+    free_update(rules->pending);
+    pthread_mutex_destroy(&rules->lock);
+    yr_free(rules->pins);
+    yr_free(rules);
+}
+
+/*
+    Makes the context the current version of the handle. Scans acquiring the
+    rules afterwards use it, the ones already running keep using the 
+    previous version until they release it. The context belongs to the 
+    handle from now on and must not be destroyed by the caller.
+    
+    The rules can be changed afterwards with yr_update_rules only if spare 
+    is not NULL. It must be another context compiled from the same rules and 
+    with the same settings, and belongs to the handle too.
+*/
+
+int yr_publish_rules(YARA_RULES* rules, YARA_CONTEXT* context, YARA_CONTEXT* spare)
+{
+    RULES_VERSION* version;
+    RULES_VERSION* spare_version = NULL;
+    RULES_VERSION* previous;
+    RULES_VERSION* previous_spare;
+    
+    if (context == NULL || context->version != NULL || 
+        context == spare || (spare != NULL && spare->version != NULL))
+        return ERROR_INVALID_ARGUMENT;
+    
+    version = create_version(context, rules->slots);
+    
+    if (version == NULL)
+        return ERROR_INSUFICIENT_MEMORY;
+    
+    if (spare != NULL)
+    {
+        spare_version = create_version(spare, rules->slots);
+        
+        if (spare_version == NULL)
+        {
+            free_version(version);
+            return ERROR_INSUFICIENT_MEMORY;
+        }
+    }
+    
+    pthread_mutex_lock(&rules->lock);
+    
+    previous = swap_version(rules, version);
+    previous_spare = rules->spare;
+    
+    rules->spare = spare_version;
+    
+    free_update(rules->pending);
+    rules->pending = NULL;
+    
+    pthread_mutex_unlock(&rules->lock);
+    
+    release_version(previous);
+    release_version(previous_spare);
+    
+    return ERROR_SUCCESS;
+}
+
+/*
+    Adds the rules in rules_string to namespace ns if identifier is NULL, 
+    removes the rule identifier if rules_string is NULL, and otherwise 
+    replaces it, like yr_add_rules, yr_remove_rule and yr_replace_rule do.
+*/
+
+int update_context(YARA_CONTEXT* context, RULES_UPDATE* update)
+{
+    if (update->identifier == NULL)
+        return add_rules(context, update->ns, update->rules_string);
+    else if (update->rules_string == NULL)
+        return delete_rule(context, update->ns, update->identifier);
+    else
+        return replace_rule(context, update->ns, update->identifier, update->rules_string);
+}
+
+/*
+    Changes the rules of the handle like update_context does, without 
+    stopping the scans. The handle keeps two versions with the same rules, 
+    the current one and a spare one that no scan acquires. The change is 
+    made to the spare version, which is indexed and becomes the current one. 
+    The replaced version becomes the spare, and the same change is made to 
+    it at the beginning of the next update, once the scans that were still 
+    using it finish. Only the strings of the rules changed are indexed 
+    again, see yr_add_rules.
+    
+    Scans are never blocked, but an update waits for the scans started 
+    before the previous update. If the change fails both versions are left 
+    as they were, except when running out of memory, which drops the spare 
+    version. Returns ERROR_INVALID_ARGUMENT if the rules were published 
+    without a spare context or the spare was dropped.
+*/
+
+int yr_update_rules(YARA_RULES* rules, const char* ns, const char* identifier, const char* rules_string)
+{
+    RULES_VERSION* spare;
+    RULES_UPDATE* update;
+    int result;
+    
+    if (ns == NULL || (identifier == NULL && rules_string == NULL))
+        return ERROR_INVALID_ARGUMENT;
+    
+    update = (RULES_UPDATE*) yr_malloc(sizeof(RULES_UPDATE));
+    
+    if (update == NULL)
+        return ERROR_INSUFICIENT_MEMORY;
+        
+    update->ns = yr_strdup(ns);
+    update->identifier = (identifier != NULL) ? yr_strdup(identifier) : NULL;
+    update->rules_string = (rules_string != NULL) ? yr_strdup(rules_string) : NULL;
+    
+    if (update->ns == NULL || 
+        (identifier != NULL && update->identifier == NULL) || 
+        (rules_string != NULL && update->rules_string == NULL))
+    {
+        free_update(update);
+        return ERROR_INSUFICIENT_MEMORY;
+    }
+    
+    pthread_mutex_lock(&rules->lock);
+    
+    spare = rules->spare;
+    
+    if (spare == NULL)
+    {
+        pthread_mutex_unlock(&rules->lock);
+        free_update(update);
+        return ERROR_INVALID_ARGUMENT;
+    }
+    
+    /* the handle's reference is the only one left once its scans finish */
+    
+    while (ATOMIC_LOAD(&spare->references) > 1)
+        sched_yield();
+    
+    if (rules->pending != NULL)
+    {
+        result = update_context(spare->context, rules->pending);
+        
+        free_update(rules->pending);
+        rules->pending = NULL;
+        
+        /* the spare can't catch up with the current version, it's dropped */
+        
+        if (result != ERROR_SUCCESS)
+        {
+            rules->spare = NULL;
+            pthread_mutex_unlock(&rules->lock);
+            release_version(spare);
+            free_update(update);
+            return result;
+        }
+    }
+    
+    result = update_context(spare->context, update);
+    
+    if (result != ERROR_SUCCESS)
+    {
+        pthread_mutex_unlock(&rules->lock);
+        free_update(update);
+        return result;
+    }
+    
+    /* scans must not index the rules, they'd do it all at the same time */
+    
+    result = index_rules(spare->context);
+    
+    if (result != ERROR_SUCCESS)
+    {
+        rules->spare = NULL;
+        pthread_mutex_unlock(&rules->lock);
+        release_version(spare);
+        free_update(update);
+        return result;
+    }
+    
+    rules->spare = swap_version(rules, spare);
+    rules->pending = update;
+    
+    pthread_mutex_unlock(&rules->lock);
+    
+    return ERROR_SUCCESS;
+}
+
+/*
+    Returns the scanner of the given slot in the current version, which is 
+    kept until released with yr_release_rules even if a new version is 
+    published meanwhile. A slot must be used by one thread at a time. Returns
+    NULL if no version was published yet.
+*/
+
+YARA_SCANNER* yr_acquire_rules(YARA_RULES* rules, int slot)
+{
+    RULES_VERSION* version;
+    
+    if (slot < 0 || slot >= rules->slots)
+        return NULL;
+    
+    do
+    {
+        version = ATOMIC_LOAD(&rules->current);
+        ATOMIC_STORE(&rules->pins[slot], version);
+    }
+    while (version != ATOMIC_LOAD(&rules->current));
+    
+    if (version != NULL)
+        ATOMIC_INCREMENT(&version->references);
+    
+    ATOMIC_STORE(&rules->pins[slot], NULL);
+    
+    return (version != NULL) ? version->scanners[slot] : NULL;
+}
+
+
+void yr_release_rules(YARA_SCANNER* scanner)
+{
+    release_version(scanner->context->version);
+}
+
+/*
+    Evaluates the preconditions of the rules, flagging the ones that failed. 
+    Returns TRUE if all of them failed, in which case nothing can match.
+    Preconditions are evaluated before searching strings, so the results of
+    rules they reference are forgotten afterwards instead of being reused.
+*/
+
+int evaluate_preconditions(YARA_SCANNER* scanner, EVALUATION_CONTEXT* eval_context)
+{
+    int all_preconditions_failed = TRUE;
+    unsigned int touched_rules_count = scanner->touched_rules_count;
+	RULE* rule;
+	
+	rule = scanner->rule_list_head;
+    while (rule != NULL)
+    {
+        if (rule->precondition != NULL)
+            if (evaluate(rule->precondition, eval_context) == 0) 
+                BITMAP_SET(scanner->failed_preconditions, rule->index);
+            else
+                all_preconditions_failed = FALSE;
+        else
+            all_preconditions_failed = FALSE;
+
+        rule = rule->next;
+    }
+    
+    while (scanner->touched_rules_count > touched_rules_count)
+    {
+        rule = scanner->touched_rules[--scanner->touched_rules_count];
+        rule->flags &= ~(RULE_FLAGS_EVALUATED | RULE_FLAGS_CONDITION_TRUE);
+    }
+    
+    return all_preconditions_failed;
+}
+
+/*
+    Searches the strings in a block, splitting the work among the scanning 
+    threads. The threads and args arrays must have room for SEARCH_THREADS 
+    items. With a single thread the block is searched by the calling one.
+    Only matches starting before limit are looked for, which is usually the 
+    last byte of the block. If records is TRUE the block is made of the 
+    context's records and matches can't cross from one to the next.
+*/
+
+void search_block(MEMORY_BLOCK* block, size_t limit, int records, YARA_SCANNER* scanner, pthread_t* threads, THREADED_SCAN_ARGS* args)
+{
+	unsigned int i;	
+    unsigned int threads_created = 0;
+    unsigned int threads_count = SEARCH_THREADS(scanner);
+    
+    if (block->size < 2)
+        return;
+        
+    if (limit > block->size - 1)
+        limit = block->size - 1;
+    
+    scanner->threads_searching = threads_count;
+    
+    if (threads_count == 1)
+    {
+        args[0].thread_index = 0;
+        args[0].threads_count = 1;
+        args[0].limit = limit;
+        args[0].block = block;
+        args[0].scanner = scanner;
+        args[0].records = records;
+        
+        threaded_scan(&args[0]);
+        return;
+    }
+    
+    for (i = 0; i < threads_count && i < limit; i++) 
+    {
+        args[i].thread_index = i;
+        args[i].threads_count = threads_count;
+        args[i].limit = limit;
+        args[i].block = block;
+        args[i].scanner = scanner;
+        args[i].records = records;
+
+        if (pthread_create(&threads[i], NULL, threaded_scan, &args[i]) != 0)
+            break;
+            
+        threads_created++;
+    }
+
+    // wait for the threads that were actually created to finish
+    for (i = 0; i < threads_created; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/*
+    Evaluates the rules once the strings have been searched and invokes the
+    callback for them. Returns CALLBACK_CONTINUE if all the rules were 
+    evaluated, or what the callback returned if it asked to stop.
+*/
+
+int evaluate_rules(YARA_SCANNER* scanner, EVALUATION_CONTEXT* eval_context, int is_executable, int is_file, YARACALLBACK callback, void* user_data)
+{
+	RULE* rule;
+	int result;
+	
+	rule = scanner->rule_list_head;
+	
+	/* no global rule has failed in any namespace yet */
+	
+	memset(scanner->unsatisfied_namespaces, 0, BITMAP_WORDS(scanner->namespaces_count + 1) * sizeof(unsigned int));
+	
+	/* evaluate global rules */
+	
+	while (rule != NULL)
+	{	
+		if (rule->flags & RULE_FLAGS_GLOBAL)
+		{
+            if (!BITMAP_TEST(scanner->failed_preconditions, rule->index))
+            {
+                eval_context->rule = rule;
+                
+                if (evaluate_rule(rule, eval_context))
+                {
+                    rule->flags |= RULE_FLAGS_MATCH;
+                }
+                else
+                {
+                    BITMAP_SET(scanner->unsatisfied_namespaces, rule->ns->index);
+                }
+                
+                if (!(rule->flags & RULE_FLAGS_PRIVATE))
+                {
+                    if (callback(rule, user_data) != 0)
+                        return CALLBACK_ERROR;
+                }
+            }
+		}
+			
+		rule = rule->next;
+	}
+	
+	/* evaluate the rest of the rules rules */
+
+	rule = scanner->rule_list_head;
+	
+	while (rule != NULL)
+	{
+		/* 
+		   skip global rules, privates rules, rules that don't need to be
+		   evaluated due to some global rule unsatisfied in it's namespace,
+           and rules that have failed the precondition
+		*/
+		
+		if (rule->flags & RULE_FLAGS_GLOBAL || rule->flags & RULE_FLAGS_PRIVATE 
+		    || BITMAP_TEST(scanner->unsatisfied_namespaces, rule->ns->index)
+            || BITMAP_TEST(scanner->failed_preconditions, rule->index))  
+		{
+			rule = rule->next;
+			continue;
+		}
+
+	  
+		if ((is_executable  || !(rule->flags & RULE_FLAGS_REQUIRE_EXECUTABLE)) &&
+		    (is_file        || !(rule->flags & RULE_FLAGS_REQUIRE_FILE)))
+		{
+		    eval_context->rule = rule;
+		    
+		    if (evaluate_rule(rule, eval_context))
+    		{
+                rule->flags |= RULE_FLAGS_MATCH;
+    		}
+		}
+		
+		result = callback(rule, user_data);
+		
+		if (result == CALLBACK_ABORT || result == CALLBACK_ERROR)
             return result;
+		
+		rule = rule->next;
+	}
+	
+	return CALLBACK_CONTINUE;
+}
+
+/*
+    Binds the variables whose value depends on what the scanner is scanning,
+    so that scanners sharing the context don't change its variables. The
+    bindings array must have room for two items and live as long as the
+    evaluation context is used.
+*/
+
+void bind_scan_variables(YARA_SCANNER* scanner, EVALUATION_CONTEXT* eval_context, VARIABLE_BINDING* bindings, int is_executable)
+{
+    VARIABLE* variable;
+    
+    eval_context->bindings = NULL;
+    
+    variable = lookup_variable(scanner->context->variables, PREDEFINED_VAR_IS_EXECUTABLE);
+    
+    if (variable != NULL)
+    {
+        bindings[0].variable = variable;
+        bindings[0].value = *variable;
+        bindings[0].value.boolean = is_executable;
+        bindings[0].next = eval_context->bindings;
+        eval_context->bindings = &bindings[0];
+    }
+    
+    variable = lookup_variable(scanner->context->variables, PREDEFINED_VAR_FILE_PATH);
+    
+    if (variable != NULL && scanner->file_path != NULL)
+    {
+        bindings[1].variable = variable;
+        bindings[1].value = *variable;
+        bindings[1].value.string = (char*) scanner->file_path;
+        bindings[1].next = eval_context->bindings;
+        eval_context->bindings = &bindings[1];
+    }
+}
+
+int scan_mem_blocks(MEMORY_BLOCK* block, YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data)
+{
+    YARA_CONTEXT* context = scanner->context;
+    
+    int error;
+	int is_executable;
+    int is_file;
+	
+	EVALUATION_CONTEXT eval_context;
+	VARIABLE_BINDING bindings[2];
+    
+    // thread variables
+    pthread_t* threads = NULL;
+    THREADED_SCAN_ARGS* args = NULL;
+	
+	if (block->size < 2)
+        return ERROR_SUCCESS;
+	
+	error = index_rules(context);
+	
+	if (error != ERROR_SUCCESS)
+        return error;
+	
+	error = clear_marks(scanner);
+	
+	if (error != ERROR_SUCCESS)
+	    return error;
+	
+	eval_context.file_size = block->size;
+    eval_context.entry_point = 0;
+    eval_context.entry_point_computed = FALSE;
+    eval_context.scanning_process_memory = scanner->scanning_process_memory;
+    eval_context.found_strings = NULL;
+    eval_context.process = NULL;
+    eval_context.scanner = scanner;
+    
+    error = build_block_index(block, &eval_context);
+    
+    if (error != ERROR_SUCCESS)
+        return error;
+    
+    is_executable = is_pe(block->data, block->size) || is_elf(block->data, block->size) || scanner->scanning_process_memory;
+    is_file = !scanner->scanning_process_memory;
+    
+    bind_scan_variables(scanner, &eval_context, bindings, is_executable);
+    
+    // if all the preconditions failed then we're done
+    if (evaluate_preconditions(scanner, &eval_context))
+    {
+        //printf("all preconditions failed\n");
+        free_block_index(&eval_context);
+        return ERROR_SUCCESS;
+    }
+    
+    threads = (pthread_t*) yr_malloc(sizeof(pthread_t) * SEARCH_THREADS(scanner));
+    args = (THREADED_SCAN_ARGS*) yr_malloc(sizeof(THREADED_SCAN_ARGS) * SEARCH_THREADS(scanner));
+    
+    if (threads == NULL || args == NULL)
+    {
+        if (threads != NULL)
+            yr_free(threads);
+        
+        if (args != NULL)
+            yr_free(args);
+        
+        free_block_index(&eval_context);
+        return ERROR_INSUFICIENT_MEMORY;
+    }
+	
+	while (block != NULL)
+	{
+        search_block(block, block->size - 1, FALSE, scanner, threads, args);
+        
+        /* search for strings constrained to a region of the input */
+        
+        error = find_matches_in_regions(block, 0, block->size - 1, scanner);
+        
+        if (error != ERROR_SUCCESS)
+        {
+            yr_free(threads);
+            yr_free(args);
+            free_block_index(&eval_context);
+            return error;
+        }
+        
+        block = block->next;
+    }
+    
+    yr_free(threads);
+    yr_free(args);
+    
+    /* sort matches by offset and link them */
+    
+    finalize_matches(scanner);
+    report_match_warnings(scanner, user_data);
+    
+    eval_context.found_strings = scanner->found_strings;
+    
+    error = evaluate_rules(scanner, &eval_context, is_executable, is_file, callback, user_data);
+	
+	free_block_index(&eval_context);
+	
+	return (error == CALLBACK_ERROR) ? ERROR_CALLBACK_ERROR : ERROR_SUCCESS;
+}
+
+int yr_scanner_scan_mem(unsigned char* buffer, size_t buffer_size, YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data)
+{
+    MEMORY_BLOCK block;
+    
+    block.data = buffer;
+    block.size = buffer_size;
+    block.base = 0;
+    block.next = NULL;
+    
+    return scan_mem_blocks(&block, scanner, callback, user_data);
+}
+
+/*
+    Evaluates the rules for a record once set_record_window has given the
+    strings the matches found in it.
+*/
+
+int evaluate_record(unsigned char* data, size_t size, YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data)
+{
+    MEMORY_BLOCK block;
+	EVALUATION_CONTEXT eval_context;
+	VARIABLE_BINDING bindings[2];
+	int is_executable;
+	
+	block.data = data;
+	block.size = size;
+	block.base = 0;
+	block.next = NULL;
+	
+	eval_context.file_size = size;
+    eval_context.entry_point = 0;
+    eval_context.entry_point_computed = FALSE;
+    eval_context.scanning_process_memory = FALSE;
+    eval_context.found_strings = NULL;
+    eval_context.process = NULL;
+    eval_context.scanner = scanner;
+    
+    /* a single block needs no index, this can't fail */
+    
+    build_block_index(&block, &eval_context);
+    
+    is_executable = is_pe(data, size) || is_elf(data, size);
+    
+    bind_scan_variables(scanner, &eval_context, bindings, is_executable);
+    
+    clear_rule_marks(scanner);
+    
+    if (evaluate_preconditions(scanner, &eval_context))
+        return CALLBACK_CONTINUE;
+    
+    eval_context.found_strings = scanner->found_strings;
+    
+    return evaluate_rules(scanner, &eval_context, is_executable, TRUE, callback, user_data);
+}
+
+/*
+    Scans a buffer made of records, which are separated by the context's
+    record_delimiter or have record_size bytes each, reporting the rules
+    matching each record as if it was scanned alone with yr_scan_mem. The
+    buffer is searched only once, but without letting matches cross from a
+    record to the next, the matches are then distributed among the records
+    and the rules evaluated for each of them. While the callback runs
+    yr_get_record_number and yr_get_record_offset tell which record it is
+    being invoked for. Records too short for any string to be searched in
+    them are still evaluated.
+*/
+
+int yr_scanner_scan_mem_records(unsigned char* buffer, size_t buffer_size, YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data)
+{
+    YARA_CONTEXT* context = scanner->context;
+    
+    MEMORY_BLOCK block;
+    MEMORY_BLOCK record;
+    RECORD_MATCHES records;
+    RULE* rule;
+    STRING* string;
+    
+    pthread_t* threads;
+    THREADED_SCAN_ARGS* args;
+    
+    size_t start, end;
+    int result = ERROR_SUCCESS;
+    int callback_result = CALLBACK_CONTINUE;
+    
+    if (!IS_RECORD_MODE(context))
+        return ERROR_INVALID_ARGUMENT;
+    
+    result = index_rules(context);
+    
+    if (result != ERROR_SUCCESS)
+        return result;
+    
+    result = clear_marks(scanner);
+    
+    if (result != ERROR_SUCCESS)
+        return result;
+    
+    /*
+        in fast matching mode strings are searched until the first match, but
+        here every record needs its own, so fast matching is turned off in the
+        scanner's strings for this scan
+    */
+    
+    for (string = scanner->strings; string < scanner->strings + scanner->strings_count; string++)
+    {
+        string->flags &= ~STRING_FLAGS_FAST_MATCH;
+    }
+    
+    threads = (pthread_t*) yr_malloc(sizeof(pthread_t) * SEARCH_THREADS(scanner));
+    args = (THREADED_SCAN_ARGS*) yr_malloc(sizeof(THREADED_SCAN_ARGS) * SEARCH_THREADS(scanner));
+    
+    if (threads == NULL || args == NULL)
+    {
+        result = ERROR_INSUFICIENT_MEMORY;
+    }
+    else
+    {
+        block.data = buffer;
+        block.size = buffer_size;
+        block.base = 0;
+        block.next = NULL;
+        
+        search_block(&block, block.size - 1, TRUE, scanner, threads, args);
+    }
+    
+    if (threads != NULL)
+        yr_free(threads);
+    
+    if (args != NULL)
+        yr_free(args);
+    
+    /* strings constrained to a region are searched in that region of each record */
+    
+    if (BUCKET_SIZE(&context->hash_table, HASH_BUCKET_CONSTRAINED) > 0 ||
+        (context->delta_table.populated && BUCKET_SIZE(&context->delta_table, HASH_BUCKET_CONSTRAINED) > 0))
+    {
+        for (start = 0; start < buffer_size && result == ERROR_SUCCESS; start = end)
+        {
+            end = record_end(context, buffer, buffer_size, start);
+            
+            record.data = buffer + start;
+            record.size = end - start;
+            record.base = start;
+            record.next = NULL;
+            
+            result = find_matches_in_regions(&record, start, record.size - 1, scanner);
+        }
+    }
+    
+    if (result == ERROR_SUCCESS)
+    {
+        finalize_matches(scanner);
+        report_match_warnings(scanner, user_data);
+        result = init_record_matches(scanner, &records);
+    }
+    
+    if (result == ERROR_SUCCESS)
+    {
+        scanner->record_number = 0;
+        
+        for (start = 0; start < buffer_size; start = end)
+        {
+            end = record_end(context, buffer, buffer_size, start);
+            
+            scanner->record_number++;
+            scanner->record_offset = start;
+            
+            set_record_window(&records, scanner, start, end);
+            
+            callback_result = evaluate_record(buffer + start, end - start, scanner, callback, user_data);
+            
+            clear_record_window(&records, scanner);
+            
+            if (callback_result != CALLBACK_CONTINUE)
+                break;
+        }
+        
+        destroy_record_matches(&records);
+        
+        if (callback_result == CALLBACK_ERROR)
+            result = ERROR_CALLBACK_ERROR;
+    }
+    
+    for (rule = context->rule_list.head; rule != NULL; rule = rule->next)
+    {
+        for (string = rule->string_list_head; string != NULL; string = string->next)
+        {
+            SCANNER_STRING(scanner, string)->flags |= string->flags & STRING_FLAGS_FAST_MATCH;
+        }
+    }
+    
+    return result;
+}
+
+
+/*
+    Invokes the callback for the rules as scan_mem_blocks does, but using
+    the rule flags restored from the result cache instead of scanning.
+*/
+
+int replay_cached_result(YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data)
+{
+    RULE* rule;
+	
+	memset(scanner->unsatisfied_namespaces, 0, BITMAP_WORDS(scanner->namespaces_count + 1) * sizeof(unsigned int));
+	
+	for (rule = scanner->rule_list_head; rule != NULL; rule = rule->next)
+	{
+		if (!(rule->flags & RULE_FLAGS_GLOBAL) || BITMAP_TEST(scanner->failed_preconditions, rule->index))
+            continue;
+        
+        if (!(rule->flags & RULE_FLAGS_MATCH))
+            BITMAP_SET(scanner->unsatisfied_namespaces, rule->ns->index);
+        
+        if (!(rule->flags & RULE_FLAGS_PRIVATE))
+        {
+            if (callback(rule, user_data) != 0)
+                return ERROR_CALLBACK_ERROR;
         }
+	}
+	
+	for (rule = scanner->rule_list_head; rule != NULL; rule = rule->next)
+	{
+		if (rule->flags & RULE_FLAGS_GLOBAL || rule->flags & RULE_FLAGS_PRIVATE
+		    || BITMAP_TEST(scanner->unsatisfied_namespaces, rule->ns->index)
+            || BITMAP_TEST(scanner->failed_preconditions, rule->index))
+		{
+			continue;
+		}
+		
+		switch (callback(rule, user_data))
+		{
+		    case CALLBACK_ABORT:
+                return ERROR_SUCCESS;
+            
+            case CALLBACK_ERROR:
+                return ERROR_CALLBACK_ERROR;
+		}
+	}
+	
+	return ERROR_SUCCESS;
+}
+
+
+typedef struct _CACHED_SCAN_ARGS
+{
+    YARACALLBACK    callback;
+    void*           user_data;
+    int             interrupted;
+
+} CACHED_SCAN_ARGS;
+
+
+int cached_scan_callback(RULE* rule, void* data)
+{
+    CACHED_SCAN_ARGS* args = (CACHED_SCAN_ARGS*) data;
+    int result = args->callback(rule, args->user_data);
+    
+    if (result != CALLBACK_CONTINUE)
+        args->interrupted = TRUE;
+    
+    return result;
+}
+
+/*
+    Scans a buffer looking for its result in the context's cache first. The
+    result is stored only if every rule was evaluated, that is, when the
+    callback didn't stop the scan.
+*/
+
+int scan_mem_cached(unsigned char* buffer, size_t buffer_size, YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data)
+{
+    YARA_CONTEXT* context = scanner->context;
+    CACHED_SCAN_ARGS args;
+    unsigned long long hash;
+    int result;
+    
+    /* buffers this small aren't scanned at all */
+    
+    if (buffer_size < 2)
+        return yr_scanner_scan_mem(buffer, buffer_size, scanner, callback, user_data);
+    
+    hash = hash_data(buffer, buffer_size);
+    
+    result = clear_marks(scanner);
+    
+    if (result != ERROR_SUCCESS)
+        return result;
+    
+    if (cache_lookup(context->result_cache, hash, buffer_size, scanner))
+        return replay_cached_result(scanner, callback, user_data);
+    
+    args.callback = callback;
+    args.user_data = user_data;
+    args.interrupted = FALSE;
+    
+    result = yr_scanner_scan_mem(buffer, buffer_size, scanner, cached_scan_callback, &args);
+    
+    if (result == ERROR_SUCCESS && !args.interrupted)
+        cache_store(context->result_cache, hash, buffer_size, scanner);
+    
+    return result;
+}
+
+/*
+    Scans a buffer in the way the context is set up for: as a sequence of
+    records, through the result cache or as a whole.
+*/
+
+int scan_buffer(unsigned char* buffer, size_t buffer_size, YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data)
+{
+    if (IS_RECORD_MODE(scanner->context))
+        return yr_scanner_scan_mem_records(buffer, buffer_size, scanner, callback, user_data);
+    else if (scanner->context->result_cache != NULL)
+        return scan_mem_cached(buffer, buffer_size, scanner, callback, user_data);
+    else
+        return yr_scanner_scan_mem(buffer, buffer_size, scanner, callback, user_data);
+}
+
+/*
+    Scans a mapped file and unmaps it when done.
+*/
+
+int scan_mapped_file(MAPPED_FILE* mfile, const char* file_path, YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data)
+{
+	int result;
+    
+    scanner->file_path = file_path;
+    
+    result = scan_buffer(mfile->data, mfile->size, scanner, callback, user_data);
+    
+    scanner->file_path = NULL;
+	
+	unmap_file(mfile);
+	
+	return result;
+}
+
+int yr_scanner_scan_file(const char* file_path, YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data)
+{
+	MAPPED_FILE mfile;
+	int result;
+    
+    result = map_file(file_path, &mfile);
+	
+	if (result == ERROR_SUCCESS)
+	{
+        result = scan_mapped_file(&mfile, file_path, scanner, callback, user_data);
+	}
+    else
+    {
+        fprintf(stderr, "unable to scan file %s error code %d\n", file_path, result);
+    }
+	
+	return result;
+}
+
+#ifndef WIN32
+
+/*
+    Same as yr_scanner_scan_file but for a file already opened by the caller,
+    file_path is only used for the filepath variable and error messages.
+    The descriptor is closed before returning.
+*/
+
+int yr_scanner_scan_fd(int fd, const char* file_path, YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data)
+{
+	MAPPED_FILE mfile;
+	int result;
+    
+    result = map_file_descriptor(fd, &mfile);
+	
+	if (result == ERROR_SUCCESS)
+	{
+        result = scan_mapped_file(&mfile, file_path, scanner, callback, user_data);
+	}
+    else
+    {
+        fprintf(stderr, "unable to scan file %s error code %d\n", file_path, result);
+    }
+	
+	return result;
+}
+
+#endif
+
+/*
+    Opens the result cache stored in cache_path, creating it if needed. Files
+    scanned afterwards with yr_scan_file are looked up in the cache by content
+    and, if they were scanned before with the same rules, the callback is
+    invoked with the cached results without scanning them. The cache must be
+    opened after compiling all the rules and setting the limits on the matches
+    kept. Rules using external variables can't be cached and
+    ERROR_UNCACHEABLE_RULES is returned for them.
+*/
+
+int yr_open_result_cache(YARA_CONTEXT* context, const char* cache_path)
+{
+    yr_close_result_cache(context);
+    
+    return cache_open(cache_path, context, &context->result_cache);
+}
+
+void yr_close_result_cache(YARA_CONTEXT* context)
+{
+    if (context->result_cache != NULL)
+    {
+        cache_close(context->result_cache);
+        context->result_cache = NULL;
+    }
+}
+
+/*
+    Scans a chunk of a process region read into a memory block. Unless it's
+    the last one of the region the chunk overlaps the next by overlap bytes,
+    and only matches starting before the overlap are looked for here, the 
+    others are found when scanning the next chunk.
+*/
+
+int scan_process_chunk(MEMORY_BLOCK* chunk, int last, size_t overlap, YARA_SCANNER* scanner, pthread_t* threads, THREADED_SCAN_ARGS* args)
+{
+    size_t limit = last ? chunk->size - 1 : chunk->size - overlap;
+    
+    search_block(chunk, limit, FALSE, scanner, threads, args);
+    
+    return find_matches_in_regions(chunk, 0, limit, scanner);
+}
 
-        // otherwise we break it up by line
-        start = stop = mfile.data;
-        while (start < (mfile.data + mfile.size)) 
+/*
+    Scans the memory of a process one region at a time. Regions are read in
+    chunks of PROCESS_CHUNK_SIZE bytes into a single buffer, so the memory
+    needed doesn't depend on the size of the process. Only the table of its
+    regions and the matches found are kept until the rules are evaluated,
+    integers and the entry point are then read from the process itself.
+    
+    Consecutive chunks overlap by the span of the longest match of any 
+    string, computed when the hash tables are populated. If some string has 
+    no bound, like regular expressions, or the overlap would take most of 
+    the chunk, each region is read whole instead and the buffer grows up to 
+    the size of the largest one.
+
+    The scan is given up with ERROR_SCAN_TIMEOUT or ERROR_MEMORY_LIMIT_EXCEEDED,
+    and no rules are reported, when it takes longer than the context's
+    process_timeout or reads more than process_memory_limit bytes. The process
+    is stopped while being scanned, so the timeout also bounds the time it
+    stays stopped.
+*/
+
+int yr_scanner_scan_proc(int pid, YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data)
+{
+    YARA_CONTEXT* context = scanner->context;
+    
+    PROCESS_MEMORY* process;
+    MEMORY_BLOCK* region;
+    MEMORY_BLOCK chunk;
+    
+    EVALUATION_CONTEXT eval_context;
+    VARIABLE_BINDING bindings[2];
+    
+    pthread_t* threads = NULL;
+    THREADED_SCAN_ARGS* args = NULL;
+    unsigned char* buffer = NULL;
+    
+    size_t offset, length, requested;
+    size_t chunk_size, overlap;
+    size_t buffer_size = PROCESS_CHUNK_SIZE;
+    size_t total_read = 0;
+    time_t start = time(NULL);
+    int whole_regions;
+    int result;
+    
+    /* the process is stopped while attached, so nothing else is done meanwhile */
+    
+    result = index_rules(context);
+    
+    if (result == ERROR_SUCCESS)
+        result = clear_marks(scanner);
+    
+    if (result != ERROR_SUCCESS)
+        return result;
+    
+    result = open_process_memory(pid, context->region_flags, context->region_path, &process);
+    
+    if (result != ERROR_SUCCESS)
+        return result;
+    
+    if (process->regions_count == 0)
+    {
+        close_process_memory(process);
+        return ERROR_SUCCESS;
+    }
+    
+    eval_context.file_size = process->regions->size;
+    eval_context.entry_point = 0;
+    eval_context.entry_point_computed = FALSE;
+    eval_context.scanning_process_memory = TRUE;
+    eval_context.found_strings = NULL;
+    eval_context.process = process;
+    eval_context.scanner = scanner;
+    
+    result = build_block_index(process->regions, &eval_context);
+    
+    if (result != ERROR_SUCCESS)
+    {
+        close_process_memory(process);
+        return result;
+    }
+    
+    scanner->scanning_process_memory = TRUE;
+    
+    bind_scan_variables(scanner, &eval_context, bindings, TRUE);
+    
+    if (evaluate_preconditions(scanner, &eval_context))
+    {
+        scanner->scanning_process_memory = FALSE;
+        free_block_index(&eval_context);
+        close_process_memory(process);
+        return ERROR_SUCCESS;
+    }
+    
+    overlap = context->hash_table.max_span;
+    whole_regions = context->hash_table.unbounded;
+    
+    if (context->delta_table.populated)
+    {
+        if (context->delta_table.max_span > overlap)
+            overlap = context->delta_table.max_span;
+            
+        whole_regions |= context->delta_table.unbounded;
+    }
+    
+    if (overlap > PROCESS_CHUNK_SIZE / 2)
+        whole_regions = TRUE;
+    
+    buffer = (unsigned char*) yr_malloc(buffer_size);
+    threads = (pthread_t*) yr_malloc(sizeof(pthread_t) * SEARCH_THREADS(scanner));
+    args = (THREADED_SCAN_ARGS*) yr_malloc(sizeof(THREADED_SCAN_ARGS) * SEARCH_THREADS(scanner));
+    
+    if (buffer == NULL || threads == NULL || args == NULL)
+        result = ERROR_INSUFICIENT_MEMORY;
+    
+    for (region = process->regions; region != NULL && result == ERROR_SUCCESS; region = region->next)
+    {
+        offset = 0;
+        chunk_size = whole_regions ? region->size : PROCESS_CHUNK_SIZE;
+        
+        while (offset < region->size && result == ERROR_SUCCESS)
         {
-            if (*stop == '\n' || *stop == '\r')
+            requested = region->size - offset;
+            
+            if (requested > chunk_size)
+                requested = chunk_size;
+            
+            if (context->process_timeout != 0 && difftime(time(NULL), start) > context->process_timeout)
             {
-                stop++;
-
-                // if this is \r\n then move ahead one more
-                if (stop < (mfile.data + mfile.size) && *(stop - 1) == '\r' && *stop == '\n')
-                    stop++;
-
-                // scan this much stuff
-                if ((stop - start) > 0)
+                result = ERROR_SCAN_TIMEOUT;
+                break;
+            }
+            
+            if (context->process_memory_limit != 0 && total_read + requested > context->process_memory_limit)
+            {
+                result = ERROR_MEMORY_LIMIT_EXCEEDED;
+                break;
+            }
+            
+            total_read += requested;
+            
+            if (requested > buffer_size)
+            {
+                yr_free(buffer);
+                
+                buffer = (unsigned char*) yr_malloc(requested);
+                buffer_size = requested;
+                
+                if (buffer == NULL)
                 {
-                    result = yr_scan_mem(start, stop - start, context, callback, user_data);
-                    if (result != ERROR_SUCCESS)
-                        break;
-
-                    start = stop;
+                    result = ERROR_INSUFICIENT_MEMORY;
+                    break;
                 }
             }
-
-            stop++;
+            
+            length = read_process_memory(process, region->base + offset, buffer, requested);
+            
+            /* the first page can't be read, go on with the next one */
+            
+            if (length == 0)
+            {
+                offset = ((region->base + offset) | (process->page_size - 1)) + 1 - region->base;
+                continue;
+            }
+            
+            chunk.data = buffer;
+            chunk.size = length;
+            chunk.base = region->base + offset;
+            chunk.next = NULL;
+            
+            if (length == chunk_size && offset + length < region->size)
+            {
+                result = scan_process_chunk(&chunk, FALSE, overlap, scanner, threads, args);
+                offset += chunk_size - overlap;
+            }
+            else
+            {
+                result = scan_process_chunk(&chunk, TRUE, overlap, scanner, threads, args);
+                
+                if (length == requested)
+                    break;
+                
+                /*
+                    the read stopped at a page that can't be read, go on with
+                    the page after it
+                */
+                
+                offset = ((region->base + offset + length) | (process->page_size - 1)) + 1 - region->base;
+            }
         }
+    }
+    
+    if (buffer != NULL)
+        yr_free(buffer);
+    
+    if (threads != NULL)
+        yr_free(threads);
+    
+    if (args != NULL)
+        yr_free(args);
+    
+    if (result == ERROR_SUCCESS)
+    {
+        finalize_matches(scanner);
+        report_match_warnings(scanner, user_data);
+        
+        eval_context.found_strings = scanner->found_strings;
+        
+        result = evaluate_rules(scanner, &eval_context, TRUE, FALSE, callback, user_data);
+        result = (result == CALLBACK_ERROR) ? ERROR_CALLBACK_ERROR : ERROR_SUCCESS;
+    }
+    
+    scanner->scanning_process_memory = FALSE;
+    
+    free_block_index(&eval_context);
+    close_process_memory(process);
+    
+    return result;
+}
 
-		unmap_file(&mfile);
-	} 
-    else
+/*
+    Creates a scanner for the rules of the context. The rules are indexed
+    here, so several scanners created from the same context can then scan at
+    the same time in different threads, as long as nothing is compiled into
+    the context meanwhile. Scanners must be destroyed before their context.
+*/
+
+YARA_SCANNER* yr_create_scanner(YARA_CONTEXT* context)
+{
+    YARA_SCANNER* scanner;
+    
+    if (index_rules(context) != ERROR_SUCCESS)
+        return NULL;
+    
+    scanner = (YARA_SCANNER*) yr_malloc(sizeof(YARA_SCANNER));
+    
+    if (scanner == NULL)
+        return NULL;
+    
+    memset(scanner, 0, sizeof(YARA_SCANNER));
+    
+    scanner->context = context;
+    
+    if (clear_marks(scanner) != ERROR_SUCCESS)
     {
-        fprintf(stderr, "unable to scan file %s error code %d\n", file_path, result);
+        yr_free(scanner);
+        return NULL;
     }
-		
-	return result;
+    
+    pthread_mutex_init(&scanner->match_lock, NULL);
+    
+    return scanner;
+}
+
+void yr_destroy_scanner(YARA_SCANNER* scanner)
+{
+    free_scanner_matches(scanner);
+    free_scanner_copies(scanner);
+    
+    pthread_mutex_destroy(&scanner->match_lock);
+    yr_free(scanner->cache_entry);
+    yr_free(scanner);
+}
+
+/*
+    While the callback of yr_scan_mem_records runs, these tell the number of
+    the record it is invoked for, starting at 1, and its offset.
+*/
+
+size_t yr_get_record_number(YARA_SCANNER* scanner)
+{
+    return scanner->record_number;
+}
+
+size_t yr_get_record_offset(YARA_SCANNER* scanner)
+{
+    return scanner->record_offset;
+}
+
+/*
+    The yr_scan_* functions taking a context use a scanner of its own,
+    created the first time one of them is called.
+*/
+
+static YARA_SCANNER* context_scanner(YARA_CONTEXT* context)
+{
+    if (context->scanner == NULL)
+        context->scanner = yr_create_scanner(context);
+    
+    return context->scanner;
+}
+
+int yr_scan_mem(unsigned char* buffer, size_t buffer_size, YARA_CONTEXT* context, YARACALLBACK callback, void* user_data)
+{
+    YARA_SCANNER* scanner = context_scanner(context);
+    
+    if (scanner == NULL)
+        return ERROR_INSUFICIENT_MEMORY;
+    
+    return yr_scanner_scan_mem(buffer, buffer_size, scanner, callback, user_data);
+}
+
+int yr_scan_mem_records(unsigned char* buffer, size_t buffer_size, YARA_CONTEXT* context, YARACALLBACK callback, void* user_data)
+{
+    YARA_SCANNER* scanner = context_scanner(context);
+    
+    if (scanner == NULL)
+        return ERROR_INSUFICIENT_MEMORY;
+    
+    return yr_scanner_scan_mem_records(buffer, buffer_size, scanner, callback, user_data);
+}
+
+int yr_scan_file(const char* file_path, YARA_CONTEXT* context, YARACALLBACK callback, void* user_data)
+{
+    YARA_SCANNER* scanner = context_scanner(context);
+    
+    if (scanner == NULL)
+        return ERROR_INSUFICIENT_MEMORY;
+    
+    return yr_scanner_scan_file(file_path, scanner, callback, user_data);
 }
 
+#ifndef WIN32
+
+int yr_scan_fd(int fd, const char* file_path, YARA_CONTEXT* context, YARACALLBACK callback, void* user_data)
+{
+    YARA_SCANNER* scanner = context_scanner(context);
+    
+    if (scanner == NULL)
+        return ERROR_INSUFICIENT_MEMORY;
+    
+    return yr_scanner_scan_fd(fd, file_path, scanner, callback, user_data);
+}
+
+#endif
+
 int yr_scan_proc(int pid, YARA_CONTEXT* context, YARACALLBACK callback, void* user_data)
 {
+    YARA_SCANNER* scanner = context_scanner(context);
     
-    MEMORY_BLOCK* first_block;
-    MEMORY_BLOCK* next_block;
-    MEMORY_BLOCK* block;
-        
-    int result = get_process_memory(pid, &first_block);
+    if (scanner == NULL)
+        return ERROR_INSUFICIENT_MEMORY;
+    
+    return yr_scanner_scan_proc(pid, scanner, callback, user_data);
+}
 
-    if (result == ERROR_SUCCESS)
-    {
-        context->scanning_process_memory = TRUE;
-        result = yr_scan_mem_blocks(first_block, context, callback, user_data);
-    }
+
+typedef struct _BATCH
+{
+    YARA_SCAN_ITEM*     items;
+    int                 items_count;
+    int                 next_item;
+    int                 stopped;
     
-    if (result == ERROR_SUCCESS)
-    {  
-        block = first_block;
+    YARA_CONTEXT*       context;
+    YARABATCHCALLBACK   callback;
+    void*               user_data;
+    
+    pthread_mutex_t     queue_lock;         /* protects next_item and stopped */
+    pthread_mutex_t     callback_lock;
+    
+} BATCH;
+
+
+typedef struct _BATCH_WORKER
+{
+    BATCH*              batch;
+    YARA_SCANNER*       scanner;
+    int                 item_index;
+    pthread_t           thread;
+    
+} BATCH_WORKER;
+
+
+int batch_callback(RULE* rule, void* data)
+{
+    BATCH_WORKER* worker = (BATCH_WORKER*) data;
+    BATCH* batch = worker->batch;
+    int result;
+    
+    pthread_mutex_lock(&batch->callback_lock);
+    result = batch->callback(rule, worker->item_index, batch->user_data);
+    pthread_mutex_unlock(&batch->callback_lock);
+    
+    return result;
+}
+
+void batch_warning(int warning, STRING* string, void* data)
+{
+    BATCH_WORKER* worker = (BATCH_WORKER*) data;
+    BATCH* batch = worker->batch;
     
-        while (block != NULL)
+    pthread_mutex_lock(&batch->callback_lock);
+    batch->context->warning_function(warning, string, batch->user_data);
+    pthread_mutex_unlock(&batch->callback_lock);
+}
+
+void* batch_worker(void* param)
+{
+    BATCH_WORKER* worker = (BATCH_WORKER*) param;
+    BATCH* batch = worker->batch;
+    YARA_SCAN_ITEM* item;
+    
+    while (TRUE)
+    {
+        pthread_mutex_lock(&batch->queue_lock);
+        
+        if (batch->stopped || batch->next_item == batch->items_count)
         {
-            next_block = block->next;
+            pthread_mutex_unlock(&batch->queue_lock);
+            break;
+        }
+        
+        worker->item_index = batch->next_item++;
         
-            yr_free(block->data);
-            yr_free(block);   
+        pthread_mutex_unlock(&batch->queue_lock);
         
-            block = next_block;   
+        item = &batch->items[worker->item_index];
+        
+        switch(item->type)
+        {
+        case SCAN_ITEM_TYPE_FILE:
+            item->result = yr_scanner_scan_file(item->file_path, worker->scanner, batch_callback, worker);
+            break;
+            
+        case SCAN_ITEM_TYPE_PROCESS:
+            item->result = yr_scanner_scan_proc(item->pid, worker->scanner, batch_callback, worker);
+            break;
+            
+        case SCAN_ITEM_TYPE_BUFFER:
+            item->result = scan_buffer(item->data, item->size, worker->scanner, batch_callback, worker);
+            break;
+            
+        default:
+            item->result = ERROR_INVALID_ARGUMENT;
+            break;
+        }
+        
+        if (item->result == ERROR_CALLBACK_ERROR)
+        {
+            pthread_mutex_lock(&batch->queue_lock);
+            batch->stopped = TRUE;
+            pthread_mutex_unlock(&batch->queue_lock);
         }
     }
+    
+    return NULL;
+}
 
-    return result;
+/*
+    Scans a batch of files, buffers and processes with the rules of the 
+    context. The items are distributed among workers_count workers, each one 
+    with a scanner of its own, so the rules are compiled only once. The first 
+    worker runs in the calling thread and the others are started here, which 
+    makes the setup for the batch a fixed cost no matter how many items it 
+    has. With more than one worker each item is searched by its worker alone,
+    otherwise the context's search_threads applies as usual.
+
+    The callback receives the index of the item being reported and is never 
+    invoked by two workers at the same time. If it returns CALLBACK_ERROR the 
+    items not scanned yet are left with ERROR_NOT_SCANNED as result and the
+    function returns ERROR_CALLBACK_ERROR. The result of scanning each item 
+    is in its result field. The context's warning function receives the 
+    batch's user data, and is never invoked at the same time as the callback.
+*/
+
+int yr_scan_batch(YARA_SCAN_ITEM* items, int items_count, YARA_CONTEXT* context, int workers_count, YARABATCHCALLBACK callback, void* user_data)
+{
+    BATCH batch;
+    BATCH_WORKER* workers;
+    int workers_started;
+    int i;
+    
+    if (workers_count < 1)
+        return ERROR_INVALID_ARGUMENT;
+        
+    if (items_count < 1)
+        return ERROR_SUCCESS;
+        
+    if (workers_count > items_count)
+        workers_count = items_count;
+    
+    workers = (BATCH_WORKER*) yr_malloc(workers_count * sizeof(BATCH_WORKER));
+    
+    if (workers == NULL)
+        return ERROR_INSUFICIENT_MEMORY;
+    
+    /* if some scanner can't be created the other workers take its share */
+    
+    for (i = 0; i < workers_count; i++)
+    {
+        workers[i].scanner = yr_create_scanner(context);
+        
+        if (workers[i].scanner == NULL)
+            break;
+    }
+    
+    workers_count = i;
+    
+    if (workers_count == 0)
+    {
+        yr_free(workers);
+        return ERROR_INSUFICIENT_MEMORY;
+    }
+        
+    for (i = 0; i < items_count; i++)
+    {
+        items[i].result = ERROR_NOT_SCANNED;
+    }
+    
+    batch.items = items;
+    batch.items_count = items_count;
+    batch.next_item = 0;
+    batch.stopped = FALSE;
+    batch.context = context;
+    batch.callback = callback;
+    batch.user_data = user_data;
+    
+    pthread_mutex_init(&batch.queue_lock, NULL);
+    pthread_mutex_init(&batch.callback_lock, NULL);
+    
+    for (i = 0; i < workers_count; i++)
+    {
+        workers[i].batch = &batch;
+        
+        if (workers_count > 1)
+            workers[i].scanner->search_threads = 1;
+            
+        if (context->warning_function != NULL)
+            workers[i].scanner->warning_function = batch_warning;
+    }
+    
+    /* if some worker can't be started the others take its share */
+    
+    for (workers_started = 1; workers_started < workers_count; workers_started++)
+    {
+        if (pthread_create(&workers[workers_started].thread, NULL, batch_worker, &workers[workers_started]) != 0)
+            break;
+    }
+    
+    batch_worker(&workers[0]);
+    
+    for (i = 1; i < workers_started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    
+    for (i = 0; i < workers_count; i++)
+    {
+        yr_destroy_scanner(workers[i].scanner);
+    }
+    
+    pthread_mutex_destroy(&batch.queue_lock);
+    pthread_mutex_destroy(&batch.callback_lock);
+    
+    yr_free(workers);
+    
+    return batch.stopped ? ERROR_CALLBACK_ERROR : ERROR_SUCCESS;
 }
 
 
@@ -874,61 +2902,76 @@ char* yr_get_error_message(YARA_CONTEXT* context, char* buffer, int buffer_size)
 		    snprintf(buffer, buffer_size, "include circular reference");
                 case ERROR_INCLUDE_DEPTH_EXCEEDED:
                     snprintf(buffer, buffer_size, "too many levels of included rules");
-            break;		    
+            break;
+		case ERROR_UNCACHEABLE_RULES:
+		    snprintf(buffer, buffer_size, "rules using external variables can't be cached");
+			break;
+		case ERROR_NOT_SCANNED:
+		    snprintf(buffer, buffer_size, "not scanned");
+			break;
+		case ERROR_SCAN_TIMEOUT:
+		    snprintf(buffer, buffer_size, "scan timed out");
+			break;
+		case ERROR_MEMORY_LIMIT_EXCEEDED:
+		    snprintf(buffer, buffer_size, "memory limit exceeded");
+			break;
+		case ERROR_AMBIGUOUS_IDENTIFIER:
+		    snprintf(buffer, buffer_size, "identifier \"%s\" is used as a variable but it's also a rule", context->last_error_extra_info);
+			break;
+		case ERROR_RULE_REFERENCED:
+		    snprintf(buffer, buffer_size, "rule \"%s\" is referenced by other rules", context->last_error_extra_info);
+			break;
 	}
 	
     return buffer;
 }
 
 
-int yr_calculate_rules_weight(YARA_CONTEXT* context)
+static int hash_table_weight(HASH_TABLE* hash_table)
 {
-    STRING_LIST_ENTRY* entry;
-
-    int i,j, count, weight = 0;
+    HASH_TABLE_ENTRY* entry;
+    STRING* string;
 
-    if (!context->hash_table.populated)
-    {        
-        populate_hash_table(&context->hash_table, &context->rule_list);
-    }
+    unsigned int b, i, count;
+    int weight = 0;
     
-    for (i = 0; i < 256; i++)
-    {   
-        for (j = 0; j < 256; j++)
-        {
-            entry = context->hash_table.hashed_strings_2b[i][j];
-        
-            count = 0;
+    if (!hash_table->populated)
+        return 0;
+    
+    for (b = 0; b < HASH_BUCKETS; b++)
+    {
+        entry = BUCKET_ENTRIES(hash_table, b);
+        count = BUCKET_SIZE(hash_table, b);
         
-            while (entry != NULL)
-            {         
-                weight += string_weight(entry->string, 1);               
-                entry = entry->next;
-                count++;
-            }
+        for (i = 0; i < count; i++)
+        {
+            /* skip the strings of removed rules */
             
-            weight += count;
-        }
-        
-        entry = context->hash_table.hashed_strings_1b[i];
-    
-        count = 0;
-    
-        while (entry != NULL)
-        {         
-            weight += string_weight(entry->string, 2);               
-            entry = entry->next;
-            count++;
+            if (hash_table->descriptors[entry[i].descriptor].owners_count == 0)
+                continue;
+                
+            string = hash_table->descriptors[entry[i].descriptor].owners[0];
+            
+            if (b < HASH_BUCKET_1B(0))
+                weight += string_weight(string, 1) + 1;
+            else if (b < HASH_BUCKET_NON_HASHED)
+                weight += string_weight(string, 2);
+            else if (b == HASH_BUCKET_NON_HASHED)
+                weight += string_weight(string, 4);
+            else
+                weight += string_weight(string, 1);
         }
     }
     
-    entry = context->hash_table.non_hashed_strings;
-    
-    while (entry != NULL)
-    {
-        weight += string_weight(entry->string, 4);
-    }
-    
     return weight;
 }
 
+
+int yr_calculate_rules_weight(YARA_CONTEXT* context)
+{
+    if (index_rules(context) != ERROR_SUCCESS)
+        return 0;
+    
+    return hash_table_weight(&context->hash_table) + hash_table_weight(&context->delta_table);
+}
+
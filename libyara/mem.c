@@ -14,78 +14,612 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <string.h>
+#include <pthread.h>
+
+#include "mem.h"
+#include "yara.h"
+
 #ifdef WIN32
 
 #include <windows.h>
 
 static HANDLE hHeap;
 
+static void* system_malloc(size_t size)
+{
+    return (void*) HeapAlloc(hHeap, HEAP_ZERO_MEMORY, size);
+}
+
+
+static void* system_realloc(void* ptr, size_t size)
+{
+    return (void*) HeapReAlloc(hHeap, HEAP_ZERO_MEMORY, ptr, size);
+}
+
+
+static void system_free(void* ptr)
+{
+    HeapFree(hHeap, 0, ptr);
+}
+
+#else
+
+#include <stdlib.h>
+
+static void* system_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+
+static void* system_realloc(void* ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+
+static void system_free(void* ptr)
+{
+    free(ptr);
+}
+
+#endif
+
+/*
+    Small blocks are recycled through pools, one for each size class. Every 
+    thread keeps a cache of free blocks of each class and only goes to the 
+    shared pool, which needs a lock, when its cache runs empty or grows too 
+    big. Blocks start with a header telling their class, blocks too big for 
+    any class come straight from the system and go back to it when freed.
+*/
+
+#define POOL_CACHE_BLOCKS       64          /* free blocks a thread keeps for each class */
+#define POOL_SHARED_BLOCKS      4096        /* free blocks the shared pool keeps for each class */
+#define POOL_CLASSES            MEMORY_LARGE_CLASS
+
+#define CLASS_SIZE(c)           ((size_t) MEMORY_MIN_CLASS_SIZE << (c))
+
+typedef struct _BLOCK_HEADER
+{
+    size_t                  size;           /* bytes requested */
+    size_t                  size_class;
+    
+} BLOCK_HEADER;
+
+
+typedef struct _FREE_BLOCK
+{
+    struct _FREE_BLOCK*     next;
+    
+} FREE_BLOCK;
+
+
+typedef struct _THREAD_CACHE
+{
+    FREE_BLOCK*             blocks[POOL_CLASSES];
+    unsigned int            blocks_count[POOL_CLASSES];
+    MEMORY_STATS            stats;
+    struct _THREAD_CACHE*   next;
+    struct _THREAD_CACHE*   prev;
+    
+} THREAD_CACHE;
+
+
+static pthread_key_t cache_key;
+static pthread_mutex_t pool_lock;
+static int pool_ready = FALSE;
+
+/* the following are protected by pool_lock */
+
+static FREE_BLOCK* shared_blocks[POOL_CLASSES];
+static unsigned int shared_blocks_count[POOL_CLASSES];
+static THREAD_CACHE* caches = NULL;         /* caches of the running threads */
+static MEMORY_STATS retired_stats;          /* counters of the threads already gone */
+
+
+static size_t size_class(size_t size)
+{
+    size_t c = 0;
+    
+    while (c < POOL_CLASSES && CLASS_SIZE(c) < size)
+        c++;
+        
+    return c;
+}
+
+
+static void add_stats(MEMORY_STATS* to, MEMORY_STATS* from)
+{
+    int i;
+    
+    for (i = 0; i < MEMORY_SIZE_CLASSES; i++)
+    {
+        to->calls[i] += from->calls[i];
+        to->bytes[i] += from->bytes[i];
+    }
+}
+
+/*
+    Moves blocks from the thread's cache to the shared pool until only keep 
+    of them are left, blocks not fitting in the pool are given back to the 
+    system.
+*/
+
+static void flush_cache(THREAD_CACHE* cache, size_t c, unsigned int keep)
+{
+    FREE_BLOCK* block;
+    FREE_BLOCK* excess = NULL;
+    
+    pthread_mutex_lock(&pool_lock);
+    
+    while (cache->blocks_count[c] > keep)
+    {
+        block = cache->blocks[c];
+        cache->blocks[c] = block->next;
+        cache->blocks_count[c]--;
+        
+        if (shared_blocks_count[c] < POOL_SHARED_BLOCKS)
+        {
+            block->next = shared_blocks[c];
+            shared_blocks[c] = block;
+            shared_blocks_count[c]++;
+        }
+        else
+        {
+            block->next = excess;
+            excess = block;
+        }
+    }
+    
+    pthread_mutex_unlock(&pool_lock);
+    
+    while (excess != NULL)
+    {
+        block = excess;
+        excess = excess->next;
+        system_free(block);
+    }
+}
+
+
+static void refill_cache(THREAD_CACHE* cache, size_t c)
+{
+    FREE_BLOCK* block;
+    
+    pthread_mutex_lock(&pool_lock);
+    
+    while (shared_blocks[c] != NULL && cache->blocks_count[c] < POOL_CACHE_BLOCKS / 2)
+    {
+        block = shared_blocks[c];
+        shared_blocks[c] = block->next;
+        shared_blocks_count[c]--;
+        
+        block->next = cache->blocks[c];
+        cache->blocks[c] = block;
+        cache->blocks_count[c]++;
+    }
+    
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+    Called when a thread exits, and by yr_heap_free for the calling thread.
+*/
+
+static void release_thread_cache(void* ptr)
+{
+    THREAD_CACHE* cache = (THREAD_CACHE*) ptr;
+    size_t c;
+    
+    for (c = 0; c < POOL_CLASSES; c++)
+        flush_cache(cache, c, 0);
+    
+    pthread_mutex_lock(&pool_lock);
+    
+    add_stats(&retired_stats, &cache->stats);
+    
+    if (cache->prev != NULL)
+        cache->prev->next = cache->next;
+    else
+        caches = cache->next;
+        
+    if (cache->next != NULL)
+        cache->next->prev = cache->prev;
+    
+    pthread_mutex_unlock(&pool_lock);
+    
+    system_free(cache);
+}
+
+
+static THREAD_CACHE* get_thread_cache()
+{
+    THREAD_CACHE* cache;
+    
+    if (!pool_ready)
+        return NULL;
+        
+    cache = (THREAD_CACHE*) pthread_getspecific(cache_key);
+    
+    if (cache == NULL)
+    {
+        cache = (THREAD_CACHE*) system_malloc(sizeof(THREAD_CACHE));
+        
+        if (cache == NULL)
+            return NULL;
+            
+        memset(cache, 0, sizeof(THREAD_CACHE));
+        
+        pthread_mutex_lock(&pool_lock);
+        
+        cache->next = caches;
+        
+        if (caches != NULL)
+            caches->prev = cache;
+            
+        caches = cache;
+        
+        pthread_mutex_unlock(&pool_lock);
+        
+        pthread_setspecific(cache_key, cache);
+    }
+    
+    return cache;
+}
+
+
 void yr_heap_alloc()
 {
+    if (pool_ready)
+        return;
+        
+    #ifdef WIN32
     hHeap = HeapCreate(0, 0x8000, 0);
+    #endif
+    
+    memset(shared_blocks, 0, sizeof(shared_blocks));
+    memset(shared_blocks_count, 0, sizeof(shared_blocks_count));
+    memset(&retired_stats, 0, sizeof(retired_stats));
+    
+    pthread_mutex_init(&pool_lock, NULL);
+    pthread_key_create(&cache_key, release_thread_cache);
+    
+    pool_ready = TRUE;
 }
 
+
 void yr_heap_free()
 {
+    THREAD_CACHE* cache;
+    FREE_BLOCK* block;
+    size_t c;
+    
+    if (!pool_ready)
+        return;
+    
+    cache = (THREAD_CACHE*) pthread_getspecific(cache_key);
+    
+    if (cache != NULL)
+    {
+        pthread_setspecific(cache_key, NULL);
+        release_thread_cache(cache);
+    }
+    
+    for (c = 0; c < POOL_CLASSES; c++)
+    {
+        while (shared_blocks[c] != NULL)
+        {
+            block = shared_blocks[c];
+            shared_blocks[c] = block->next;
+            system_free(block);
+        }
+        
+        shared_blocks_count[c] = 0;
+    }
+    
+    pool_ready = FALSE;
+    
+    pthread_key_delete(cache_key);
+    pthread_mutex_destroy(&pool_lock);
+    
+    #ifdef WIN32
     HeapDestroy(hHeap);
+    #endif
 }
 
+
 void* yr_malloc(size_t size)
 {
-    return (void*) HeapAlloc(hHeap, HEAP_ZERO_MEMORY, size);
+    THREAD_CACHE* cache = get_thread_cache();
+    BLOCK_HEADER* header = NULL;
+    size_t c = size_class(size);
+    
+    if (cache != NULL)
+    {
+        cache->stats.calls[c]++;
+        cache->stats.bytes[c] += size;
+        
+        if (c < POOL_CLASSES)
+        {
+            if (cache->blocks[c] == NULL)
+                refill_cache(cache, c);
+                
+            if (cache->blocks[c] != NULL)
+            {
+                header = (BLOCK_HEADER*) cache->blocks[c];
+                cache->blocks[c] = cache->blocks[c]->next;
+                cache->blocks_count[c]--;
+            }
+        }
+    }
+    
+    if (header == NULL)
+    {
+        header = (BLOCK_HEADER*) system_malloc(sizeof(BLOCK_HEADER) + ((c < POOL_CLASSES) ? CLASS_SIZE(c) : size));
+        
+        if (header == NULL)
+            return NULL;
+    }
+    
+    header->size = size;
+    header->size_class = c;
+    
+    return header + 1;
 }
 
 
-void yr_free(void* ptr)
+void* yr_realloc(void* ptr, size_t size)
 {
-    HeapFree(hHeap, 0, ptr);
+    BLOCK_HEADER* header;
+    THREAD_CACHE* cache;
+    void* new_ptr;
+    
+    if (ptr == NULL)
+        return yr_malloc(size);
+        
+    header = (BLOCK_HEADER*) ptr - 1;
+    
+    /* blocks having room enough are kept */
+    
+    if (header->size_class < POOL_CLASSES && size <= CLASS_SIZE(header->size_class))
+    {
+        header->size = size;
+        return ptr;
+    }
+    
+    if (header->size_class == POOL_CLASSES && size_class(size) == POOL_CLASSES)
+    {
+        header = (BLOCK_HEADER*) system_realloc(header, sizeof(BLOCK_HEADER) + size);
+        
+        if (header == NULL)
+            return NULL;
+        
+        cache = get_thread_cache();
+        
+        if (cache != NULL)
+        {
+            cache->stats.calls[POOL_CLASSES]++;
+            cache->stats.bytes[POOL_CLASSES] += size;
+        }
+        
+        header->size = size;
+        return header + 1;
+    }
+    
+    new_ptr = yr_malloc(size);
+    
+    if (new_ptr == NULL)
+        return NULL;
+    
+    memcpy(new_ptr, ptr, (header->size < size) ? header->size : size);
+    yr_free(ptr);
+    
+    return new_ptr;
 }
 
 
-char* yr_strdup(const char *s)
+void yr_free(void *ptr)
 {
-    size_t len;
-    char *r;
+    BLOCK_HEADER* header;
+    THREAD_CACHE* cache;
+    FREE_BLOCK* block;
+    size_t c;
+    
+    if (ptr == NULL)
+        return;
+        
+    header = (BLOCK_HEADER*) ptr - 1;
+    c = header->size_class;
     
-    len = strlen(s);
+    if (c < POOL_CLASSES && (cache = get_thread_cache()) != NULL)
+    {
+        block = (FREE_BLOCK*) header;
+        block->next = cache->blocks[c];
+        cache->blocks[c] = block;
+        cache->blocks_count[c]++;
+        
+        if (cache->blocks_count[c] > POOL_CACHE_BLOCKS)
+            flush_cache(cache, c, POOL_CACHE_BLOCKS / 2);
+            
+        return;
+    }
     
-    r = yr_malloc(len + 1);
+    system_free(header);
+}
+
+
+char* yr_strdup(const char *s)
+{
+    size_t len = strlen(s);
+    char* r = (char*) yr_malloc(len + 1);
     
-    strcpy(r, s);
+    if (r != NULL)
+        memcpy(r, s, len + 1);
     
     return r;
 }
 
-#else
+/*
+    Counters of the threads still running are read while they may be 
+    updating them, so figures are approximate if other threads are 
+    allocating memory.
+*/
 
-#include <stdlib.h>
-#include <string.h>
+void yr_get_memory_stats(MEMORY_STATS* stats)
+{
+    THREAD_CACHE* cache;
+    
+    memset(stats, 0, sizeof(MEMORY_STATS));
+    
+    if (!pool_ready)
+        return;
+        
+    pthread_mutex_lock(&pool_lock);
+    
+    add_stats(stats, &retired_stats);
+    
+    for (cache = caches; cache != NULL; cache = cache->next)
+        add_stats(stats, &cache->stats);
+    
+    pthread_mutex_unlock(&pool_lock);
+}
 
-void yr_heap_alloc()
+
+#define ALIGN(x)            (((x) + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1))
+#define CHUNK_DATA(x)       ((unsigned char*) (x) + ALIGN(sizeof(ARENA_CHUNK)))
+
+ARENA_CHUNK* new_arena_chunk(size_t size)
 {
-    return;
+    ARENA_CHUNK* chunk = (ARENA_CHUNK*) yr_malloc(ALIGN(sizeof(ARENA_CHUNK)) + size);
+    
+    if (chunk != NULL)
+    {
+        chunk->next = NULL;
+        chunk->size = size;
+        chunk->used = 0;
+    }
+    
+    return chunk;
 }
 
-void yr_heap_free()
+ARENA* yr_arena_create()
 {
-    return;
+    ARENA* arena = (ARENA*) yr_malloc(sizeof(ARENA));
+    
+    if (arena != NULL)
+    {
+        arena->chunks = NULL;
+    }
+    
+    return arena;
 }
 
-void* yr_malloc(size_t size)
+void yr_arena_destroy(ARENA* arena)
 {
-    return malloc(size);
+    ARENA_CHUNK* chunk;
+    ARENA_CHUNK* next_chunk;
+    
+    chunk = arena->chunks;
+    
+    while (chunk != NULL)
+    {
+        next_chunk = chunk->next;
+        yr_free(chunk);
+        chunk = next_chunk;
+    }
+    
+    yr_free(arena);
 }
 
+/*
+    Objects bigger than a quarter of a chunk get a chunk of their own, which 
+    is put behind the first one so that the space left in it is not wasted.
+*/
 
-void yr_free(void *ptr)
+void* yr_arena_alloc(ARENA* arena, size_t size)
 {
-    free(ptr);
+    ARENA_CHUNK* chunk;
+    void* ptr;
+    
+    size = ALIGN(size);
+    
+    if (size > ARENA_CHUNK_SIZE / 4)
+    {
+        chunk = new_arena_chunk(size);
+        
+        if (chunk == NULL)
+            return NULL;
+            
+        chunk->used = size;
+        
+        if (arena->chunks != NULL)
+        {
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        }
+        else
+        {
+            arena->chunks = chunk;
+        }
+        
+        return CHUNK_DATA(chunk);
+    }
+    
+    chunk = arena->chunks;
+    
+    if (chunk == NULL || chunk->size - chunk->used < size)
+    {
+        chunk = new_arena_chunk(ARENA_CHUNK_SIZE);
+        
+        if (chunk == NULL)
+            return NULL;
+            
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    
+    ptr = CHUNK_DATA(chunk) + chunk->used;
+    chunk->used += size;
+    
+    return ptr;
 }
 
+/*
+    Hands the chunks of other to arena, which frees them from now on. They
+    go behind the first chunk of arena, which is still the one used for new
+    objects.
+*/
 
-char* yr_strdup(const char *s)
+void yr_arena_merge(ARENA* arena, ARENA* other)
 {
-    return strdup(s);
+    ARENA_CHUNK* last;
+    
+    if (other->chunks == NULL)
+        return;
+    
+    if (arena->chunks == NULL)
+    {
+        arena->chunks = other->chunks;
+    }
+    else
+    {
+        for (last = other->chunks; last->next != NULL; last = last->next);
+        
+        last->next = arena->chunks->next;
+        arena->chunks->next = other->chunks;
+    }
+    
+    other->chunks = NULL;
 }
 
-#endif
\ No newline at end of file
+char* yr_arena_strdup(ARENA* arena, const char* s)
+{
+    size_t len = strlen(s);
+    char* r = (char*) yr_arena_alloc(arena, len + 1);
+    
+    if (r != NULL)
+        memcpy(r, s, len + 1);
+        
+    return r;
+}
@@ -22,9 +22,58 @@ limitations under the License.
 void yr_heap_alloc();
 void yr_heap_free();
 void* yr_malloc(size_t size);
+void* yr_realloc(void* ptr, size_t size);
 void yr_free(void *ptr);
 char* yr_strdup(const char *s);
 
+/*
+    Atomic operations for data shared by threads without a lock, they are 
+    plain operations without the GCC builtins
+*/
+
+#if defined(__GNUC__)
+#define ATOMIC_LOAD(x)          __atomic_load_n((x), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(x, v)      __atomic_store_n((x), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_INCREMENT(x)     __sync_add_and_fetch((x), 1)
+#define ATOMIC_DECREMENT(x)     __sync_sub_and_fetch((x), 1)
+#else
+#define ATOMIC_LOAD(x)          (*(x))
+#define ATOMIC_STORE(x, v)      (*(x) = (v))
+#define ATOMIC_INCREMENT(x)     (++(*(x)))
+#define ATOMIC_DECREMENT(x)     (--(*(x)))
+#endif
+
+/*
+    An arena hands out memory from big chunks and frees it all at once. The
+    objects making up the compiled rules come from the arena of their context,
+    as they live as long as the context does.
+*/
+
+#define ARENA_CHUNK_SIZE        65536
+#define ARENA_ALIGNMENT         8
+
+typedef struct _ARENA_CHUNK
+{
+    struct _ARENA_CHUNK*    next;
+    size_t                  size;
+    size_t                  used;
+    
+} ARENA_CHUNK;
+
+
+typedef struct _ARENA
+{
+    ARENA_CHUNK*            chunks;         /* new objects go to the first one */
+    
+} ARENA;
+
+
+ARENA* yr_arena_create();
+void yr_arena_destroy(ARENA* arena);
+void* yr_arena_alloc(ARENA* arena, size_t size);
+char* yr_arena_strdup(ARENA* arena, const char* s);
+void yr_arena_merge(ARENA* arena, ARENA* other);
+
 #endif
 
 
@@ -17,28 +17,157 @@ limitations under the License.
 
 
 #ifdef WIN32
-
 #include <windows.h>
+#endif
+
+#include <string.h>
+
 #include "mem.h"
 #include "proc.h"
 
-int get_process_memory(int pid, MEMORY_BLOCK** first_block)
+#define REGIONS_INCREMENT   64
+
+/*
+    Tells if a region with the given REGION_FLAGS_* and path, which is NULL
+    when unknown, passes the filter requested by the caller.
+*/
+
+int region_wanted(int flags, const char* path, int region_flags, const char* region_path)
 {
-    PVOID address;
-    SIZE_T read;
+    if ((flags & region_flags) != region_flags)
+        return FALSE;
+        
+    if (region_path != NULL && (path == NULL || strstr(path, region_path) == NULL))
+        return FALSE;
+        
+    return TRUE;
+}
+
+/*
+    Appends a region to the process' region table, which is an array grown as 
+    needed. The regions are linked once the table is complete.
+*/
+
+int add_region(PROCESS_MEMORY* process, size_t base, size_t size, unsigned int* capacity)
+{
+    MEMORY_BLOCK* regions;
+    
+    if (process->regions_count == *capacity)
+    {
+        regions = (MEMORY_BLOCK*) yr_realloc(process->regions, (*capacity + REGIONS_INCREMENT) * sizeof(MEMORY_BLOCK));
+        
+        if (regions == NULL)
+            return ERROR_INSUFICIENT_MEMORY;
+            
+        process->regions = regions;
+        *capacity += REGIONS_INCREMENT;
+    }
+    
+    process->regions[process->regions_count].data = NULL;
+    process->regions[process->regions_count].base = base;
+    process->regions[process->regions_count].size = size;
+    process->regions[process->regions_count].next = NULL;
+    process->regions_count++;
+    
+    return ERROR_SUCCESS;
+}
+
+void link_regions(PROCESS_MEMORY* process)
+{
+    unsigned int i;
+    
+    for (i = 1; i < process->regions_count; i++)
+    {
+        process->regions[i - 1].next = &process->regions[i];
+    }
+}
+
+PROCESS_MEMORY* new_process_memory(int pid)
+{
+    PROCESS_MEMORY* process = (PROCESS_MEMORY*) yr_malloc(sizeof(PROCESS_MEMORY));
+    
+    if (process != NULL)
+    {
+        process->regions = NULL;
+        process->regions_count = 0;
+        process->pid = pid;
+        process->mem = -1;
+        process->use_pread = FALSE;
+        process->handle = NULL;
+        process->page_size = 4096;
+    }
+    
+    return process;
+}
+
+void free_process_memory(PROCESS_MEMORY* process)
+{
+    if (process->regions != NULL)
+        yr_free(process->regions);
+        
+    yr_free(process);
+}
 
-    unsigned char* data;
 
+#ifdef WIN32
+
+/*
+    Windows doesn't tell the paths of the regions, so region_path is ignored.
+    Mapped views are reported as shared and private memory as anonymous.
+*/
+
+int region_flags_from_protection(MEMORY_BASIC_INFORMATION* mbi)
+{
+    int flags = 0;
+    
+    switch (mbi->Protect & 0xFF)
+    {
+        case PAGE_READONLY:
+            flags = REGION_FLAGS_READ;
+            break;
+        case PAGE_READWRITE:
+        case PAGE_WRITECOPY:
+            flags = REGION_FLAGS_READ | REGION_FLAGS_WRITE;
+            break;
+        case PAGE_EXECUTE:
+            flags = REGION_FLAGS_EXECUTE;
+            break;
+        case PAGE_EXECUTE_READ:
+            flags = REGION_FLAGS_READ | REGION_FLAGS_EXECUTE;
+            break;
+        case PAGE_EXECUTE_READWRITE:
+        case PAGE_EXECUTE_WRITECOPY:
+            flags = REGION_FLAGS_READ | REGION_FLAGS_WRITE | REGION_FLAGS_EXECUTE;
+            break;
+    }
+    
+    if (mbi->Protect & PAGE_GUARD)
+        flags = 0;
+    
+    if (mbi->Type == MEM_MAPPED)
+        flags |= REGION_FLAGS_SHARED;
+    else if (mbi->Type == MEM_PRIVATE)
+        flags |= REGION_FLAGS_ANONYMOUS;
+        
+    return flags;
+}
+
+int open_process_memory(int pid, int region_flags, const char* region_path, PROCESS_MEMORY** process)
+{
+    PVOID address;
+    
     SYSTEM_INFO si;
     MEMORY_BASIC_INFORMATION mbi;
 
-    MEMORY_BLOCK* new_block;
-    MEMORY_BLOCK* current_block = NULL;
-
     TOKEN_PRIVILEGES tokenPriv;
     LUID luidDebug;
     HANDLE hProcess;
     HANDLE hToken;
+    
+    unsigned int capacity = 0;
+    int result = ERROR_SUCCESS;
+
+    *process = NULL;
 
     if( OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &hToken) &&
         LookupPrivilegeValue(NULL, SE_DEBUG_NAME, &luidDebug))
@@ -52,62 +181,67 @@ int get_process_memory(int pid, MEMORY_BLOCK** first_block)
 
     hProcess = OpenProcess(PROCESS_VM_READ | PROCESS_QUERY_INFORMATION, FALSE, pid);
 
-    *first_block = NULL;
-
     if (hProcess == NULL)
     {
         return ERROR_COULD_NOT_ATTACH_TO_PROCESS;
     }
+    
+    *process = new_process_memory(pid);
+    
+    if (*process == NULL)
+    {
+        CloseHandle(hProcess);
+        return ERROR_INSUFICIENT_MEMORY;
+    }
+    
+    (*process)->handle = hProcess;
 
     GetSystemInfo(&si);
+    
+    (*process)->page_size = si.dwPageSize;
 
     address = si.lpMinimumApplicationAddress;
 
-    while (address < si.lpMaximumApplicationAddress)
+    while (address < si.lpMaximumApplicationAddress && result == ERROR_SUCCESS)
     {
-         if (VirtualQueryEx(hProcess, address, &mbi, sizeof(mbi)) != 0)
-         {
-             if (mbi.State == MEM_COMMIT && mbi.Protect != PAGE_NOACCESS)
-             {
-                 data = (unsigned char*) yr_malloc(mbi.RegionSize);
-
-                 if (data == NULL)
-                     return ERROR_INSUFICIENT_MEMORY;
-
-                 if (ReadProcessMemory(hProcess, address, data, mbi.RegionSize, &read))
-                 {
-                     new_block = (MEMORY_BLOCK*) yr_malloc(sizeof(MEMORY_BLOCK));
-
-                     if (new_block == NULL)
-                     {
-                         yr_free(data);
-                         return ERROR_INSUFICIENT_MEMORY;
-                     }
-
-                     if (*first_block == NULL)
-                         *first_block = new_block;
-
-                     new_block->base = (size_t) mbi.BaseAddress;
-                     new_block->size = mbi.RegionSize;
-                     new_block->data = data;
-                     new_block->next = NULL;
-
-                     if (current_block != NULL)
-                         current_block->next = new_block;
-
-                     current_block = new_block;
-                 }
-                 else
-                 {
-                     yr_free(data);
-                 }
-             }
-
-             address = (PVOID)((DWORD) mbi.BaseAddress + mbi.RegionSize);
-         }
-     }
+        if (VirtualQueryEx(hProcess, address, &mbi, sizeof(mbi)) == 0)
+            break;
+            
+        if (mbi.State == MEM_COMMIT && 
+            region_wanted(region_flags_from_protection(&mbi), NULL, region_flags | REGION_FLAGS_READ, NULL))
+        {
+            result = add_region(*process, (size_t) mbi.BaseAddress, mbi.RegionSize, &capacity);
+        }
+
+        address = (PVOID)((SIZE_T) mbi.BaseAddress + mbi.RegionSize);
+    }
+    
+    if (result != ERROR_SUCCESS)
+    {
+        close_process_memory(*process);
+        *process = NULL;
+        return result;
+    }
+    
+    link_regions(*process);
 
-     return ERROR_SUCCESS;
+    return ERROR_SUCCESS;
+}
+
+size_t read_process_memory(PROCESS_MEMORY* process, size_t address, unsigned char* buffer, size_t length)
+{
+    SIZE_T read;
+    
+    if (!ReadProcessMemory((HANDLE) process->handle, (LPCVOID) address, buffer, length, &read))
+        return 0;
+        
+    return read;
+}
+
+void close_process_memory(PROCESS_MEMORY* process)
+{
+    CloseHandle((HANDLE) process->handle);
+    free_process_memory(process);
 }
 
 #else
@@ -118,9 +252,6 @@ int get_process_memory(int pid, MEMORY_BLOCK** first_block)
 #include <sys/ptrace.h>
 #include <sys/wait.h>
 
-#include "mem.h"
-#include "proc.h"
-
 #if defined(__FreeBSD__) || defined(__MACH__)
 #define PTRACE_ATTACH PT_ATTACH
 #define PTRACE_DETACH PT_DETACH
@@ -133,8 +264,14 @@ int get_process_memory(int pid, MEMORY_BLOCK** first_block)
 #include <mach/vm_region.h>
 #include <mach/vm_statistics.h>
 
-int get_process_memory(pid_t pid, MEMORY_BLOCK** first_block)
+/*
+    Mach doesn't tell the paths of the regions nor if they are backed by a 
+    file, so region_path and REGION_FLAGS_ANONYMOUS are ignored.
+*/
+
+int open_process_memory(int pid, int region_flags, const char* region_path, PROCESS_MEMORY** process)
 {
+    int flags;
     task_t task;
     kern_return_t kr;
 
@@ -143,18 +280,29 @@ int get_process_memory(pid_t pid, MEMORY_BLOCK** first_block)
     vm_region_basic_info_data_64_t info;
     mach_msg_type_number_t info_count;
     mach_port_t object;
+    
+    unsigned int capacity = 0;
+    int result = ERROR_SUCCESS;
 
-    unsigned char* data;
-
-    MEMORY_BLOCK* new_block;
-    MEMORY_BLOCK* current_block = NULL;
-
-    *first_block = NULL;
+    *process = NULL;
 
     if ((kr = task_for_pid(mach_task_self(), pid, &task)) != KERN_SUCCESS)
     {
         return ERROR_COULD_NOT_ATTACH_TO_PROCESS;
     }
+    
+    *process = new_process_memory(pid);
+    
+    if (*process == NULL)
+    {
+        mach_port_deallocate(mach_task_self(), task);
+        return ERROR_INSUFICIENT_MEMORY;
+    }
+    
+    (*process)->handle = (void*) (size_t) task;
+    (*process)->page_size = vm_page_size;
+    
+    region_flags &= ~REGION_FLAGS_ANONYMOUS;
 
     do {
 
@@ -164,136 +312,285 @@ int get_process_memory(pid_t pid, MEMORY_BLOCK** first_block)
 
          if (kr == KERN_SUCCESS)
          {
-             data = (unsigned char*) yr_malloc(size);
-
-             if (data == NULL)
-                 return ERROR_INSUFICIENT_MEMORY;
-
-             if (vm_read_overwrite(task, address, size, (vm_address_t) data, &size) == KERN_SUCCESS)
-             {
-                 new_block = (MEMORY_BLOCK*) yr_malloc(sizeof(MEMORY_BLOCK));
-
-                 if (new_block == NULL)
-                 {
-                     yr_free(data);
-                     return ERROR_INSUFICIENT_MEMORY;
-                 }
-
-                 if (*first_block == NULL)
-                     *first_block = new_block;
-
-                 new_block->base = address;
-                 new_block->size = size;
-                 new_block->data = data;
-                 new_block->next = NULL;
-
-                 if (current_block != NULL)
-                     current_block->next = new_block;
-
-                 current_block = new_block;
-             }
-
+             flags = info.shared ? REGION_FLAGS_SHARED : 0;
+             
+             if (info.protection & VM_PROT_READ)
+                 flags |= REGION_FLAGS_READ;
+             if (info.protection & VM_PROT_WRITE)
+                 flags |= REGION_FLAGS_WRITE;
+             if (info.protection & VM_PROT_EXECUTE)
+                 flags |= REGION_FLAGS_EXECUTE;
+             
+             if (region_wanted(flags, NULL, region_flags | REGION_FLAGS_READ, NULL))
+                 result = add_region(*process, address, size, &capacity);
+                 
              address += size;
          }
 
+     } while (kr != KERN_INVALID_ADDRESS && result == ERROR_SUCCESS);
+     
+    if (result != ERROR_SUCCESS)
+    {
+        close_process_memory(*process);
+        *process = NULL;
+        return result;
+    }
+    
+    link_regions(*process);
 
-     } while (kr != KERN_INVALID_ADDRESS);
+    return ERROR_SUCCESS;
+}
 
-     if (task != MACH_PORT_NULL)
-     {
-          mach_port_deallocate(mach_task_self(), task);
-     }
+size_t read_process_memory(PROCESS_MEMORY* process, size_t address, unsigned char* buffer, size_t length)
+{
+    vm_size_t size = length;
+    
+    if (vm_read_overwrite((task_t) (size_t) process->handle, address, length, (vm_address_t) buffer, &size) != KERN_SUCCESS)
+        return 0;
+        
+    return size;
+}
 
-     return ERROR_SUCCESS;
+void close_process_memory(PROCESS_MEMORY* process)
+{
+    mach_port_deallocate(mach_task_self(), (task_t) (size_t) process->handle);
+    free_process_memory(process);
 }
 
 #else
 
 #include <errno.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
 
-int get_process_memory(pid_t pid, MEMORY_BLOCK** first_block)
-{
-    char buffer[256];
-    unsigned char* data;
-    size_t begin, end, length;
+#define READ_IOV_COUNT      256
 
-    MEMORY_BLOCK* new_block;
-    MEMORY_BLOCK* current_block = NULL;
+/*
+    The process is stopped with ptrace from here until close_process_memory,
+    that's required for reading its memory.
+    
+    Regions that can't be read and device mappings are never scanned, reading
+    the later could have side effects on the device. So isn't [vvar], which 
+    the kernel refuses to read anyway.
+*/
 
-    *first_block = NULL;
+int open_process_memory(int pid, int region_flags, const char* region_path, PROCESS_MEMORY** process)
+{
+    char buffer[4096 + 256];
+    char perms[5];
+    char* path;
+    char* newline;
+    size_t begin, end;
+    unsigned int major, minor;
+    unsigned long inode;
+    int path_offset;
+    int flags;
+    
+    unsigned int capacity = 0;
+    int result = ERROR_SUCCESS;
+    
+    FILE* maps;
+
+    *process = NULL;
 
     sprintf(buffer, "/proc/%u/maps", pid);
 
-    FILE* maps = fopen(buffer, "r");
+    maps = fopen(buffer, "r");
 
     if (maps == NULL)
     {
         return ERROR_COULD_NOT_ATTACH_TO_PROCESS;
     }
+    
+    *process = new_process_memory(pid);
+    
+    if (*process == NULL)
+    {
+        fclose(maps);
+        return ERROR_INSUFICIENT_MEMORY;
+    }
 
     sprintf(buffer, "/proc/%u/mem", pid);
 
-    int mem = open(buffer, O_RDONLY);
+    (*process)->mem = open(buffer, O_RDONLY);
+    (*process)->page_size = sysconf(_SC_PAGESIZE);
 
-    if (mem == -1)
+    if ((*process)->mem == -1)
     {
         fclose(maps);
+        free_process_memory(*process);
+        *process = NULL;
         return ERROR_COULD_NOT_ATTACH_TO_PROCESS;
     }
 
     if (ptrace(PTRACE_ATTACH, pid, NULL, 0) == -1)
     {
+        fclose(maps);
+        close((*process)->mem);
+        free_process_memory(*process);
+        *process = NULL;
         return ERROR_COULD_NOT_ATTACH_TO_PROCESS;
     }
 
-    wait(NULL);
+    waitpid(pid, NULL, 0);
 
-    while (fgets(buffer, sizeof(buffer), maps) != NULL)
+    while (fgets(buffer, sizeof(buffer), maps) != NULL && result == ERROR_SUCCESS)
     {
-        if (sscanf(buffer, "%lx-%lx", &begin, &end) != 2 || end < begin) {
+        /* begin-end perms offset major:minor inode path */
+        
+        if (sscanf(buffer, "%lx-%lx %4s %*x %x:%x %lu %n", 
+                   &begin, &end, perms, &major, &minor, &inode, &path_offset) != 6 || end < begin) {
           continue;
         }
+        
+        path = buffer + path_offset;
+        newline = strchr(path, '\n');
+        
+        if (newline != NULL)
+            *newline = '\0';
+            
+        if ((strncmp(path, "/dev/", 5) == 0 && strcmp(path, "/dev/zero") != 0) ||
+             strncmp(path, "[vvar", 5) == 0)
+            continue;
+        
+        flags = (inode == 0) ? REGION_FLAGS_ANONYMOUS : 0;
+        
+        if (perms[0] == 'r')
+            flags |= REGION_FLAGS_READ;
+        if (perms[1] == 'w')
+            flags |= REGION_FLAGS_WRITE;
+        if (perms[2] == 'x')
+            flags |= REGION_FLAGS_EXECUTE;
+        if (perms[3] == 's')
+            flags |= REGION_FLAGS_SHARED;
+
+        if (region_wanted(flags, path, region_flags | REGION_FLAGS_READ, region_path))
+            result = add_region(*process, begin, end - begin, &capacity);
+    }
 
-        length = end - begin;
+    fclose(maps);
+    
+    if (result != ERROR_SUCCESS)
+    {
+        close_process_memory(*process);
+        *process = NULL;
+        return result;
+    }
+    
+    link_regions(*process);
 
-        data = yr_malloc(length);
+    return ERROR_SUCCESS;
+}
 
-        if (data == NULL)
-            return ERROR_INSUFICIENT_MEMORY;
+#ifdef SYS_process_vm_readv
 
-        if (pread(mem, data, length, begin) != -1)
-        {
-            new_block = (MEMORY_BLOCK*) yr_malloc(sizeof(MEMORY_BLOCK));
+/*
+    Reads with process_vm_readv, which copies straight from the process 
+    without going through the file system. The kernel doesn't split an iovec
+    on a partial transfer, so the remote side is given page by page and the
+    read stops at the first page that can't be read instead of failing as a
+    whole. Returns -1 if process_vm_readv is not usable at all.
+*/
 
-            if (new_block == NULL)
-            {
-                yr_free(data);
-                return ERROR_INSUFICIENT_MEMORY;
-            }
+ssize_t read_process_pages(PROCESS_MEMORY* process, size_t address, unsigned char* buffer, size_t length)
+{
+    struct iovec local;
+    struct iovec remote[READ_IOV_COUNT];
+    
+    size_t total = 0;
+    size_t requested;
+    size_t next;
+    ssize_t read;
+    int count;
+    
+    while (total < length)
+    {
+        requested = 0;
+        
+        for (count = 0; count < READ_IOV_COUNT && total + requested < length; count++)
+        {
+            next = ((address + total + requested) | (process->page_size - 1)) + 1;
+            
+            if (next - address > length)
+                next = address + length;
+            
+            remote[count].iov_base = (void*) (address + total + requested);
+            remote[count].iov_len = next - (address + total + requested);
+            requested += remote[count].iov_len;
+        }
+        
+        local.iov_base = buffer + total;
+        local.iov_len = requested;
+        
+        read = syscall(SYS_process_vm_readv, process->pid, &local, 1, remote, count, 0);
+        
+        if (read == -1)
+        {
+            if (total == 0 && (errno == ENOSYS || errno == EPERM))
+                return -1;
+                
+            break;
+        }
+        
+        total += read;
+        
+        if ((size_t) read < requested)
+            break;
+    }
+    
+    return total;
+}
 
-            if (*first_block == NULL)
-                *first_block = new_block;
+#endif
 
-            new_block->base = begin;
-            new_block->size = length;
-            new_block->data = data;
-            new_block->next = NULL;
+/*
+    Returns the number of bytes read, which is less than length if the read 
+    reached a page that can't be read.
+*/
 
-            if (current_block != NULL)
-                current_block->next = new_block;
+size_t read_process_memory(PROCESS_MEMORY* process, size_t address, unsigned char* buffer, size_t length)
+{
+    size_t total = 0;
+    ssize_t read;
+    
+#ifdef SYS_process_vm_readv
 
-            current_block = new_block;
-        }
+    if (!process->use_pread)
+    {
+        read = read_process_pages(process, address, buffer, length);
+        
+        if (read >= 0)
+            return read;
+        
+        /* not available in this kernel or not allowed, use /proc/<pid>/mem */
+        
+        process->use_pread = TRUE;
     }
+    
+#endif
+    
+    while (total < length)
+    {
+        read = pread(process->mem, buffer + total, length - total, address + total);
+        
+        if (read == -1 && errno == EINTR)
+            continue;
+            
+        if (read <= 0)
+            break;
+            
+        total += read;
+    }
+    
+    return total;
+}
 
-    ptrace(PTRACE_DETACH, pid, NULL, 0);
-
-    close(mem);
-    fclose(maps);
-
-    return ERROR_SUCCESS;
+void close_process_memory(PROCESS_MEMORY* process)
+{
+    ptrace(PTRACE_DETACH, process->pid, NULL, 0);
+    close(process->mem);
+    free_process_memory(process);
 }
 
 #endif
 #endif
-
@@ -21,6 +21,28 @@ limitations under the License.
 
 #include "yara.h"
 
-int get_process_memory(int pid, MEMORY_BLOCK** first_block);
+/* 
+    The memory of a process being scanned. Only the table of its regions is 
+    kept, as memory blocks with no data, and the contents are read as needed 
+    with read_process_memory.
+*/
+
+typedef struct _PROCESS_MEMORY
+{
+    MEMORY_BLOCK*   regions;            /* linked in address order */
+    unsigned int    regions_count;
+    
+    int             pid;
+    int             mem;                /* /proc/<pid>/mem */
+    int             use_pread;          /* process_vm_readv is not available */
+    void*           handle;             /* process handle or task port */
+    size_t          page_size;
+    
+} PROCESS_MEMORY;
+
+
+int open_process_memory(int pid, int region_flags, const char* region_path, PROCESS_MEMORY** process);
+size_t read_process_memory(PROCESS_MEMORY* process, size_t address, unsigned char* buffer, size_t length);
+void close_process_memory(PROCESS_MEMORY* process);
 
 #endif
@@ -17,6 +17,7 @@ limitations under the License.
 #include <string.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <stdlib.h>
 
 #include "filemap.h"
 #include "yara.h"
@@ -27,6 +28,7 @@ limitations under the License.
 #include "eval.h"
 #include "regex.h"
 #include "scan.h"
+#include "hash.h"
 
 #ifndef TRUE
 #define TRUE 1
@@ -40,8 +42,8 @@ limitations under the License.
 #define inline __inline
 #endif
 
-// thread sync
-extern pthread_mutex_t match_lock;
+#define LOCK_MATCHES(x)     do { if ((x)->threads_searching > 1) pthread_mutex_lock(&(x)->match_lock); } while (0)
+#define UNLOCK_MATCHES(x)   do { if ((x)->threads_searching > 1) pthread_mutex_unlock(&(x)->match_lock); } while (0)
 
 static char lowercase[256];
 static char altercase[256];
@@ -342,22 +344,14 @@ int regexp_match(unsigned char* buffer, size_t buffer_size, unsigned char* patte
         return 0;
 }
 
-int populate_hash_table(HASH_TABLE* hash_table, RULE_LIST* rule_list)
+/*
+    Initializes the lookup tables used while scanning. Called once from
+    yr_init, as the tables are shared by all contexts.
+*/
+
+void init_scan_tables()
 {
-    RULE* rule;
-    STRING* string;
-    STRING_LIST_ENTRY* entry;
-    
-    unsigned char first[256];
-    unsigned char second[2];
-    
-    unsigned char f;
-    unsigned char s;
-    
-    int fcount;
-    int scount;
-    
-    int i, j;
+    int i;
     
     for (i = 0; i < 256; i++)
     {
@@ -393,256 +387,1030 @@ int populate_hash_table(HASH_TABLE* hash_table, RULE_LIST* rule_list)
     isregexescapable['$'] = 1;
     isregexescapable['|'] = 1;
     isregexescapable['\\'] = 1;
-        
-    rule = rule_list->head;
+}
+
+/*
+    While populating the hash table strings with the same pattern and 
+    modifiers are given the same descriptor, and the buckets of each 
+    descriptor are recorded in a temporary array of keys, which is then 
+    sorted by bucket into the table's entries. Entries, descriptors, owners
+    and offsets are allocated with yr_malloc and belong to the table, which
+    frees them in free_hash_table, so the table can be populated again after
+    the rules change.
+*/
+
+#define PATTERN_FLAGS   (STRING_FLAGS_HEXADECIMAL | STRING_FLAGS_NO_CASE | STRING_FLAGS_ASCII | \
+                         STRING_FLAGS_WIDE | STRING_FLAGS_REGEXP | STRING_FLAGS_FULL_WORD)
+
+typedef struct _HASH_KEY
+{
+    unsigned int    bucket;
+    unsigned int    descriptor;
     
-    while (rule != NULL)
-    {
-        string = rule->string_list_head;
+} HASH_KEY;
 
-        while (string != NULL)
-        {
-            fcount = 0;
-            scount = 0;
-            f = 0;
-            s = 0;
+typedef struct _HASH_KEYS
+{
+    HASH_KEY*       keys;
+    unsigned int    count;
+    unsigned int    capacity;
+    unsigned int    first;              /* first key of the current descriptor */
+    unsigned int    descriptor;
+    
+} HASH_KEYS;
+
+
+static int add_hash_key(HASH_KEYS* keys, unsigned int bucket)
+{
+    HASH_KEY* new_keys;
+    unsigned int capacity;
+    unsigned int i;
+    
+    /* bytes without case give the same key twice for nocase strings */
+    
+    for (i = keys->first; i < keys->count; i++)
+    {
+        if (keys->keys[i].bucket == bucket)
+            return ERROR_SUCCESS;
+    }
+    
+    if (keys->count == keys->capacity)
+    {
+        capacity = (keys->capacity == 0) ? 256 : keys->capacity * 2;
+        new_keys = (HASH_KEY*) yr_realloc(keys->keys, capacity * sizeof(HASH_KEY));
+        
+        if (new_keys == NULL)
+            return ERROR_INSUFICIENT_MEMORY;
             
-            if (string->flags & STRING_FLAGS_REGEXP)
-            {                               
-                int pos = 0;
+        keys->keys = new_keys;
+        keys->capacity = capacity;
+    }
+    
+    keys->keys[keys->count].bucket = bucket;
+    keys->keys[keys->count].descriptor = keys->descriptor;
+    keys->count++;
+    
+    return ERROR_SUCCESS;
+}
 
-                if (string->string[0] == '^')
-                {
-                    pos++;
-                }
+/*
+    Adds the keys for the buckets given by the first bytes of the string.
+*/
 
-                if (string->length > pos)
-                {
-                    // Get first character for hash map.
-                    if (string->string[pos] == '\\' && string->length > pos + 1)
-                    {
-                        if (isregexescapable[string->string[pos+1]])
-                        {
-                            f = string->string[pos+1];
-                            pos += 2;
-                        }
-                    }
-                    else
-                    {
-                        if (isregexhashable[string->string[pos]])
-                        {
-                            f = string->string[pos];
-                            pos++;
-                        }
-                    }
-                }
-                
-                if (f && string->length > pos)
-                {
-                    // Get second character for hash map.
-                    if (string->string[pos] == '\\' && string->length > pos + 1)
-                    {
-                        if (isregexescapable[string->string[pos+1]])
-                        {
-                            s = string->string[pos+1];
-                            pos += 2;
-                        }
-                    }
-                    else
-                    {
-                        if (isregexhashable[string->string[pos]])
-                        {
-                            s = string->string[pos];
-                            pos++;
-                        }
-                    }
-                }
-                // If f is set then it can be used in hashtable
+static int add_string_keys(HASH_KEYS* keys, STRING* string)
+{
+    unsigned char first[256];
+    unsigned char second[2];
+    
+    unsigned char f;
+    unsigned char s;
+    
+    int fcount;
+    int scount;
+    
+    int result = ERROR_SUCCESS;
+    int i, j;
+    
+    fcount = 0;
+    scount = 0;
+    f = 0;
+    s = 0;
+    
+    if (string->flags & STRING_FLAGS_REGEXP)
+    {                               
+        int pos = 0;
+
+        if (string->string[0] == '^')
+        {
+            pos++;
+        }
 
-                if (f)
+        if (string->length > pos)
+        {
+            // Get first character for hash map.
+            if (string->string[pos] == '\\' && string->length > pos + 1)
+            {
+                if (isregexescapable[string->string[pos+1]])
                 {
-                    first[fcount++] = f;
-                    
-                    if (string->flags & STRING_FLAGS_NO_CASE)
-                        first[fcount++] = altercase[f];
-                                
-                    if (s)
-                    {
-                        second[scount++] = s;
-            
-                        if (string->flags & STRING_FLAGS_NO_CASE)
-                            second[scount++] = altercase[s];
-                    }
+                    f = string->string[pos+1];
+                    pos += 2;
                 }
-                
-                if (fcount == 0)
+            }
+            else
+            {
+                if (isregexhashable[string->string[pos]])
                 {
-                    fcount += regex_get_first_bytes(&(string->re), first);
+                    f = string->string[pos];
+                    pos++;
                 }
-                
             }
-            else if (string->flags & STRING_FLAGS_HEXADECIMAL)
+        }
+        
+        if (f && string->length > pos)
+        {
+            // Get second character for hash map.
+            if (string->string[pos] == '\\' && string->length > pos + 1)
             {
-                if (string->mask[0] == 0xFF) 
-                    first[fcount++] = string->string[0];
-                
-                if (string->mask[1] == 0xFF)
-                    second[scount++] = string->string[1];
+                if (isregexescapable[string->string[pos+1]])
+                {
+                    s = string->string[pos+1];
+                    pos += 2;
+                }
             }
-            else 
+            else
             {
-                first[fcount++] = string->string[0];
-                
-                if (string->length > 1)
-                    second[scount++] = string->string[1];
-                
-                if (string->flags & STRING_FLAGS_NO_CASE)
+                if (isregexhashable[string->string[pos]])
                 {
-                    first[fcount++] = altercase[string->string[0]];
-                    
-                    if (string->length > 1)
-                        second[scount++] = altercase[string->string[1]];
+                    s = string->string[pos];
+                    pos++;
                 }
             }
+        }
+        // If f is set then it can be used in hashtable
+
+        if (f)
+        {
+            first[fcount++] = f;
             
-            for (i = 0; i < fcount; i++)
+            if (string->flags & STRING_FLAGS_NO_CASE)
+                first[fcount++] = altercase[f];
+                        
+            if (s)
             {
-                for (j = 0; j < scount; j++)
-                {
-                    entry = (STRING_LIST_ENTRY*) yr_malloc(sizeof(STRING_LIST_ENTRY));
+                second[scount++] = s;
+    
+                if (string->flags & STRING_FLAGS_NO_CASE)
+                    second[scount++] = altercase[s];
+            }
+        }
+        
+        if (fcount == 0)
+        {
+            fcount += regex_get_first_bytes(&(string->re), first);
+        }
+        
+    }
+    else if (string->flags & STRING_FLAGS_HEXADECIMAL)
+    {
+        if (string->mask[0] == 0xFF) 
+            first[fcount++] = string->string[0];
+        
+        if (string->mask[1] == 0xFF)
+            second[scount++] = string->string[1];
+    }
+    else 
+    {
+        first[fcount++] = string->string[0];
+        
+        if (string->length > 1)
+            second[scount++] = string->string[1];
+        
+        if (string->flags & STRING_FLAGS_NO_CASE)
+        {
+            first[fcount++] = altercase[string->string[0]];
+            
+            if (string->length > 1)
+                second[scount++] = altercase[string->string[1]];
+        }
+    }
+    
+    for (i = 0; i < fcount && result == ERROR_SUCCESS; i++)
+    {
+        for (j = 0; j < scount && result == ERROR_SUCCESS; j++)
+        {
+            result = add_hash_key(keys, HASH_BUCKET_2B(first[i], second[j]));
+        }
+        
+        if (scount == 0 && result == ERROR_SUCCESS)
+        {
+            result = add_hash_key(keys, HASH_BUCKET_1B(first[i]));
+        }
+    }
+    
+    if (fcount == 0 && result == ERROR_SUCCESS)
+    {
+        result = add_hash_key(keys, HASH_BUCKET_NON_HASHED);
+    }
+    
+    return result;
+}
 
-                    if (entry == NULL)
-                        return ERROR_INSUFICIENT_MEMORY;
-                        
-                    entry->next = hash_table->hashed_strings_2b[first[i]][second[j]];
-                    entry->string = string;
-                    hash_table->hashed_strings_2b[first[i]][second[j]] = entry;
+/*
+    Length of a hex string's mask, skip instructions are followed by their 
+    operands, which could be mistaken for MASK_END.
+*/
+
+static int mask_length(unsigned char* mask)
+{
+    int i = 0;
+    
+    while (mask[i] != MASK_END)
+    {
+        if (mask[i] == MASK_EXACT_SKIP)
+            i += 2;
+        else if (mask[i] == MASK_RANGE_SKIP)
+            i += 3;
+        else
+            i++;
+    }
+    
+    return i;
+}
+
+
+/*
+    Bytes a match of a hex string spans at most, skips are counted at their 
+    longest and alternatives by the longest of them.
+*/
+
+static unsigned int hex_span(unsigned char* mask)
+{
+    unsigned int span = 0;
+    unsigned int alternative, longest;
+    int m = 0;
+    
+    while (mask[m] != MASK_END)
+    {
+        if (mask[m] == MASK_EXACT_SKIP)
+        {
+            span += mask[m + 1];
+            m += 2;
+        }
+        else if (mask[m] == MASK_RANGE_SKIP)
+        {
+            span += mask[m + 2];
+            m += 3;
+        }
+        else if (mask[m] == MASK_OR)
+        {
+            longest = 0;
+            
+            while (mask[m] != MASK_OR_END)
+            {
+                alternative = 0;
+                m++;
                 
+                while (mask[m] != MASK_OR && mask[m] != MASK_OR_END)
+                {
+                    alternative++;
+                    m++;
                 }
                 
-                if (scount == 0)
-                {
-                    entry = (STRING_LIST_ENTRY*) yr_malloc(sizeof(STRING_LIST_ENTRY));
+                if (alternative > longest)
+                    longest = alternative;
+            }
+            
+            span += longest;
+            m++;
+        }
+        else
+        {
+            span++;
+            m++;
+        }
+    }
+    
+    return span;
+}
 
-                    if (entry == NULL)
-                        return ERROR_INSUFICIENT_MEMORY;
+/*
+    Bytes a match of the string and what's looked at around it span at 
+    most, or zero if its matches have no bound, as it happens with regular 
+    expressions.
+*/
 
-                    entry->next = hash_table->hashed_strings_1b[first[i]];
-                    entry->string = string;
-                    hash_table->hashed_strings_1b[first[i]] = entry;
-                }
+static unsigned int string_span(STRING* string)
+{
+    unsigned int span;
+    
+    if (IS_REGEXP(string))
+        return 0;
+    
+    if (IS_HEX(string))
+        span = hex_span(string->mask);
+    else if (IS_WIDE(string))
+        span = string->length * 2;
+    else
+        span = string->length;
+    
+    /* full word strings look at the character after the match */
+    
+    if (IS_FULL_WORD(string))
+        span += 2;
+    
+    return span;
+}
+
+
+static int same_pattern(STRING* a, STRING* b)
+{
+    if ((a->flags & PATTERN_FLAGS) != (b->flags & PATTERN_FLAGS) || 
+        a->length != b->length || 
+        memcmp(a->string, b->string, a->length) != 0)
+    {
+        return FALSE;
+    }
+    
+    if (IS_HEX(a))
+    {
+        return mask_length(a->mask) == mask_length(b->mask) && 
+               memcmp(a->mask, b->mask, mask_length(a->mask)) == 0;
+    }
+    
+    return TRUE;
+}
+
+
+static void fill_string_descriptor(STRING_DESCRIPTOR* descriptor, STRING* string)
+{
+    descriptor->flags = string->flags & ~STRING_FLAGS_FOUND;
+    descriptor->length = string->length;
+    descriptor->string = string->string;
+    
+    if (IS_REGEXP(string))
+        descriptor->re = string->re;
+    else
+        descriptor->mask = string->mask;
+}
+
+
+static void fill_hash_table_entry(HASH_TABLE_ENTRY* entry, STRING_DESCRIPTOR* descriptor, unsigned int index)
+{
+    STRING* string = descriptor->owners[0];
+    unsigned int i;
+    
+    entry->descriptor = index;
+    entry->rule_index = string->rule->index;
+    entry->flags = string->flags & (STRING_FLAGS_ASCII | STRING_FLAGS_WIDE | STRING_FLAGS_HEXADECIMAL);
+    entry->length = 0;
+    entry->prefix_length = 0;
+    
+    for (i = 1; i < descriptor->owners_count; i++)
+    {
+        if (descriptor->owners[i]->rule->index != entry->rule_index)
+            entry->rule_index = SHARED_PATTERN;
+    }
+    
+    if (string->flags & (STRING_FLAGS_REGEXP | STRING_FLAGS_HEXADECIMAL))
+        return;
+    
+    entry->length = string->length;
+    
+    if (string->flags & STRING_FLAGS_NO_CASE)
+        return;
+    
+    for (i = 0; i < string->length && i < sizeof(entry->prefix); i++)
+    {
+        entry->prefix[i] = string->string[i];
+    }
+    
+    entry->prefix_length = i;
+}
+
+
+void free_hash_table(HASH_TABLE* hash_table)
+{
+    yr_free(hash_table->offsets);
+    yr_free(hash_table->entries);
+    yr_free(hash_table->descriptors);
+    yr_free(hash_table->owners);
+    
+    memset(hash_table, 0, sizeof(HASH_TABLE));
+}
+
+
+/*
+    Builds the hash table for the strings of the rules with an index equal
+    or greater than first_index, freeing the arrays it had before.
+*/
+
+int populate_hash_table(HASH_TABLE* hash_table, RULE_LIST* rule_list, unsigned int first_index)
+{
+    RULE* rule;
+    STRING* string;
+    STRING_DESCRIPTOR* descriptor;
+    STRING** owners;
+    HASH_KEYS keys;
+    
+    STRING** patterns = NULL;           /* the first string having each descriptor */
+    unsigned int* pattern_of = NULL;    /* descriptor of each string by index */
+    unsigned int* slots = NULL;         /* descriptors plus one by pattern hash */
+    unsigned int slots_count = 1;
+    unsigned int strings_count = 0;
+    unsigned int max_index = 0;
+    unsigned int patterns_count = 0;
+    
+    int result = ERROR_SUCCESS;
+    unsigned int b, k, slot, span;
+    
+    keys.keys = NULL;
+    keys.count = 0;
+    keys.capacity = 0;
+    
+    free_hash_table(hash_table);
+    
+    for (rule = rule_list->head; rule != NULL; rule = rule->next)
+    {
+        if (rule->index < first_index)
+            continue;
+            
+        for (string = rule->string_list_head; string != NULL; string = string->next)
+        {
+            strings_count++;
+            
+            if (string->index > max_index)
+                max_index = string->index;
+        }
+    }
+    
+    while (slots_count < strings_count * 2)
+        slots_count *= 2;
+    
+    patterns = (STRING**) yr_malloc((strings_count + 1) * sizeof(STRING*));
+    pattern_of = (unsigned int*) yr_malloc((max_index + 1) * sizeof(unsigned int));
+    slots = (unsigned int*) yr_malloc(slots_count * sizeof(unsigned int));
+    
+    if (patterns == NULL || pattern_of == NULL || slots == NULL)
+        result = ERROR_INSUFICIENT_MEMORY;
+    else
+        memset(slots, 0, slots_count * sizeof(unsigned int));
+    
+    rule = rule_list->head;
+    
+    while (rule != NULL && result == ERROR_SUCCESS)
+    {
+        if (rule->index < first_index)
+        {
+            rule = rule->next;
+            continue;
+        }
+        
+        string = rule->string_list_head;
+
+        while (string != NULL && result == ERROR_SUCCESS)
+        {
+            /* 
+                strings constrained to a small region are kept apart, they are
+                searched only within their region after the block is scanned,
+                so they don't share descriptors
+            */
+            
+            if (IS_CONSTRAINED(string) && 
+                string->region_end - string->region_start < MAX_REGION_SIZE)
+            {
+                pattern_of[string->index] = patterns_count;
+                patterns[patterns_count] = string;
+                
+                keys.first = keys.count;
+                keys.descriptor = patterns_count++;
+                
+                result = add_hash_key(&keys, HASH_BUCKET_CONSTRAINED);
+                string = string->next;
+                continue;
             }
             
-            if (fcount == 0)
+            slot = hash(string->flags & PATTERN_FLAGS, string->string, string->length) & (slots_count - 1);
+            
+            while (slots[slot] != 0 && !same_pattern(patterns[slots[slot] - 1], string))
+                slot = (slot + 1) & (slots_count - 1);
+            
+            if (slots[slot] != 0)
             {
-                entry = (STRING_LIST_ENTRY*) yr_malloc(sizeof(STRING_LIST_ENTRY));
-
-                if (entry == NULL)
-                    return ERROR_INSUFICIENT_MEMORY;
-
-                entry->next = hash_table->non_hashed_strings;
-                entry->string = string; 
-                hash_table->non_hashed_strings = entry;
+                pattern_of[string->index] = slots[slot] - 1;
+                string = string->next;
+                continue;
             }
             
+            pattern_of[string->index] = patterns_count;
+            patterns[patterns_count] = string;
+            slots[slot] = patterns_count + 1;
+            
+            keys.first = keys.count;
+            keys.descriptor = patterns_count++;
+            
+            result = add_string_keys(&keys, string);
             string = string->next;
         }
         
         rule = rule->next;
     }
     
-    hash_table->populated = TRUE;
+    if (result == ERROR_SUCCESS)
+    {
+        hash_table->offsets = (unsigned int*) yr_malloc((HASH_BUCKETS + 1) * sizeof(unsigned int));
+        hash_table->entries = (HASH_TABLE_ENTRY*) yr_malloc((keys.count + 1) * sizeof(HASH_TABLE_ENTRY));
+        hash_table->descriptors = (STRING_DESCRIPTOR*) yr_malloc((patterns_count + 1) * sizeof(STRING_DESCRIPTOR));
+        hash_table->owners = (STRING**) yr_malloc((strings_count + 1) * sizeof(STRING*));
+        
+        if (hash_table->offsets == NULL || 
+            hash_table->entries == NULL || 
+            hash_table->descriptors == NULL ||
+            hash_table->owners == NULL)
+        {
+            result = ERROR_INSUFICIENT_MEMORY;
+        }
+    }
     
-    return ERROR_SUCCESS;
+    if (result == ERROR_SUCCESS)
+    {
+        for (k = 0; k < patterns_count; k++)
+        {
+            fill_string_descriptor(&hash_table->descriptors[k], patterns[k]);
+            hash_table->descriptors[k].owners_count = 0;
+            
+            span = string_span(patterns[k]);
+            
+            if (span == 0)
+                hash_table->unbounded = TRUE;
+            else if (span > hash_table->max_span)
+                hash_table->max_span = span;
+        }
+        
+        for (rule = rule_list->head; rule != NULL; rule = rule->next)
+        {
+            if (rule->index < first_index)
+                continue;
+                
+            for (string = rule->string_list_head; string != NULL; string = string->next)
+            {
+                hash_table->descriptors[pattern_of[string->index]].owners_count++;
+            }
+        }
+        
+        /* the owners of all descriptors are in a single array */
+        
+        owners = hash_table->owners;
+        
+        for (k = 0; k < patterns_count; k++)
+        {
+            descriptor = &hash_table->descriptors[k];
+            descriptor->owners = owners;
+            owners += descriptor->owners_count;
+            descriptor->owners_count = 0;
+        }
+    }
+    
+    if (result == ERROR_SUCCESS)
+    {
+        /* fast matching applies to a descriptor if it applies to all its owners */
+        
+        for (rule = rule_list->head; rule != NULL; rule = rule->next)
+        {
+            if (rule->index < first_index)
+                continue;
+                
+            for (string = rule->string_list_head; string != NULL; string = string->next)
+            {
+                descriptor = &hash_table->descriptors[pattern_of[string->index]];
+                descriptor->owners[descriptor->owners_count++] = string;
+                
+                if (!(string->flags & STRING_FLAGS_FAST_MATCH))
+                    descriptor->flags &= ~STRING_FLAGS_FAST_MATCH;
+            }
+        }
+        
+        hash_table->descriptors_count = patterns_count;
+        
+        /* 
+            count the entries in each bucket, turn the counts into the
+            bucket's start, and use them as cursors while filling buckets
+            in. Then every cursor points to the start of the next bucket.
+        */
+        
+        memset(hash_table->offsets, 0, (HASH_BUCKETS + 1) * sizeof(unsigned int));
+        
+        for (k = 0; k < keys.count; k++)
+        {
+            hash_table->offsets[keys.keys[k].bucket + 1]++;
+        }
+        
+        for (b = 0; b < HASH_BUCKETS; b++)
+        {
+            hash_table->offsets[b + 1] += hash_table->offsets[b];
+        }
+        
+        for (k = 0; k < keys.count; k++)
+        {
+            fill_hash_table_entry(  &hash_table->entries[hash_table->offsets[keys.keys[k].bucket]++],
+                                    &hash_table->descriptors[keys.keys[k].descriptor],
+                                    keys.keys[k].descriptor);
+        }
+        
+        for (b = HASH_BUCKETS; b > 0; b--)
+        {
+            hash_table->offsets[b] = hash_table->offsets[b - 1];
+        }
+        
+        hash_table->offsets[0] = 0;
+        hash_table->entries_count = keys.count;
+        hash_table->populated = TRUE;
+    }
+    
+    if (result != ERROR_SUCCESS)
+        free_hash_table(hash_table);
+    
+    yr_free(keys.keys);
+    yr_free(patterns);
+    yr_free(pattern_of);
+    yr_free(slots);
+    
+    return result;
 }
 
 
-void clear_hash_table(HASH_TABLE* hash_table)
+/*
+    Makes sure the strings of all the rules are in the hash tables. The rules 
+    compiled since the hash table was populated go to the delta table, which 
+    is cheap to build while they are few. When they are more than a fraction 
+    of the indexed ones the hash table is populated again with all of them.
+*/
+
+int index_rules(YARA_CONTEXT* context)
 {
-    int i,j;
+    unsigned int count = context->rule_list.count;
+    int populated = context->hash_table.populated;
+    int result = ERROR_SUCCESS;
     
-    STRING_LIST_ENTRY* next_entry;
-    STRING_LIST_ENTRY* entry;
+    if (!populated || count - context->indexed_rules > context->indexed_rules / DELTA_TABLE_RATIO)
+    {
+        result = populate_hash_table(&context->hash_table, &context->rule_list, 0);
+        free_hash_table(&context->delta_table);
+        
+        context->indexed_rules = count;
+        context->delta_rules = count;
+    }
+    else if (count != context->delta_rules)
+    {
+        result = populate_hash_table(&context->delta_table, &context->rule_list, context->indexed_rules);
+        context->delta_rules = count;
+    }
+    else
+    {
+        return ERROR_SUCCESS;
+    }
+    
+    /* cached results don't account for the new rules */
+    
+    if (populated)
+        yr_close_result_cache(context);
+    
+    return result;
+}
 
-    for (i = 0; i < 256; i++)
+
+static void unindex_rule_in_table(HASH_TABLE* hash_table, RULE* rule)
+{
+    STRING_DESCRIPTOR* descriptor;
+    unsigned int i, j, k;
+    
+    if (!hash_table->populated)
+        return;
+        
+    for (i = 0; i < hash_table->descriptors_count; i++)
     {
-        entry = hash_table->hashed_strings_1b[i];
-            
-        while (entry != NULL)
+        descriptor = &hash_table->descriptors[i];
+        
+        for (j = 0, k = 0; j < descriptor->owners_count; j++)
         {
-            next_entry = entry->next;
-            yr_free(entry);
-            entry = next_entry;
+            if (descriptor->owners[j]->rule != rule)
+                descriptor->owners[k++] = descriptor->owners[j];
         }
         
-        hash_table->hashed_strings_1b[i] = NULL;
+        descriptor->owners_count = k;
+    }
+    
+    /* entries left without owners are never searched again */
+    
+    for (i = 0; i < hash_table->entries_count; i++)
+    {
+        if (hash_table->descriptors[hash_table->entries[i].descriptor].owners_count == 0)
+            hash_table->entries[i].flags = 0;
+    }
+}
+
+
+/*
+    Takes the strings of a rule removed from the rule list out of the hash 
+    tables without building them again.
+*/
+
+void unindex_rule(YARA_CONTEXT* context, RULE* rule)
+{
+    if (rule->string_list_head == NULL)
+        return;
         
-        for (j = 0; j < 256; j++)
+    unindex_rule_in_table(&context->hash_table, rule);
+    unindex_rule_in_table(&context->delta_table, rule);
+}
+
+
+/*
+    Resets the rules touched by the last evaluation and forgets about failed
+    preconditions, leaving the strings as they are.
+*/
+
+void clear_rule_marks(YARA_SCANNER* scanner)
+{
+    unsigned int i;
+    
+    for (i = 0; i < scanner->touched_rules_count; i++)
+    {
+        scanner->touched_rules[i]->flags &= ~(RULE_FLAGS_MATCH | RULE_FLAGS_EVALUATED | RULE_FLAGS_CONDITION_TRUE);
+    }
+    
+    scanner->touched_rules_count = 0;
+    
+    if (scanner->failed_preconditions != NULL)
+    {
+        memset(scanner->failed_preconditions, 0, BITMAP_WORDS(scanner->rules_count + 1) * sizeof(unsigned int));
+    }
+}
+
+/*
+    Frees the matches of the last scan, leaving the strings that had them as
+    not found.
+*/
+
+void free_scanner_matches(YARA_SCANNER* scanner)
+{
+    STRING* string;
+    unsigned int i, j;
+    
+    for (i = 0; i < scanner->touched_strings_count; i++)
+    {
+        string = scanner->touched_strings[i];
+        string->flags &= ~STRING_FLAGS_FOUND;  /* clear found mark */
+        
+        for (j = 0; j < string->matches_count; j++)
         {
-            entry = hash_table->hashed_strings_2b[i][j];
-                
-            while (entry != NULL)
-            {
-                next_entry = entry->next;
-                yr_free(entry);
-                entry = next_entry;
-            }
+            yr_free(string->matches[j].data);
+        }
+        
+        if (string->matches != NULL)
+        {
+            yr_free(string->matches);
+        }
+        
+        string->matches = NULL;
+        string->matches_count = 0;
+        string->matches_capacity = 0;
+        string->matches_dropped = 0;
+        string->matches_head = NULL;
+        string->matches_tail = NULL;
+        
+        BITMAP_CLEAR(scanner->found_strings, string->index);
+    }
+    
+    scanner->touched_strings_count = 0;
+    scanner->match_memory = 0;
+    scanner->match_memory_exhausted = FALSE;
+}
+
+
+void free_scanner_copies(YARA_SCANNER* scanner)
+{
+    yr_free(scanner->rules);
+    yr_free(scanner->strings);
+    yr_free(scanner->found_strings);
+    yr_free(scanner->touched_strings);
+    yr_free(scanner->touched_rules);
+    yr_free(scanner->failed_preconditions);
+    yr_free(scanner->unsatisfied_namespaces);
+    
+    scanner->rules = NULL;
+    scanner->rule_list_head = NULL;
+    scanner->rules_count = 0;
+    scanner->strings = NULL;
+    scanner->strings_count = 0;
+    scanner->namespaces_count = 0;
+    scanner->found_strings = NULL;
+    scanner->touched_strings = NULL;
+    scanner->touched_strings_count = 0;
+    scanner->touched_rules = NULL;
+    scanner->touched_rules_count = 0;
+    scanner->failed_preconditions = NULL;
+    scanner->unsatisfied_namespaces = NULL;
+}
+
+/*
+    Copies the rules and strings of the context into the scanner, along with 
+    the arrays and bitmaps sized after them. Rules and strings taken out of 
+    the context leave unused copies behind, as their indexes are not given 
+    to any other.
+*/
+
+static int copy_rules(YARA_SCANNER* scanner)
+{
+    YARA_CONTEXT* context = scanner->context;
+    
+    unsigned int rules_count = context->rule_list.count;
+    unsigned int strings_count = context->strings_count;
+    unsigned int namespaces_count = context->namespaces_count;
+    
+    RULE* rule;
+    RULE* rule_copy;
+    RULE** rule_link;
+    STRING* string;
+    STRING* string_copy;
+    STRING** string_link;
+    
+    free_scanner_copies(scanner);
+    
+    /* one more item each, so that nothing is empty */
+    
+    scanner->rules = (RULE*) yr_malloc((rules_count + 1) * sizeof(RULE));
+    scanner->strings = (STRING*) yr_malloc((strings_count + 1) * sizeof(STRING));
+    scanner->found_strings = (unsigned int*) yr_malloc(BITMAP_WORDS(strings_count + 1) * sizeof(unsigned int));
+    scanner->touched_strings = (STRING**) yr_malloc((strings_count + 1) * sizeof(STRING*));
+    scanner->touched_rules = (RULE**) yr_malloc((rules_count + 1) * sizeof(RULE*));
+    scanner->failed_preconditions = (unsigned int*) yr_malloc(BITMAP_WORDS(rules_count + 1) * sizeof(unsigned int));
+    scanner->unsatisfied_namespaces = (unsigned int*) yr_malloc(BITMAP_WORDS(namespaces_count + 1) * sizeof(unsigned int));
+    
+    if (scanner->rules == NULL || 
+        scanner->strings == NULL || 
+        scanner->found_strings == NULL ||
+        scanner->touched_strings == NULL || 
+        scanner->touched_rules == NULL ||
+        scanner->failed_preconditions == NULL ||
+        scanner->unsatisfied_namespaces == NULL)
+    {
+        free_scanner_copies(scanner);
+        return ERROR_INSUFICIENT_MEMORY;
+    }
+    
+    memset(scanner->rules, 0, (rules_count + 1) * sizeof(RULE));
+    memset(scanner->strings, 0, (strings_count + 1) * sizeof(STRING));
+    memset(scanner->found_strings, 0, BITMAP_WORDS(strings_count + 1) * sizeof(unsigned int));
+    memset(scanner->failed_preconditions, 0, BITMAP_WORDS(rules_count + 1) * sizeof(unsigned int));
+    memset(scanner->unsatisfied_namespaces, 0, BITMAP_WORDS(namespaces_count + 1) * sizeof(unsigned int));
+    
+    rule_link = &scanner->rule_list_head;
+    
+    for (rule = context->rule_list.head; rule != NULL; rule = rule->next)
+    {
+        rule_copy = SCANNER_RULE(scanner, rule);
+        *rule_copy = *rule;
+        rule_copy->flags &= ~(RULE_FLAGS_MATCH | RULE_FLAGS_EVALUATED | RULE_FLAGS_CONDITION_TRUE);
+        
+        string_link = &rule_copy->string_list_head;
+        
+        for (string = rule->string_list_head; string != NULL; string = string->next)
+        {
+            string_copy = SCANNER_STRING(scanner, string);
+            *string_copy = *string;
+            string_copy->flags &= ~STRING_FLAGS_FOUND;
+            string_copy->rule = rule_copy;
             
-            hash_table->hashed_strings_2b[i][j] = NULL;
+            *string_link = string_copy;
+            string_link = &string_copy->next;
+        }
+        
+        *string_link = NULL;
+        *rule_link = rule_copy;
+        rule_link = &rule_copy->next;
+    }
+    
+    *rule_link = NULL;
+    
+    scanner->rules_count = rules_count;
+    scanner->strings_count = strings_count;
+    scanner->namespaces_count = namespaces_count;
+    scanner->generation = context->rule_list.generation;
+    
+    return ERROR_SUCCESS;
+}
+
+/*
+    Undoes what the last scan did to the scanner's rules and strings. Only 
+    the ones in the touched lists are visited, so the cost depends on how 
+    much matched and not on the number of rules. If the rules of the context
+    changed since the last scan they are copied again.
+*/
+
+int clear_marks(YARA_SCANNER* scanner)
+{
+    YARA_CONTEXT* context = scanner->context;
+    
+    clear_rule_marks(scanner);
+    free_scanner_matches(scanner);
+    
+    if (scanner->rules == NULL ||
+        scanner->generation != context->rule_list.generation ||
+        scanner->rules_count != context->rule_list.count ||
+        scanner->strings_count != context->strings_count ||
+        scanner->namespaces_count != context->namespaces_count)
+    {
+        return copy_rules(scanner);
+    }
+    
+    return ERROR_SUCCESS;
+}
+
+int compare_matches(const void* a, const void* b)
+{
+    size_t offset_a = ((MATCH*) a)->offset;
+    size_t offset_b = ((MATCH*) b)->offset;
+    
+    if (offset_a < offset_b)
+        return -1;
+    else if (offset_a > offset_b)
+        return 1;
+    else
+        return 0;
+}
+
+/* 
+    link_matches(STRING* string)
+
+    Matches are appended to the string's array in the order they are found,
+    which is not necessarily the offset order when scanning with more than one
+    thread. This function sorts the array if needed and links its items so that 
+    the matches can be walked as a list starting at matches_head.
+*/
+
+void link_matches(STRING* string)
+{
+    unsigned int i;
+    
+    for (i = 1; i < string->matches_count; i++)
+    {
+        if (string->matches[i - 1].offset > string->matches[i].offset)
+        {
+            qsort(string->matches, string->matches_count, sizeof(MATCH), compare_matches);
+            break;
         }
     }
     
-    entry = hash_table->non_hashed_strings;
-    
-    while (entry != NULL)
+    for (i = 0; i < string->matches_count; i++)
+    {
+        string->matches[i].next = (i + 1 < string->matches_count) ? &string->matches[i + 1] : NULL;
+    }
+    
+    if (string->matches_count > 0)
+    {
+        string->matches_head = &string->matches[0];
+        string->matches_tail = &string->matches[string->matches_count - 1];
+    }
+    else
     {
-        next_entry = entry->next;
-        yr_free(entry);
-        entry = next_entry;
+        string->matches_head = NULL;
+        string->matches_tail = NULL;
     }
+}
+
+/*
+    Called once the blocks have been scanned. Links the matches of each string
+    and sets the bits of the found strings in the bitmap used to evaluate 
+    string sets, which clear_marks left empty.
+*/
+
+void finalize_matches(YARA_SCANNER* scanner)
+{
+    STRING* string;
+    unsigned int i;
     
-    hash_table->non_hashed_strings = NULL;
+    for (i = 0; i < scanner->touched_strings_count; i++)
+    {
+        string = scanner->touched_strings[i];
+        link_matches(string);
+        BITMAP_SET(scanner->found_strings, string->index);
+    }
 }
 
-void clear_marks(RULE_LIST* rule_list)
+/*
+    Tells the warning function about the matches the last scan didn't keep.
+*/
+
+void report_match_warnings(YARA_SCANNER* scanner, void* user_data)
 {
-    RULE* rule;
+    YARA_CONTEXT* context = scanner->context;
+    YARAWARNING warning_function = scanner->warning_function;
     STRING* string;
-    MATCH* match;
-    MATCH* next_match;
+    unsigned int i;
     
-    rule = rule_list->head;
+    if (warning_function == NULL)
+        warning_function = context->warning_function;
     
-    while (rule != NULL)
-    {    
-        rule->flags &= ~RULE_FLAGS_MATCH;
-        rule->flags &= ~RULE_FLAGS_FAILED_PRECONDITION;
-        string = rule->string_list_head;
+    if (warning_function == NULL)
+        return;
+    
+    for (i = 0; i < scanner->touched_strings_count; i++)
+    {
+        string = scanner->touched_strings[i];
         
-        while (string != NULL)
+        if (string->matches_dropped > 0 && 
+            context->max_string_matches != 0 &&
+            string->matches_count >= context->max_string_matches)
         {
-            string->flags &= ~STRING_FLAGS_FOUND;  /* clear found mark */
-            
-            match = string->matches_head;
-            
-            while (match != NULL)
-            {
-                next_match = match->next;
-                yr_free(match->data);
-                yr_free(match);
-                match = next_match;
-            }
-            
-            string->matches_head = NULL;
-            string->matches_tail = NULL;
-            string = string->next;
+            warning_function(WARNING_TOO_MANY_MATCHES, string, user_data);
         }
-        
-        rule = rule->next;
     }
+    
+    if (scanner->match_memory_exhausted)
+        warning_function(WARNING_MATCH_MEMORY_EXHAUSTED, NULL, user_data);
 }
 
-inline int string_match(unsigned char* buffer, size_t buffer_size, STRING* string, int flags, int negative_size)
+inline int string_match(unsigned char* buffer, size_t buffer_size, STRING_DESCRIPTOR* string, int flags, int negative_size)
 {
     int match;
     int i, len;
@@ -651,14 +1419,6 @@ inline int string_match(unsigned char* buffer, size_t buffer_size, STRING* strin
     unsigned char tmp_buffer[512];
     unsigned char* tmp;
 
-    // if the precondition failed for the rule this string is in
-    // then nothing can possibly match
-    if (string->rule->flags & RULE_FLAGS_FAILED_PRECONDITION)
-    {
-        //printf("skipping string %s in rule %s\n", string->identifier, string->rule->identifier);
-        return 0;
-    }
-    
     if (IS_HEX(string))
     {
         return hex_match(buffer, buffer_size, string->string, string->length, string->mask);
@@ -783,65 +1543,181 @@ inline int string_match(unsigned char* buffer, size_t buffer_size, STRING* strin
 }
 
 
-inline int find_matches_for_strings(   STRING_LIST_ENTRY* first_string, 
+/*
+    Appends a match to the string, which is the scanner's copy, unless the 
+    context's limits are reached. The matching data is copied only for 
+    matches that are kept.
+*/
+
+inline int add_match(STRING* string, unsigned char* buffer, int len, size_t current_offset, YARA_SCANNER* scanner)
+{
+    YARA_CONTEXT* context = scanner->context;
+    unsigned int capacity;
+    
+    MATCH* match;
+    MATCH* matches;
+    unsigned char* data;
+    
+    LOCK_MATCHES(scanner);
+    
+    if (string->matches_count + string->matches_dropped == 0)
+    {
+        scanner->touched_strings[scanner->touched_strings_count++] = string;
+    }
+    
+    string->flags |= STRING_FLAGS_FOUND;
+    
+    /* beyond the limits matches are counted but not kept */
+    
+    if ((context->max_string_matches != 0 && 
+         string->matches_count >= context->max_string_matches) ||
+        (context->match_memory_limit != 0 && 
+         scanner->match_memory + sizeof(MATCH) + len > context->match_memory_limit))
+    {
+        if (string->matches_count < context->max_string_matches || context->max_string_matches == 0)
+            scanner->match_memory_exhausted = TRUE;
+            
+        string->matches_dropped++;
+        UNLOCK_MATCHES(scanner);
+        return ERROR_SUCCESS;
+    }
+    
+    if (string->matches_count == string->matches_capacity)
+    {
+        capacity = (string->matches_capacity == 0) ? 4 : string->matches_capacity * 2;
+        matches = (MATCH*) yr_realloc(string->matches, capacity * sizeof(MATCH));
+        
+        if (matches == NULL)
+        {
+            UNLOCK_MATCHES(scanner);
+            return ERROR_INSUFICIENT_MEMORY;
+        }
+        
+        string->matches = matches;
+        string->matches_capacity = capacity;
+    }
+    
+    data = (unsigned char*) yr_malloc(len);
+    
+    if (data == NULL)
+    {
+        UNLOCK_MATCHES(scanner);
+        return ERROR_INSUFICIENT_MEMORY;
+    }
+        
+    memcpy(data, buffer, len);
+    
+    match = &string->matches[string->matches_count];
+    match->offset = current_offset;
+    match->length = len;
+    match->data = data;
+    match->next = NULL;
+    
+    string->matches_count++;
+    scanner->match_memory += sizeof(MATCH) + len;
+
+    UNLOCK_MATCHES(scanner);
+    
+    return ERROR_SUCCESS;
+}
+
+/*
+    Tells if there's no point in looking for a fast matching pattern because 
+    all its owners were found already.
+*/
+
+inline int all_owners_found(STRING_DESCRIPTOR* descriptor, YARA_SCANNER* scanner)
+{
+    STRING* string;
+    unsigned int i;
+    
+    for (i = 0; i < descriptor->owners_count; i++)
+    {
+        string = SCANNER_STRING(scanner, descriptor->owners[i]);
+        
+        if (!(string->flags & STRING_FLAGS_FOUND) || 
+            !(string->flags & STRING_FLAGS_FAST_MATCH))
+            return FALSE;
+    }
+    
+    return TRUE;
+}
+
+
+inline int find_matches_for_strings(   HASH_TABLE* hash_table,
+                                HASH_TABLE_ENTRY* entries,
+                                unsigned int entries_count,
                                 unsigned char* buffer, 
                                 size_t buffer_size,
                                 size_t current_offset,
                                 int flags, 
-                                int negative_size)
+                                int negative_size,
+                                YARA_SCANNER* scanner)
 {
     int len;
+    int result;
+    unsigned int i, j;
     
     STRING* string;
-    MATCH* match;
-    STRING_LIST_ENTRY* entry = first_string;
+    HASH_TABLE_ENTRY* entry;
+    STRING_DESCRIPTOR* descriptor;
     
-    while (entry != NULL)
+    for (i = 0; i < entries_count; i++)
     {   
-        string = entry->string;
-        entry = entry->next;
+        entry = &entries[i];
+        
+        if (!(entry->flags & flags))
+        {
+            continue;
+        }
+        
+        // if the precondition failed for the rule this string is in
+        // then nothing can possibly match
+        if (entry->rule_index != SHARED_PATTERN && 
+            BITMAP_TEST(scanner->failed_preconditions, entry->rule_index))
+        {
+            continue;
+        }
+        
+        if (flags & STRING_FLAGS_ASCII)
+        {
+            if (entry->length > buffer_size)
+                continue;
+                
+            if (entry->prefix_length > 0 && 
+                (entry->prefix_length > buffer_size || memcmp(entry->prefix, buffer, entry->prefix_length) != 0))
+                continue;
+        }
+        else if (flags & STRING_FLAGS_WIDE)
+        {
+            if (entry->length * 2 > buffer_size)
+                continue;
+        }
+        
+        descriptor = &hash_table->descriptors[entry->descriptor];
         
-        if ((string->flags & STRING_FLAGS_FOUND) && (string->flags & STRING_FLAGS_FAST_MATCH))
+        if ((descriptor->flags & STRING_FLAGS_FAST_MATCH) && all_owners_found(descriptor, scanner))
         {
             continue;
         }
         
-        if ((string->flags & flags) && (len = string_match(buffer, buffer_size, string, flags, negative_size)))
+        if ((len = string_match(buffer, buffer_size, descriptor, flags, negative_size)))
         {         
-            string->flags |= STRING_FLAGS_FOUND;
-            match = (MATCH*) yr_malloc(sizeof(MATCH));
-            match->data = (unsigned char*) yr_malloc(len);
-
-            if (match != NULL && match->data != NULL)
+            for (j = 0; j < descriptor->owners_count; j++)
             {
-                match->offset = current_offset;
-                match->length = len;
-                match->next = NULL;
-                
-                memcpy(match->data, buffer, len);         
-
-                pthread_mutex_lock(&match_lock);
-                
-                if (string->matches_head == NULL)
-                {
-                    string->matches_head = match;
-                }
+                string = SCANNER_STRING(scanner, descriptor->owners[j]);
                 
-                if (string->matches_tail != NULL)
+                if (descriptor->owners_count > 1 && 
+                    (BITMAP_TEST(scanner->failed_preconditions, string->rule->index) || 
+                     ((string->flags & STRING_FLAGS_FOUND) && (string->flags & STRING_FLAGS_FAST_MATCH))))
                 {
-                    string->matches_tail->next = match;
+                    continue;
                 }
                 
-                string->matches_tail = match;
-
-                pthread_mutex_unlock(&match_lock);
-            }
-            else
-            {
-                if (match != NULL) 
-                    yr_free(match);
+                result = add_match(string, buffer, len, current_offset, scanner);
                 
-                return ERROR_INSUFICIENT_MEMORY;
+                if (result != ERROR_SUCCESS)
+                    return result;
             }
         }       
     }
@@ -857,40 +1733,371 @@ int find_matches(
     size_t current_offset,
     int flags,
     int negative_size,
-    YARA_CONTEXT* context)
+    YARA_SCANNER* scanner)
+{
+    YARA_CONTEXT* context = scanner->context;
+    HASH_TABLE* hash_table = &context->hash_table;
+    unsigned int buckets[3];
+    int result = ERROR_SUCCESS;
+    int i;
+    
+    buckets[0] = HASH_BUCKET_2B(first_char, second_char);
+    buckets[1] = HASH_BUCKET_1B(first_char);
+    buckets[2] = HASH_BUCKET_NON_HASHED;
+    
+    while (hash_table != NULL && result == ERROR_SUCCESS)
+    {
+        for (i = 0; i < 3 && result == ERROR_SUCCESS; i++)
+        {
+            if (BUCKET_SIZE(hash_table, buckets[i]) > 0)
+            {
+                result = find_matches_for_strings(  hash_table,
+                                                    BUCKET_ENTRIES(hash_table, buckets[i]),
+                                                    BUCKET_SIZE(hash_table, buckets[i]),
+                                                    buffer, 
+                                                    buffer_size, 
+                                                    current_offset, 
+                                                    flags, 
+                                                    negative_size,
+                                                    scanner);
+            }
+        }
+        
+        /* rules added after the table was populated are in the delta table */
+        
+        if (hash_table == &context->hash_table && context->delta_table.populated)
+            hash_table = &context->delta_table;
+        else
+            hash_table = NULL;
+    }
+                
+    return result;
+}
+
+/*
+    Searches the strings constrained to a region in the part of their region 
+    covered by the block. Regions are relative to origin, which is the start 
+    of the scanned data or of the record being scanned. Only matches starting 
+    before limit, an offset within the block, are looked for.
+*/
+
+static int find_matches_in_table_regions(HASH_TABLE* hash_table, MEMORY_BLOCK* block, size_t origin, size_t limit, YARA_SCANNER* scanner)
 {
     int result = ERROR_SUCCESS;
+    size_t i, start, end;
+    size_t region_start, region_end;
+    
+    STRING* string;
+    HASH_TABLE_ENTRY* entry;
+    unsigned int n;
+    
+    if (block->size < 2 || limit == 0)
+        return ERROR_SUCCESS;
+        
+    if (limit > block->size - 1)
+        limit = block->size - 1;
+    
+    entry = BUCKET_ENTRIES(hash_table, HASH_BUCKET_CONSTRAINED);
+    
+    for (n = 0; n < BUCKET_SIZE(hash_table, HASH_BUCKET_CONSTRAINED) && result == ERROR_SUCCESS; n++, entry++)
+    {
+        /* the string was removed along with its rule */
+        
+        if (hash_table->descriptors[entry->descriptor].owners_count == 0)
+            continue;
+        
+        string = hash_table->descriptors[entry->descriptor].owners[0];
+        
+        region_start = origin + string->region_start;
+        region_end = origin + string->region_end;
+        
+        /* skip strings whose region doesn't overlap the block */
+        
+        if (region_end < block->base || 
+            region_start >= block->base + limit)
+        {
+            continue;
+        }
+        
+        start = (region_start > block->base) ? region_start - block->base : 0;
+        end = region_end - block->base;
+        
+        /* the last byte of a block is not scanned, as in threaded_scan */
+        
+        if (end > limit - 1)
+            end = limit - 1;
+        
+        for (i = start; i <= end && result == ERROR_SUCCESS; i++)
+        {
+            result = find_matches_for_strings(  hash_table,
+                                                entry,
+                                                1,
+                                                block->data + i,
+                                                block->size - i,
+                                                block->base + i,
+                                                STRING_FLAGS_HEXADECIMAL | STRING_FLAGS_ASCII,
+                                                i,
+                                                scanner);
+                                                
+            if (result == ERROR_SUCCESS && 
+                block->data[i + 1] == 0 && block->size > 3 && i < block->size - 3 && block->data[i + 3] == 0)
+            {
+                result = find_matches_for_strings(  hash_table,
+                                                    entry,
+                                                    1,
+                                                    block->data + i,
+                                                    block->size - i,
+                                                    block->base + i,
+                                                    STRING_FLAGS_WIDE,
+                                                    i,
+                                                    scanner);
+            }
+        }
+    }
+    
+    return result;
+}
+
+
+int find_matches_in_regions(MEMORY_BLOCK* block, size_t origin, size_t limit, YARA_SCANNER* scanner)
+{
+    YARA_CONTEXT* context = scanner->context;
+    int result;
+    
+    result = find_matches_in_table_regions(&context->hash_table, block, origin, limit, scanner);
+    
+    if (result == ERROR_SUCCESS && context->delta_table.populated)
+        result = find_matches_in_table_regions(&context->delta_table, block, origin, limit, scanner);
+        
+    return result;
+}
+
+
+#define RECORD_STRING_KEY(x)    ((x)->matches[(x)->next].offset)
+
+void record_heap_push(RECORD_MATCHES* records, RECORD_STRING* record_string)
+{
+    unsigned int i = records->heap_count++;
+    unsigned int parent;
+    
+    while (i > 0)
+    {
+        parent = (i - 1) / 2;
         
-    if (context->hash_table.hashed_strings_2b[first_char][second_char] != NULL)
+        if (RECORD_STRING_KEY(records->heap[parent]) <= RECORD_STRING_KEY(record_string))
+            break;
+            
+        records->heap[i] = records->heap[parent];
+        i = parent;
+    }
+    
+    records->heap[i] = record_string;
+}
+
+RECORD_STRING* record_heap_pop(RECORD_MATCHES* records)
+{
+    RECORD_STRING* top = records->heap[0];
+    RECORD_STRING* last = records->heap[--records->heap_count];
+    unsigned int i = 0;
+    unsigned int child;
+    
+    while ((child = 2 * i + 1) < records->heap_count)
     {
-        result =  find_matches_for_strings( context->hash_table.hashed_strings_2b[first_char][second_char], 
-                                            buffer, 
-                                            buffer_size, 
-                                            current_offset, 
-                                            flags, 
-                                            negative_size);
+        if (child + 1 < records->heap_count && 
+            RECORD_STRING_KEY(records->heap[child + 1]) < RECORD_STRING_KEY(records->heap[child]))
+        {
+            child++;
+        }
+        
+        if (RECORD_STRING_KEY(last) <= RECORD_STRING_KEY(records->heap[child]))
+            break;
+            
+        records->heap[i] = records->heap[child];
+        i = child;
     }
     
+    if (records->heap_count > 0)
+        records->heap[i] = last;
+    
+    return top;
+}
+
+/*
+    Called after finalize_matches when scanning records. Takes the matches
+    away from the strings, which look as not found until set_record_window
+    gives them the matches in a record. Matches not kept because of the 
+    limits can't be told apart by record, so they are not counted.
+*/
+
+int init_record_matches(YARA_SCANNER* scanner, RECORD_MATCHES* records)
+{
+    STRING* string;
+    RECORD_STRING* record_string;
+    unsigned int count = scanner->touched_strings_count;
+    unsigned int i;
+    
+    memset(records, 0, sizeof(RECORD_MATCHES));
     
-    if (result == ERROR_SUCCESS && context->hash_table.hashed_strings_1b[first_char] != NULL)
+    if (count > 0)
     {
-        result =  find_matches_for_strings( context->hash_table.hashed_strings_1b[first_char], 
-                                            buffer, 
-                                            buffer_size, 
-                                            current_offset, 
-                                            flags, 
-                                            negative_size);
+        records->strings = (RECORD_STRING*) yr_malloc(count * sizeof(RECORD_STRING));
+        records->heap = (RECORD_STRING**) yr_malloc(count * sizeof(RECORD_STRING*));
+        records->touched = (RECORD_STRING**) yr_malloc(count * sizeof(RECORD_STRING*));
+        
+        if (records->strings == NULL || records->heap == NULL || records->touched == NULL)
+        {
+            destroy_record_matches(records);
+            return ERROR_INSUFICIENT_MEMORY;
+        }
     }
     
-    if (result == ERROR_SUCCESS && context->hash_table.non_hashed_strings != NULL)
+    for (i = 0; i < count; i++)
     {
-         result = find_matches_for_strings(    context->hash_table.non_hashed_strings, 
-                                               buffer, 
-                                               buffer_size, 
-                                               current_offset, 
-                                               flags, 
-                                               negative_size);
+        string = scanner->touched_strings[i];
+        string->flags &= ~STRING_FLAGS_FOUND;
+        
+        BITMAP_CLEAR(scanner->found_strings, string->index);
+            
+        record_string = &records->strings[records->strings_count++];
+        record_string->string = string;
+        record_string->matches = string->matches;
+        record_string->matches_count = string->matches_count;
+        record_string->next = 0;
+        
+        string->matches = NULL;
+        string->matches_count = 0;
+        string->matches_dropped = 0;
+        string->matches_head = NULL;
+        string->matches_tail = NULL;
+        
+        if (record_string->matches_count > 0)
+            record_heap_push(records, record_string);
     }
+    
+    return ERROR_SUCCESS;
+}
+
+/*
+    Gives each string the matches starting in the record [start, end) with 
+    their offsets relative to the start of the record, as if the record had 
+    been scanned alone. Matches starting in the record but ending after it 
+    are left out. Records must be visited in increasing offset order.
+*/
+
+void set_record_window(RECORD_MATCHES* records, YARA_SCANNER* scanner, size_t start, size_t end)
+{
+    RECORD_STRING* record_string;
+    STRING* string;
+    MATCH* matches;
+    MATCH tmp;
+    unsigned int lo, hi, i, j;
+    
+    while (records->heap_count > 0 && RECORD_STRING_KEY(records->heap[0]) < end)
+    {
+        record_string = record_heap_pop(records);
+        matches = record_string->matches;
+        
+        lo = record_string->next;
+        
+        while (lo < record_string->matches_count && matches[lo].offset < start)
+            lo++;
+            
+        hi = lo;
+        
+        while (hi < record_string->matches_count && matches[hi].offset < end)
+            hi++;
+        
+        record_string->next = hi;
+        
+        if (hi < record_string->matches_count)
+            record_heap_push(records, record_string);
+        
+        /* 
+            move the matches that fit in the record to the front of the window 
+            keeping their order, swapping instead of overwriting keeps the data 
+            of the others in the array so that clear_marks can free it
+        */
+        
+        for (i = lo, j = lo; i < hi; i++)
+        {
+            if (matches[i].offset + matches[i].length <= end)
+            {
+                if (i != j)
+                {
+                    tmp = matches[j];
+                    matches[j] = matches[i];
+                    matches[i] = tmp;
+                }
                 
-    return result;
+                j++;
+            }
+        }
+        
+        if (j == lo)
+            continue;
+        
+        for (i = lo; i < j; i++)
+        {
+            matches[i].offset -= start;
+            matches[i].next = (i + 1 < j) ? &matches[i + 1] : NULL;
+        }
+        
+        string = record_string->string;
+        string->matches = &matches[lo];
+        string->matches_count = j - lo;
+        string->matches_head = &matches[lo];
+        string->matches_tail = &matches[j - 1];
+        string->flags |= STRING_FLAGS_FOUND;
+        
+        scanner->found_strings[string->index / BITMAP_WORD_BITS] |= 1U << (string->index % BITMAP_WORD_BITS);
+        
+        records->touched[records->touched_count++] = record_string;
+    }
+}
+
+void clear_record_window(RECORD_MATCHES* records, YARA_SCANNER* scanner)
+{
+    STRING* string;
+    unsigned int i;
+    
+    for (i = 0; i < records->touched_count; i++)
+    {
+        string = records->touched[i]->string;
+        string->flags &= ~STRING_FLAGS_FOUND;
+        string->matches = NULL;
+        string->matches_count = 0;
+        string->matches_head = NULL;
+        string->matches_tail = NULL;
+        
+        scanner->found_strings[string->index / BITMAP_WORD_BITS] &= ~(1U << (string->index % BITMAP_WORD_BITS));
+    }
+    
+    records->touched_count = 0;
+}
+
+/*
+    Gives the strings back all their matches, they are freed by clear_marks
+    as usual.
+*/
+
+void destroy_record_matches(RECORD_MATCHES* records)
+{
+    unsigned int i;
+    
+    for (i = 0; i < records->strings_count; i++)
+    {
+        records->strings[i].string->matches = records->strings[i].matches;
+        records->strings[i].string->matches_count = records->strings[i].matches_count;
+    }
+    
+    if (records->strings != NULL)
+        yr_free(records->strings);
+        
+    if (records->heap != NULL)
+        yr_free(records->heap);
+        
+    if (records->touched != NULL)
+        yr_free(records->touched);
+        
+    memset(records, 0, sizeof(RECORD_MATCHES));
 }
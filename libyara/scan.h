@@ -17,15 +17,174 @@ limitations under the License.
 #ifndef _SCAN_H 
 #define _SCAN_H
 
+#include <pthread.h>
+
 #include "yara.h"
+#include "mem.h"
+
+/* 
+    strings constrained to regions larger than this are searched in the whole 
+    input like any other string
+*/
+
+#define MAX_REGION_SIZE     0x10000
+
+#define IS_CONSTRAINED(x)   ((((x)->flags) & STRING_FLAGS_REGION) && !(((x)->flags) & STRING_FLAGS_UNCONSTRAINED))
+
+/* 
+    buckets of the hash table: one for each pair of first bytes, one for each 
+    first byte when the second one is not known, one for strings without known 
+    first bytes and one for strings constrained to a small region
+*/
+
+#define HASH_BUCKET_2B(f, s)        (((f) << 8) | (s))
+#define HASH_BUCKET_1B(f)           (0x10000 + (f))
+#define HASH_BUCKET_NON_HASHED      0x10100
+#define HASH_BUCKET_CONSTRAINED     0x10101
+#define HASH_BUCKETS                0x10102
+
+/* rule index of entries whose descriptor has owners in different rules */
+
+#define SHARED_PATTERN              0xFFFFFFFF
+
+#define BUCKET_ENTRIES(t, b)        ((t)->entries + (t)->offsets[b])
+#define BUCKET_SIZE(t, b)           ((t)->offsets[(b) + 1] - (t)->offsets[b])
+
+extern int thread_count;
+
+/* 
+    threads searching each block for a scanner, the context can override 
+    thread_count and the scanner can override the context
+*/
+
+#define SEARCH_THREADS(x)   (((x)->search_threads > 0) ? (x)->search_threads : \
+                             ((x)->context->search_threads > 0) ? (x)->context->search_threads : thread_count)
+
+/* 
+    the hash table is populated again when the rules in the delta table are
+    more than this fraction of the indexed ones
+*/
+
+#define DELTA_TABLE_RATIO   8
+
+/* 
+    A scanner marks copies of the context's rules and strings, each one at 
+    the position given by the index of the original, so the rules can be 
+    shared by scanners running at the same time. The copies are linked like
+    the originals and are the ones received by the callback. They are made 
+    again when the rules of the context change, see clear_marks.
+*/
+
+struct _YARA_SCANNER
+{
+    YARA_CONTEXT*   context;
+    int             search_threads;         /* zero to use the context's */
+    YARAWARNING     warning_function;       /* used instead of the context's if not NULL */
+    unsigned int    generation;             /* of the context's rules when the copies were made */
+    unsigned int    namespaces_count;
+    
+    RULE*           rules;                  /* rule_list.count copies */
+    RULE*           rule_list_head;
+    unsigned int    rules_count;
+    
+    STRING*         strings;                /* strings_count copies */
+    unsigned int    strings_count;
+    
+    unsigned int*   found_strings;          /* bitmap indexed by string->index */
+    
+    /* 
+        what the last scan changed in the copies, so that the next one can 
+        undo it without walking all of them
+    */
+    
+    STRING**        touched_strings;        /* strings with matches */
+    unsigned int    touched_strings_count;
+    
+    RULE**          touched_rules;          /* rules evaluated or matched */
+    unsigned int    touched_rules_count;
+    
+    unsigned int*   failed_preconditions;   /* bitmap indexed by rule->index */
+    unsigned int*   unsatisfied_namespaces; /* bitmap indexed by ns->index, a global rule failed */
+    
+    size_t          match_memory;           /* used by the matches of the current scan */
+    int             match_memory_exhausted;
+    
+    /* 
+        protects the matches and the above while the scan's search threads 
+        add matches, it isn't taken if there is only one
+    */
+    
+    pthread_mutex_t match_lock;
+    unsigned int    threads_searching;      /* the block being searched */
+    
+    int             scanning_process_memory;
+    
+    const char*     file_path;              /* for the file_path variable, if scanning a file */
+    
+    size_t          record_number;          /* starting at 1 */
+    size_t          record_offset;
+    
+    struct _CACHE_ENTRY* cache_entry;       /* result cache entries are copied here before using them */
+    size_t          cache_entry_size;
+};
+
+#define SCANNER_RULE(x, r)      (&(x)->rules[(r)->index])
+#define SCANNER_STRING(x, s)    (&(x)->strings[(s)->index])
+
+void init_scan_tables();
+int populate_hash_table(HASH_TABLE* hash_table, RULE_LIST* rule_list, unsigned int first_index);
+void free_hash_table(HASH_TABLE* hash_table);
+int index_rules(YARA_CONTEXT* context);
+void unindex_rule(YARA_CONTEXT* context, RULE* rule);
+void clear_rule_marks(YARA_SCANNER* scanner);
+int clear_marks(YARA_SCANNER* scanner);
+void free_scanner_matches(YARA_SCANNER* scanner);
+void free_scanner_copies(YARA_SCANNER* scanner);
+void finalize_matches(YARA_SCANNER* scanner);
+void report_match_warnings(YARA_SCANNER* scanner, void* user_data);
+int find_matches_in_regions(MEMORY_BLOCK* block, size_t origin, size_t limit, YARA_SCANNER* scanner);
+
+/* 
+    Matches found by scanning a buffer made of records, each string's matches
+    are handed to the records they belong to in offset order. Strings with 
+    matches pending are kept in a heap ordered by the offset of the next one,
+    so only the strings having matches in a record are visited for it.
+*/
+
+typedef struct _RECORD_STRING
+{
+    STRING*         string;
+    MATCH*          matches;            /* all the string's matches sorted by offset */
+    unsigned int    matches_count;
+    unsigned int    next;               /* first match not assigned to a record yet */
+    
+} RECORD_STRING;
+
+typedef struct _RECORD_MATCHES
+{
+    RECORD_STRING*  strings;
+    unsigned int    strings_count;
+    
+    RECORD_STRING** heap;
+    unsigned int    heap_count;
+    
+    RECORD_STRING** touched;            /* strings with matches in the current record */
+    unsigned int    touched_count;
+    
+} RECORD_MATCHES;
 
-int populate_hash_table(HASH_TABLE* hash_table, RULE_LIST* rule_list);
-void clear_hash_table(HASH_TABLE* hash_table);
+int init_record_matches(YARA_SCANNER* scanner, RECORD_MATCHES* records);
+void set_record_window(RECORD_MATCHES* records, YARA_SCANNER* scanner, size_t start, size_t end);
+void clear_record_window(RECORD_MATCHES* records, YARA_SCANNER* scanner);
+void destroy_record_matches(RECORD_MATCHES* records);
 
 typedef struct _THREADED_SCAN_ARGS {
     int thread_index;
+    int threads_count;
+    size_t limit;
     MEMORY_BLOCK * block;
-    YARA_CONTEXT * context;
+    YARA_SCANNER * scanner;
+    int records;                        /* TRUE if matches can't cross the context's records */
 } THREADED_SCAN_ARGS;
 
 #endif
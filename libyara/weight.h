@@ -14,8 +14,8 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
-#ifndef _SIZEDSTR_H
-#define _SIZEDSTR_H
+#ifndef _WEIGHT_H
+#define _WEIGHT_H
 
 #include "yara.h"
 
@@ -49,6 +49,8 @@ limitations under the License.
 #define STRING_FLAGS_FULL_WORD                  0x80
 #define STRING_FLAGS_ANONYMOUS                  0x100
 #define STRING_FLAGS_FAST_MATCH                 0x200
+#define STRING_FLAGS_REGION                     0x400
+#define STRING_FLAGS_UNCONSTRAINED              0x800
 
 #define IS_HEX(x)       (((x)->flags) & STRING_FLAGS_HEXADECIMAL)
 #define IS_NO_CASE(x)   (((x)->flags) & STRING_FLAGS_NO_CASE)
@@ -63,7 +65,14 @@ limitations under the License.
 #define RULE_FLAGS_GLOBAL                       0x04
 #define RULE_FLAGS_REQUIRE_EXECUTABLE           0x08
 #define RULE_FLAGS_REQUIRE_FILE                 0x10
-#define RULE_FLAGS_FAILED_PRECONDITION          0x20
+#define RULE_FLAGS_EVALUATED                    0x40
+#define RULE_FLAGS_CONDITION_TRUE               0x80
+
+#define REGION_FLAGS_READ                       0x01
+#define REGION_FLAGS_WRITE                      0x02
+#define REGION_FLAGS_EXECUTE                    0x04
+#define REGION_FLAGS_SHARED                     0x08
+#define REGION_FLAGS_ANONYMOUS                  0x10    /* not backed by a file */
 
 #ifndef ERROR_SUCCESS 
 #define ERROR_SUCCESS                           0
@@ -101,6 +110,17 @@ limitations under the License.
 #define ERROR_COULD_NOT_ATTACH_TO_PROCESS       30
 #define ERROR_VECTOR_TOO_LONG                   31
 #define ERROR_INCLUDE_DEPTH_EXCEEDED            32
+#define ERROR_UNCACHEABLE_RULES                 33
+#define ERROR_NOT_SCANNED                       34
+#define ERROR_SCAN_TIMEOUT                      35
+#define ERROR_MEMORY_LIMIT_EXCEEDED             36
+#define ERROR_AMBIGUOUS_IDENTIFIER              37
+#define ERROR_RULE_REFERENCED                   38
+
+#define WARNING_TOO_MANY_MATCHES                1
+#define WARNING_MATCH_MEMORY_EXHAUSTED          2
+
+#define DEFAULT_MAX_STRING_MATCHES              1000000
 
 #define META_TYPE_INTEGER                       1
 #define META_TYPE_STRING                        2
@@ -110,6 +130,10 @@ limitations under the License.
 #define VARIABLE_TYPE_STRING           2
 #define VARIABLE_TYPE_BOOLEAN          3
 
+#define SCAN_ITEM_TYPE_FILE                     1
+#define SCAN_ITEM_TYPE_BUFFER                   2
+#define SCAN_ITEM_TYPE_PROCESS                  3
+
 #define CALLBACK_CONTINUE                       0
 #define CALLBACK_ABORT                          1
 #define CALLBACK_ERROR                          2 
@@ -135,6 +159,8 @@ typedef struct _REGEXP
 } REGEXP;
 
 struct _RULE;
+struct _RESULT_CACHE;
+struct _ARENA;
 
 typedef struct _STRING
 {
@@ -149,7 +175,34 @@ typedef struct _STRING
     };  
     
     MATCH*          matches_head;
-    MATCH*          matches_tail;      
+    MATCH*          matches_tail;
+    
+    /* 
+        matches are stored in a contiguous array sorted by offset, the list 
+        above is linked through it once the scan finishes
+    */
+    
+    MATCH*          matches;
+    unsigned int    matches_count;
+    unsigned int    matches_capacity;
+    unsigned int    matches_dropped;    /* found but not kept because of the context's limits */
+    
+    /* 
+        when all the references to the string in the conditions are of the 
+        form "$a at <constant>" or "$a in (<constant>..<constant>)" matches 
+        are only searched for at offsets between region_start and region_end
+    */
+    
+    size_t          region_start;
+    size_t          region_end;
+    
+    /* 
+        position of the string in the found strings bitmap and in the 
+        scanners' copies of the strings, which hold what a scan found
+    */
+    
+    unsigned int    index;
+          
     struct _STRING* next;
 
     // the rule the string belongs to
@@ -192,7 +245,7 @@ typedef struct _TERM
 typedef struct _NAMESPACE
 {
     char*               name;
-    int                 global_rules_satisfied;
+    unsigned int        index;
     struct _NAMESPACE*  next;           
 
 } NAMESPACE;
@@ -218,6 +271,7 @@ typedef struct _RULE
 {
     char*           identifier;
     int             flags;
+    unsigned int    index;
     NAMESPACE*      ns;
     STRING*         string_list_head;
     TAG*            tag_list_head;
@@ -229,14 +283,6 @@ typedef struct _RULE
 } RULE;
 
 
-typedef struct _STRING_LIST_ENTRY
-{
-    STRING* string;
-    struct _STRING_LIST_ENTRY* next;
-    
-} STRING_LIST_ENTRY;
-
-
 typedef struct _RULE_LIST_ENTRY
 {
     RULE* rule;
@@ -245,22 +291,84 @@ typedef struct _RULE_LIST_ENTRY
 } RULE_LIST_ENTRY;
 
 
+typedef struct _REGEXP_LIST_ENTRY
+{
+    REGEXP* re;
+    struct _REGEXP_LIST_ENTRY* next;
+    
+} REGEXP_LIST_ENTRY;
+
+
 #define RULE_LIST_HASH_TABLE_SIZE   10007
 
 typedef struct _RULE_LIST
 {
     RULE*               head; 
     RULE*               tail;
+    unsigned int        count;              /* rules ever added, the index of the next one */
+    unsigned int        generation;         /* changes every time a rule is added or taken out */
     RULE_LIST_ENTRY     hash_table[RULE_LIST_HASH_TABLE_SIZE];
         
 } RULE_LIST;
 
 
+/*
+    What the matcher needs from a string, packed apart from the identifier, 
+    the matches and the rest of STRING, which is touched only when the string 
+    matches. Strings with the same pattern and modifiers share a descriptor,
+    so the pattern is verified once and its matches go to all of them.
+*/
+
+typedef struct _STRING_DESCRIPTOR
+{
+    int                 flags;              /* the owners' flags but STRING_FLAGS_FOUND */
+    unsigned int        length;
+    unsigned char*      string;
+    
+    union {
+        unsigned char*  mask;
+        REGEXP          re;
+    };
+    
+    STRING**            owners;
+    unsigned int        owners_count;
+    
+} STRING_DESCRIPTOR;
+
+/*
+    An entry of the hash table, carrying what's needed to discard a string 
+    at a given offset without touching its descriptor. The rule index is 
+    SHARED_PATTERN when the owners of the descriptor are in different rules.
+*/
+
+typedef struct _HASH_TABLE_ENTRY
+{
+    unsigned int        descriptor;
+    unsigned int        rule_index;
+    unsigned int        length;             /* bytes an ascii match needs, zero if not known */
+    unsigned short      flags;              /* the string's ascii, wide and hexadecimal flags */
+    unsigned char       prefix_length;
+    unsigned char       prefix[4];          /* first bytes of an ascii match, if they are known */
+    
+} HASH_TABLE_ENTRY;
+
+/*
+    Strings are indexed by their first bytes. The entries of each bucket are 
+    contiguous, bucket i spans from entries[offsets[i]] to entries[offsets[i + 1]] 
+    excluded. These arrays, the descriptors and their owners are built at once
+    when the table is populated, and freed when it's populated again.
+*/
+
 typedef struct _HASH_TABLE
 {
-    STRING_LIST_ENTRY*  hashed_strings_2b[256][256];
-    STRING_LIST_ENTRY*  hashed_strings_1b[256];
-    STRING_LIST_ENTRY*  non_hashed_strings;
+    unsigned int*       offsets;
+    HASH_TABLE_ENTRY*   entries;
+    unsigned int        entries_count;
+    STRING_DESCRIPTOR*  descriptors;
+    unsigned int        descriptors_count;
+    STRING**            owners;             /* the owners of all descriptors */
+    unsigned int        max_span;           /* bytes the longest match of a bounded string spans */
+    int                 unbounded;          /* TRUE if some string's matches have no bound */
     int                 populated;
         
 } HASH_TABLE;
@@ -276,9 +384,49 @@ typedef struct _MEMORY_BLOCK
 } MEMORY_BLOCK;
 
 
+/* 
+    An input for yr_scan_batch, either a file, a buffer or a process as told 
+    by type, which selects the fields used: file_path, data and size, or pid.
+    The result of scanning it is left in result.
+*/
+
+typedef struct _YARA_SCAN_ITEM
+{
+    int                     type;           /* one of SCAN_ITEM_TYPE_* */
+    const char*             file_path;
+    unsigned char*          data;
+    size_t                  size;
+    int                     pid;
+    int                     result;
+    
+} YARA_SCAN_ITEM;
+
+
+/*
+    Allocation counters of yr_malloc by size class. Class i holds requests
+    of up to MEMORY_MIN_CLASS_SIZE << i bytes, the last one everything 
+    bigger than that.
+*/
+
+#define MEMORY_MIN_CLASS_SIZE   16
+#define MEMORY_LARGE_CLASS      8
+#define MEMORY_SIZE_CLASSES     (MEMORY_LARGE_CLASS + 1)
+
+typedef struct _MEMORY_STATS
+{
+    unsigned long long      calls[MEMORY_SIZE_CLASSES];
+    unsigned long long      bytes[MEMORY_SIZE_CLASSES];    /* bytes requested */
+    
+} MEMORY_STATS;
+
+
+#define IS_RECORD_MODE(x)   ((x)->record_delimiter != -1 || (x)->record_size > 0)
+
 
 typedef int (*YARACALLBACK)(RULE* rule, void* data);
+typedef int (*YARABATCHCALLBACK)(RULE* rule, int item_index, void* data);
 typedef void (*YARAREPORT)(const char* file_name, int line_number, const char* error_message);
+typedef void (*YARAWARNING)(int warning, STRING* string, void* data);
 
 
 typedef struct _YARA_CONTEXT
@@ -290,7 +438,18 @@ typedef struct _YARA_CONTEXT
     int                     last_error_line;
     
     RULE_LIST               rule_list;
+    
+    /* 
+        the hash table indexes the strings of the rules with an index lower 
+        than indexed_rules, the ones compiled later are in the delta table, 
+        which is built again when more are added. Once it holds too many
+        everything goes to the hash table again, see index_rules.
+    */
+    
     HASH_TABLE              hash_table;
+    HASH_TABLE              delta_table;
+    unsigned int            indexed_rules;
+    unsigned int            delta_rules;            /* rule_list.count when the delta table was built */
     
     NAMESPACE*              namespaces;
     NAMESPACE*              current_namespace;
@@ -299,6 +458,10 @@ typedef struct _YARA_CONTEXT
     
     STRING*                 current_rule_strings;  
     int                     current_rule_flags;
+    
+    unsigned int            strings_count;
+    unsigned int            namespaces_count;
+    
     int                     inside_for;
     
     char*                   file_name_stack[MAX_INCLUDE_DEPTH];
@@ -315,18 +478,82 @@ typedef struct _YARA_CONTEXT
     
     int                     fast_match;
     int                     allow_includes;
-    int                     scanning_process_memory;
+    int                     search_threads;         /* zero to use thread_count */
+    
+    /* 
+        the regions of a process scanned by yr_scan_proc are those having all
+        the REGION_FLAGS_* in region_flags and, on Linux, whose path contains
+        region_path if it's not NULL
+    */
+    
+    int                     region_flags;
+    const char*             region_path;
+    
+    int                     process_timeout;        /* seconds, zero for no limit */
+    size_t                  process_memory_limit;   /* bytes read, zero for no limit */
+    
+    /* 
+        a string matching more than max_string_matches times in a scan keeps 
+        only its first matches, the others are just counted. Once the matches 
+        kept use match_memory_limit bytes no more are kept for any string. The 
+        warning function, if any, is told about it after the blocks are 
+        scanned, with the user data given to the scanning function.
+    */
+    
+    unsigned int            max_string_matches;     /* zero for no limit */
+    size_t                  match_memory_limit;     /* zero for no limit */
+    YARAWARNING             warning_function;
+    
+    struct _RESULT_CACHE*   result_cache;
+    
+    struct _RULES_VERSION*  version;                /* the version of a YARA_RULES it belongs to, if any */
+    
+    /* 
+        rules, strings, terms and everything else built by the compiler is 
+        allocated from the arena and freed with it, except for compiled 
+        regular expressions, which are kept in the regexps list to free them
+    */
+    
+    struct _ARENA*          arena;
+    REGEXP_LIST_ENTRY*      regexps;
+    
+    /* 
+        when record_delimiter is not -1 or record_size is not zero files are 
+        scanned as a sequence of records, see yr_scan_mem_records
+    */
+    
+    int                     record_delimiter;
+    size_t                  record_size;
+    
+    struct _YARA_SCANNER*   scanner;                /* used by the yr_scan_* functions taking the context */
         
     char                    include_base_dir[MAX_PATH];
 
 } YARA_CONTEXT;
 
+/*
+    The state of a scan: what was found for each rule and string and the 
+    matches kept. A context can be used by several scanners at the same 
+    time, each one in its own thread, as long as its rules aren't changed 
+    meanwhile. See yr_create_scanner.
+*/
+
+typedef struct _YARA_SCANNER YARA_SCANNER;
+
+/*
+    Rules shared by the threads of a long running scanner, which can be 
+    replaced by a new version while scans are running, see yr_publish_rules
+*/
+
+typedef struct _YARA_RULES YARA_RULES;
+
 
 RULE*             lookup_rule(RULE_LIST* rules, const char* identifier, NAMESPACE* ns);
 STRING*           lookup_string(STRING* string_list_head, const char* identifier);
 TAG*              lookup_tag(TAG* tag_list_head, const char* identifier);
 META*             lookup_meta(META* meta_list_head, const char* identifier);
 VARIABLE*         lookup_variable(VARIABLE* _list_head, const char* identifier);
+NAMESPACE*        lookup_namespace(NAMESPACE* namespace_list_head, const char* name);
 
 void              yr_init();
 
@@ -352,11 +579,48 @@ FILE*             yr_pop_file(YARA_CONTEXT* context);
 
 int               yr_compile_file(FILE* rules_file, YARA_CONTEXT* context);
 int               yr_compile_string(const char* rules_string, YARA_CONTEXT* context);
+int               yr_merge_context(YARA_CONTEXT* context, YARA_CONTEXT* other);
+
+int               yr_add_rules(YARA_CONTEXT* context, const char* ns, const char* rules_string);
+int               yr_remove_rule(YARA_CONTEXT* context, const char* ns, const char* identifier);
+int               yr_replace_rule(YARA_CONTEXT* context, const char* ns, const char* identifier, const char* rules_string);
+int               yr_select_rules(YARA_CONTEXT* context, const char** tags, const char** identifiers, const char** namespaces);
+
+YARA_RULES*       yr_create_rules(int slots);
+void              yr_destroy_rules(YARA_RULES* rules);
+int               yr_publish_rules(YARA_RULES* rules, YARA_CONTEXT* context, YARA_CONTEXT* spare);
+int               yr_update_rules(YARA_RULES* rules, const char* ns, const char* identifier, const char* rules_string);
+YARA_SCANNER*     yr_acquire_rules(YARA_RULES* rules, int slot);
+void              yr_release_rules(YARA_SCANNER* scanner);
 
 int               yr_scan_mem(unsigned char* buffer, size_t buffer_size, YARA_CONTEXT* context, YARACALLBACK callback, void* user_data);
+int               yr_scan_mem_records(unsigned char* buffer, size_t buffer_size, YARA_CONTEXT* context, YARACALLBACK callback, void* user_data);
 int               yr_scan_file(const char* file_path, YARA_CONTEXT* context, YARACALLBACK callback, void* user_data);
+#ifndef WIN32
+int               yr_scan_fd(int fd, const char* file_path, YARA_CONTEXT* context, YARACALLBACK callback, void* user_data);
+#endif
 int               yr_scan_proc(int pid, YARA_CONTEXT* context, YARACALLBACK callback, void* user_data);
 
+YARA_SCANNER*     yr_create_scanner(YARA_CONTEXT* context);
+void              yr_destroy_scanner(YARA_SCANNER* scanner);
+size_t            yr_get_record_number(YARA_SCANNER* scanner);
+size_t            yr_get_record_offset(YARA_SCANNER* scanner);
+
+int               yr_scanner_scan_mem(unsigned char* buffer, size_t buffer_size, YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data);
+int               yr_scanner_scan_mem_records(unsigned char* buffer, size_t buffer_size, YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data);
+int               yr_scanner_scan_file(const char* file_path, YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data);
+#ifndef WIN32
+int               yr_scanner_scan_fd(int fd, const char* file_path, YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data);
+#endif
+int               yr_scanner_scan_proc(int pid, YARA_SCANNER* scanner, YARACALLBACK callback, void* user_data);
+
+int               yr_scan_batch(YARA_SCAN_ITEM* items, int items_count, YARA_CONTEXT* context, int workers_count, YARABATCHCALLBACK callback, void* user_data);
+
+int               yr_open_result_cache(YARA_CONTEXT* context, const char* cache_path);
+void              yr_close_result_cache(YARA_CONTEXT* context);
+
+void              yr_get_memory_stats(MEMORY_STATS* stats);
+
 char*             yr_get_error_message(YARA_CONTEXT* context, char* buffer, int buffer_size);
 
 #endif
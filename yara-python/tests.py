@@ -152,18 +152,82 @@ class TestYara(unittest.TestCase):
 
         self.assertTrueRules([
             'rule test { strings: $a = "ssi" condition: $a at 2 and $a at 5 }',
+            'rule test { strings: $a = "ssi" condition: $a at 5 and #a == 2 }',
         ], 'mississippi')
 
+        self.assertFalseRules([
+            'rule test { strings: $a = "ssi" condition: $a at 3 }',
+        ], 'mississippi')
+
+    def testInRange(self):
+
+        self.assertTrueRules([
+            'rule test { strings: $a = "ssi" condition: $a in (3..6) }',
+            'rule test { strings: $a = "ssi" condition: $a in (5..5) }',
+        ], 'mississippi')
+
+        self.assertFalseRules([
+            'rule test { strings: $a = "ssi" condition: $a in (6..10) }',
+        ], 'mississippi')
+
+    def testOffset(self):
+
+        self.assertTrueRules([
+            'rule test { strings: $a = "ssi" condition: @a[1] == 2 and @a[2] == 5 }',
+        ], 'mississippi')
+
+        self.assertFalseRules([
+            'rule test { strings: $a = "ssi" condition: @a[3] == 0 or @a[0] == 0 }',
+        ], 'mississippi')
+
+    def testSharedStrings(self):
+
+        # rules having the same string share a single pattern while scanning,
+        # but each one keeps its own matches
+
+        def matchesByRule(r, data='mississippi'):
+            return dict((m.rule, m.strings) for m in r.match(data=data))
+
+        ssi = [(2, '$a', b'ssi'), (5, '$a', b'ssi')]
+
+        r = yara.compile(source='rule a { strings: $a = "ssi" condition: #a == 2 } '
+                                'rule b { strings: $a = "ssi" condition: @a[1] == 2 and @a[2] == 5 }')
+        m = matchesByRule(r)
+        self.assertEqual(sorted(m.keys()), ['a', 'b'])
+        self.assertEqual(m['a'], ssi)
+        self.assertEqual(m['b'], ssi)
+
+        r = yara.compile(source='rule a { strings: $a = "ssi" condition: $a } '
+                                'rule b { strings: $a = "ssi" condition: #a == 2 and @a[2] == 5 }', fast_match=True)
+        m = matchesByRule(r)
+        self.assertEqual(sorted(m.keys()), ['a', 'b'])
+        self.assertEqual(m['b'], ssi)
+
+        r = yara.compile(source='rule a { strings: $a = "ssi" condition: $a at 5 } '
+                                'rule b { strings: $a = "ssi" condition: #a == 2 and @a[1] == 2 }')
+        m = matchesByRule(r)
+        self.assertEqual(sorted(m.keys()), ['a', 'b'])
+        self.assertEqual(m['a'], ssi[1:])
+        self.assertEqual(m['b'], ssi)
+
+        r = yara.compile(source='rule a { strings: $a = "ssi" condition: $a at 3 } '
+                                'rule b { strings: $a = "ssi" condition: #a == 2 }')
+        self.assertEqual(list(matchesByRule(r).keys()), ['b'])
+
     def testOf(self):
 
         self.assertTrueRules([
             'rule test { strings: $a = "ssi" $b = "mis" $c = "oops" condition: any of them }',
             'rule test { strings: $a = "ssi" $b = "mis" $c = "oops" condition: 1 of them }',
-            'rule test { strings: $a = "ssi" $b = "mis" $c = "oops" condition: 2 of them }'
+            'rule test { strings: $a = "ssi" $b = "mis" $c = "oops" condition: 2 of them }',
+            'rule test { strings: $a1 = "ssi" $a2 = "mis" $b = "oops" condition: all of ($a*) }',
+            'rule test { strings: $a = "ssi" $b = "mis" $c = "oops" condition: for 2 of them : ($ at 0 or $ at 2) }'
         ], 'mississipi')
 
         self.assertFalseRules([
-            'rule test { strings: $a = "ssi" $b = "mis" $c = "oops" condition: all of them }'
+            'rule test { strings: $a = "ssi" $b = "mis" $c = "oops" condition: all of them }',
+            'rule test { strings: $a1 = "ssi" $a2 = "mis" $b = "oops" condition: 2 of ($b, $a1) }',
+            'rule test { strings: $a = "ssi" $b = "mis" $c = "oops" condition: for all of them : ($ at 0 or $ at 2) }'
         ], 'mississipi')
 
     def testForAll(self):
@@ -215,6 +279,21 @@ class TestYara(unittest.TestCase):
             'rule test { condition: filesize == %d }' % len(PE32_FILE),
         ], PE32_FILE)
 
+    def testRuleReference(self):
+
+        self.assertTrueRules([
+            'private rule a { condition: true } rule test { condition: a and a }',
+            'private rule a { strings: $a = "ssi" condition: #a == 2 } private rule b { condition: a } rule test { condition: a and b }',
+        ], 'mississippi')
+
+        self.assertFalseRules([
+            'private rule a { condition: false } rule test { condition: a or a }',
+            'private rule a { strings: $a = "ssi" condition: #a == 3 } private rule b { condition: a } rule test { condition: b }',
+        ], 'mississippi')
+
+        r = yara.compile(source='rule a { strings: $a = "ssi" condition: $a } rule test { precondition: a or filesize > 0 condition: a }')
+        self.assertTrue(len(r.match(data='mississippi')) == 2)
+
     def testCompileFile(self):
 
         f = tempfile.TemporaryFile('wt')
@@ -717,6 +717,10 @@ PyObject * Rules_match(PyObject *self, PyObject *args, PyObject *keywords)
                {
                    case ERROR_COULD_NOT_ATTACH_TO_PROCESS:
                        return PyErr_Format(YaraError, "access denied");
+                   case ERROR_SCAN_TIMEOUT:
+                       return PyErr_Format(YaraError, "scan timed out");
+                   case ERROR_MEMORY_LIMIT_EXCEEDED:
+                       return PyErr_Format(YaraError, "memory limit exceeded");
                    case ERROR_INSUFICIENT_MEMORY:
                        return PyErr_Format(YaraError, "not enough memory"); 
                    default:
@@ -749,7 +753,7 @@ static PyObject * Rules_weight(PyObject *self)
 
 static PyObject * yara_compile(PyObject *self, PyObject *args, PyObject *keywords)
 { 
-    static char *kwlist[] = {"filepath", "source", "file", "filepaths", "sources", "includes", "externals", NULL};
+    static char *kwlist[] = {"filepath", "source", "file", "filepaths", "sources", "includes", "externals", "fast_match", NULL};
     
     YARA_CONTEXT* context;
     FILE* fh;
@@ -762,6 +766,7 @@ static PyObject * yara_compile(PyObject *self, PyObject *args, PyObject *keyword
     PyObject *filepaths_dict = NULL;
     PyObject *includes = NULL;
     PyObject *externals = NULL;
+    PyObject *fast_match = NULL;
   
     PyObject *key, *value;
   
@@ -771,7 +776,7 @@ static PyObject * yara_compile(PyObject *self, PyObject *args, PyObject *keyword
     char* source = NULL;
     char* ns = NULL;
       
-    if (PyArg_ParseTupleAndKeywords(args, keywords, "|ssOOOOO", kwlist, &filepath, &source, &file, &filepaths_dict, &sources_dict, &includes, &externals))
+    if (PyArg_ParseTupleAndKeywords(args, keywords, "|ssOOOOOO", kwlist, &filepath, &source, &file, &filepaths_dict, &sources_dict, &includes, &externals, &fast_match))
     {      
         context = yr_create_context();
    
@@ -790,6 +795,19 @@ static PyObject * yara_compile(PyObject *self, PyObject *args, PyObject *keyword
                 return PyErr_Format(PyExc_TypeError, "'includes' param must be of boolean type");
             }
         }
+        
+        if (fast_match != NULL)
+        {
+            if (PyBool_Check(fast_match))
+            {
+                context->fast_match = (PyObject_IsTrue(fast_match) == 1);
+            }
+            else
+            {
+                yr_destroy_context(context); 
+                return PyErr_Format(PyExc_TypeError, "'fast_match' param must be of boolean type");
+            }
+        }
             
         if (externals != NULL)
         {
@@ -18,11 +18,14 @@ limitations under the License.
 
 #include <sys/stat.h> 
 #include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 
 #else
 
 #include <windows.h>
+#include <tlhelp32.h>
 #include "getopt.h"
 
 #endif
@@ -30,14 +33,25 @@ limitations under the License.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <yara.h>
 
 #include "config.h"
 #include "REVISION"
 
 #ifndef MAX_PATH
+#ifdef PATH_MAX
+#define MAX_PATH PATH_MAX
+#else
 #define MAX_PATH 255
 #endif
+#endif
+
+#define MAX_SCAN_THREADS    64
+#define MAX_COMPILE_THREADS 64
+#define FILE_QUEUE_SIZE     1024
+#define PREFETCH_DEPTH      64
+#define PREFETCH_SIZE       (16 * 1024 * 1024)
 
 int recursive_search = FALSE;
 int show_tags = FALSE;
@@ -50,7 +64,22 @@ int count = 0;
 int limit = 0;
 extern int thread_count;
 int compile_only = FALSE;
-extern int scan_by_line;
+int fast_match = FALSE;
+int scan_threads = 1;
+int compile_threads = 1;
+const char* result_cache_path = NULL;
+int record_delimiter = -1;
+size_t record_size = 0;
+int region_flags = REGION_FLAGS_READ;
+const char* region_path = NULL;
+int scan_all_processes = FALSE;
+const char* process_name = NULL;
+int process_timeout = 0;
+size_t process_memory_limit = 0;
+unsigned int max_string_matches = DEFAULT_MAX_STRING_MATCHES;
+size_t match_memory_limit = 0;
+
+pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
 
 TAG* specified_tags_list = NULL;
 
@@ -63,14 +92,81 @@ typedef struct _IDENTIFIER
 
 IDENTIFIER* specified_rules_list = NULL;
 
+typedef struct _EXTERNAL
+{
+	char*			name;
+	char*			value;
+	struct _EXTERNAL*	next;
+	
+} EXTERNAL;
+
+EXTERNAL* external_variables = NULL;
+
+typedef struct _EXCLUDED_DIR
+{
+	const char*			path;
+	struct _EXCLUDED_DIR*	next;
+	
+} EXCLUDED_DIR;
+
+EXCLUDED_DIR* excluded_dirs_list = NULL;
+
+/* 
+    What the callback receives as user data, the scanner is needed to know 
+    which record is being reported when scanning records.
+*/
+
+typedef struct _SCAN_TARGET
+{
+    const char*     name;
+    YARA_SCANNER*   scanner;        /* NULL if it doesn't scan records */
+    
+} SCAN_TARGET;
+
+/* 
+    Files found while walking directories are put in this queue when scanning 
+    with more than one thread, each scanning thread takes files from it and 
+    scans them using its own scanner. The first PREFETCH_DEPTH files waiting 
+    in the queue are already open and their reading has been started by the 
+    walker, so the disk is busy reading them while the previous ones are 
+    being scanned.
+*/
+
+typedef struct _FILE_QUEUE_ENTRY
+{
+    char*           path;
+    int             fd;             /* -1 if the file wasn't opened by the walker */
+    
+} FILE_QUEUE_ENTRY;
+
+typedef struct _FILE_QUEUE
+{
+    FILE_QUEUE_ENTRY entries[FILE_QUEUE_SIZE];
+    int             open_files;
+    int             head;
+    int             tail;
+    int             count;
+    int             finished;
+    int             enabled;
+    
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+    
+} FILE_QUEUE;
+
+FILE_QUEUE file_queue;
+
 
 ////////////////////////////////////////////////////////////////////////////////////////////////
 
 void show_help()
 {
-    printf("usage:  yara [OPTION]... [RULEFILE]... FILE | PID\n");
+    printf("usage:  yara [OPTION]... [RULEFILE]... FILE | PID[,PID]...\n");
     printf("options:\n");
 	printf("  -c <count>                cpu (thread) count (defaults to 1)\n");
+	printf("  -p <count>                number of files or processes scanned in parallel (defaults to 1)\n");
+	printf("  -j <count>                number of rule files compiled in parallel (defaults to 1)\n");
 	printf("  -t <tag>                  print rules tagged as <tag> and ignore the rest. Can be used more than once.\n");
     printf("  -i <identifier>           print rules named <identifier> and ignore the rest. Can be used more than once.\n");
 	printf("  -n                        print only not satisfied rules (negate).\n");
@@ -79,9 +175,20 @@ void show_help()
 	printf("  -s                        print matching strings.\n");
 	printf("  -l <number>               abort scanning after a <number> of rules matched.\n");
 	printf("  -L                        scan each line of input file(s) individually.\n");
+	printf("  -D <delimiter>            scan records separated by <delimiter> individually.\n");
+	printf("  -R <size>                 scan records of <size> bytes individually.\n");
+	printf("  -P <filter>               scan only process regions matching <filter> (rwxsa[:path]).\n");
+	printf("  -a                        scan all running processes instead of FILE or PID.\n");
+	printf("  -N <name>                 scan all running processes whose name contains <name>.\n");
+	printf("  -T <seconds>              give up on processes taking longer than <seconds> to scan.\n");
+	printf("  -M <size>                 give up on processes after reading <size> bytes of their memory.\n");
+	printf("  -X <number>               keep at most <number> matches per string (defaults to 1000000, 0 for no limit).\n");
+	printf("  -B <size>                 stop keeping matches once they use <size> bytes.\n");
 	printf("  -d <identifier>=<value>   define external variable.\n");
     printf("  -r                        recursively search directories.\n");
+	printf("  -x <dir>                  skip directory <dir> when searching recursively. Can be used more than once.\n");
 	printf("  -f                        fast matching mode.\n");
+	printf("  -k <file>                 cache results in <file> and skip files already scanned with the same rules.\n");
 	printf("  -v                        show version information.\n");
 	printf("  -C                        only compile the specified rules to check for syntax errors.\n");
 	printf("\nReport bugs to: <%s>\n", PACKAGE_BUGREPORT);
@@ -102,6 +209,177 @@ int is_numeric(const char *str)
 }
 
 
+void file_queue_init()
+{
+    file_queue.head = 0;
+    file_queue.tail = 0;
+    file_queue.count = 0;
+    file_queue.open_files = 0;
+    file_queue.finished = FALSE;
+    file_queue.enabled = TRUE;
+    
+    pthread_mutex_init(&file_queue.lock, NULL);
+    pthread_cond_init(&file_queue.not_empty, NULL);
+    pthread_cond_init(&file_queue.not_full, NULL);
+}
+
+void file_queue_destroy()
+{
+    file_queue.enabled = FALSE;
+    
+    pthread_mutex_destroy(&file_queue.lock);
+    pthread_cond_destroy(&file_queue.not_empty);
+    pthread_cond_destroy(&file_queue.not_full);
+}
+
+void file_queue_put(const char* path, int fd)
+{
+    char* path_copy = strdup(path);
+    
+    if (path_copy == NULL)
+    {
+        if (fd != -1)
+            close(fd);
+            
+        return;
+    }
+    
+    pthread_mutex_lock(&file_queue.lock);
+    
+    while (file_queue.count == FILE_QUEUE_SIZE)
+    {
+        pthread_cond_wait(&file_queue.not_full, &file_queue.lock);
+    }
+    
+    file_queue.entries[file_queue.tail].path = path_copy;
+    file_queue.entries[file_queue.tail].fd = fd;
+    file_queue.tail = (file_queue.tail + 1) % FILE_QUEUE_SIZE;
+    file_queue.count++;
+    
+    if (fd != -1)
+        file_queue.open_files++;
+    
+    pthread_cond_signal(&file_queue.not_empty);
+    pthread_mutex_unlock(&file_queue.lock);
+}
+
+/* 
+    Returns the next file to scan or NULL when the queue is empty and no more 
+    files will be added. The caller must free the returned path, and close 
+    the descriptor stored in fd if it isn't -1.
+*/
+
+char* file_queue_get(int* fd)
+{
+    char* path = NULL;
+    
+    pthread_mutex_lock(&file_queue.lock);
+    
+    while (file_queue.count == 0 && !file_queue.finished)
+    {
+        pthread_cond_wait(&file_queue.not_empty, &file_queue.lock);
+    }
+    
+    if (file_queue.count > 0)
+    {
+        path = file_queue.entries[file_queue.head].path;
+        *fd = file_queue.entries[file_queue.head].fd;
+        
+        if (*fd != -1)
+            file_queue.open_files--;
+            
+        file_queue.head = (file_queue.head + 1) % FILE_QUEUE_SIZE;
+        file_queue.count--;
+        
+        pthread_cond_signal(&file_queue.not_full);
+    }
+    
+    pthread_mutex_unlock(&file_queue.lock);
+    
+    return path;
+}
+
+void file_queue_finish()
+{
+    pthread_mutex_lock(&file_queue.lock);
+    file_queue.finished = TRUE;
+    pthread_cond_broadcast(&file_queue.not_empty);
+    pthread_mutex_unlock(&file_queue.lock);
+}
+
+/* 
+    Tells the walker if the next file should be opened and prefetched before 
+    putting it in the queue.
+*/
+
+int file_queue_should_prefetch()
+{
+    int result;
+    
+    pthread_mutex_lock(&file_queue.lock);
+    result = (file_queue.open_files < PREFETCH_DEPTH);
+    pthread_mutex_unlock(&file_queue.lock);
+    
+    return result;
+}
+
+void scan_file(const char* path, YARA_SCANNER* scanner, YARACALLBACK callback)
+{
+    if (file_queue.enabled)
+    {
+        file_queue_put(path, -1);
+    }
+    else
+    {
+        SCAN_TARGET target = { path, scanner };
+        yr_scanner_scan_file(path, scanner, callback, &target);
+    }
+}
+
+
+/* 
+    Directories given with -x are skipped without descending into them. An 
+    exclusion containing a path separator is compared against the whole path 
+    of the directory, otherwise it's compared against the directory name alone.
+*/
+
+int is_excluded(const char* path, const char* name)
+{
+    EXCLUDED_DIR* excluded = excluded_dirs_list;
+    
+    while (excluded != NULL)
+    {
+        if (strpbrk(excluded->path, "/\\") != NULL)
+        {
+            if (strcmp(excluded->path, path) == 0)
+                return TRUE;
+        }
+        else if (strcmp(excluded->path, name) == 0)
+        {
+            return TRUE;
+        }
+        
+        excluded = excluded->next;
+    }
+    
+    return FALSE;
+}
+
+/* 
+    Removes trailing path separators so that paths built while walking match 
+    the ones given with -x, the root directory is left untouched.
+*/
+
+void strip_trailing_separators(char* path)
+{
+    size_t length = strlen(path);
+    
+    while (length > 1 && (path[length - 1] == '/' || path[length - 1] == '\\'))
+    {
+        path[--length] = '\0';
+    }
+}
+
 #ifdef WIN32
 
 int is_directory(const char* path)
@@ -116,13 +394,17 @@ int is_directory(const char* path)
 	}
 }
 
-void scan_dir(const char* dir, int recursive, YARA_CONTEXT* context, YARACALLBACK callback)
+void scan_dir(const char* dir, int recursive, YARA_SCANNER* scanner, YARACALLBACK callback)
 {
 	WIN32_FIND_DATA FindFileData;
 	HANDLE hFind;
 
 	char full_path[MAX_PATH];
-	static char path_and_mask[MAX_PATH];
+	char path_and_mask[MAX_PATH];
+	size_t dir_length = strlen(dir);
+	
+	if (dir_length + 3 > MAX_PATH)
+	    return;
 	
 	sprintf(path_and_mask, "%s\\*", dir);
 	
@@ -132,16 +414,23 @@ void scan_dir(const char* dir, int recursive, YARA_CONTEXT* context, YARACALLBAC
 	{
 		do
 		{
+		    if (dir_length + strlen(FindFileData.cFileName) + 2 > MAX_PATH)
+		    {
+		        fprintf(stderr, "path too long: %s\\%s\n", dir, FindFileData.cFileName);
+		        continue;
+		    }
+		    
 			sprintf(full_path, "%s\\%s", dir, FindFileData.cFileName);
 
 			if (!(FindFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
 			{
 				//printf("Processing %s...\n", FindFileData.cFileName);
-				yr_scan_file(full_path, context, callback, full_path);
+				scan_file(full_path, scanner, callback);
 			}
-			else if (recursive && FindFileData.cFileName[0] != '.' )
+			else if (recursive && FindFileData.cFileName[0] != '.' && 
+			         !is_excluded(full_path, FindFileData.cFileName))
 			{
-				scan_dir(full_path, recursive, context, callback);
+				scan_dir(full_path, recursive, scanner, callback);
 			}
 
 		} while (FindNextFile(hFind, &FindFileData));
@@ -164,44 +453,157 @@ int is_directory(const char* path)
 	return 0;
 }
 
-void scan_dir(const char* dir, int recursive, YARA_CONTEXT* context, YARACALLBACK callback)
+#define ENTRY_OTHER         0
+#define ENTRY_FILE          1
+#define ENTRY_DIRECTORY     2
+
+/* 
+    Tells whether a directory entry is a regular file or a directory, using 
+    the type returned by readdir when the file system provides it and falling 
+    back to fstatat otherwise. Symbolic links are followed like stat does.
+*/
+
+int entry_type(int dir_fd, struct dirent* de)
+{
+    struct stat st;
+    
+#ifdef DT_DIR
+    if (de->d_type == DT_REG)
+        return ENTRY_FILE;
+        
+    if (de->d_type == DT_DIR)
+        return ENTRY_DIRECTORY;
+        
+    if (de->d_type != DT_UNKNOWN && de->d_type != DT_LNK)
+        return ENTRY_OTHER;
+#endif
+
+    if (fstatat(dir_fd, de->d_name, &st, 0) != 0)
+        return ENTRY_OTHER;
+        
+    if (S_ISREG(st.st_mode))
+        return ENTRY_FILE;
+        
+    if (S_ISDIR(st.st_mode))
+        return ENTRY_DIRECTORY;
+        
+    return ENTRY_OTHER;
+}
+
+/* 
+    Opens a file and asks the kernel to start reading it in the background.
+    Returns the file descriptor or -1 if the file couldn't be opened.
+*/
+
+int prefetch_file(int dir_fd, const char* name)
+{
+    int fd = openat(dir_fd, name, O_RDONLY);
+    
+#ifdef POSIX_FADV_WILLNEED
+    if (fd != -1)
+        posix_fadvise(fd, 0, PREFETCH_SIZE, POSIX_FADV_WILLNEED);
+#endif
+
+    return fd;
+}
+
+/* 
+    Walks the directory open as dir_fd, whose path is in the first path_length 
+    characters of path. Entries are opened relative to their parent directory 
+    so the kernel doesn't resolve the whole path again for each of them, path 
+    is only extended in place to report matches and to feed the file queue. 
+    The descriptor is closed before returning.
+*/
+
+void scan_dir_fd(int dir_fd, char* path, size_t path_length, int recursive, YARA_SCANNER* scanner, YARACALLBACK callback)
 {
 	DIR *dp;
 	struct dirent *de;
-	struct stat st;
-	char full_path[MAX_PATH];
+	size_t name_length;
+	int fd;
 
-	dp = opendir(dir);
+	dp = fdopendir(dir_fd);
 	
-	if (dp)
+	if (dp == NULL)
 	{
-		de = readdir(dp);
-		
-		while (de)
-		{
-			sprintf(full_path, "%s/%s", dir, de->d_name);
-			
-			int err = stat(full_path,&st);
-			
-			if (err == 0)
-			{
-				if(S_ISREG(st.st_mode))
-				{
-					//printf("Processing %s\n", de->d_name);		
-					yr_scan_file(full_path, context, callback, full_path);
-				}
-				else if(recursive && S_ISDIR(st.st_mode) && de->d_name[0] != '.')
-				{
-					//printf("Entering %s\n", de->d_name);
-					scan_dir(full_path, recursive, context, callback);
-				}
-			}
-			
-			de = readdir(dp);
-		}
-		
-		closedir(dp);
+	    close(dir_fd);
+	    return;
+	}
+	
+	while ((de = readdir(dp)) != NULL)
+	{
+	    name_length = strlen(de->d_name);
+	    
+	    if (path_length + name_length + 2 > MAX_PATH)
+	    {
+	        path[path_length] = '\0';
+	        fprintf(stderr, "path too long: %s/%s\n", path, de->d_name);
+	        continue;
+	    }
+	    
+	    path[path_length] = '/';
+	    memcpy(path + path_length + 1, de->d_name, name_length + 1);
+	    
+	    switch (entry_type(dirfd(dp), de))
+	    {
+	        case ENTRY_FILE:
+	        
+	            if (file_queue.enabled)
+	            {
+	                fd = file_queue_should_prefetch() ? prefetch_file(dirfd(dp), de->d_name) : -1;
+	                file_queue_put(path, fd);
+	                break;
+	            }
+	            
+	            fd = openat(dirfd(dp), de->d_name, O_RDONLY);
+	            
+	            if (fd != -1)
+	            {
+	                SCAN_TARGET target = { path, scanner };
+	                yr_scanner_scan_fd(fd, path, scanner, callback, &target);
+	            }
+	            
+	            break;
+	            
+	        case ENTRY_DIRECTORY:
+	        
+	            if (!recursive || de->d_name[0] == '.' || is_excluded(path, de->d_name))
+	                break;
+	                
+	            fd = openat(dirfd(dp), de->d_name, O_RDONLY | O_DIRECTORY);
+	            
+	            if (fd != -1)
+	            {
+	                scan_dir_fd(fd, path, path_length + name_length + 1, recursive, scanner, callback);
+	            }
+	            
+	            break;
+	    }
 	}
+	
+	path[path_length] = '\0';
+	
+	closedir(dp);
+}
+
+void scan_dir(const char* dir, int recursive, YARA_SCANNER* scanner, YARACALLBACK callback)
+{
+    char path[MAX_PATH];
+    int fd;
+    
+    if (strlen(dir) + 1 > MAX_PATH)
+        return;
+        
+    strcpy(path, dir);
+    strip_trailing_separators(path);
+    
+    fd = open(path, O_RDONLY | O_DIRECTORY);
+    
+    if (fd != -1)
+    {
+        /* for the root directory entries are appended right after its slash */
+        scan_dir_fd(fd, path, strcmp(path, "/") == 0 ? 0 : strlen(path), recursive, scanner, callback);
+    }
 }
 
 #endif
@@ -244,6 +646,7 @@ void print_hex_string(unsigned char* data, unsigned int length)
 
 int callback(RULE* rule, void* data)
 {
+    SCAN_TARGET* target = (SCAN_TARGET*) data;
 	TAG* tag;
     IDENTIFIER* identifier;
 	STRING* string;
@@ -252,7 +655,12 @@ int callback(RULE* rule, void* data)
 	
     int rule_match;
     int string_found;
+    int result = CALLBACK_CONTINUE;
 	int show = TRUE;
+	
+	/* rules matching different files can be reported by several threads */
+	
+	pthread_mutex_lock(&output_lock);
 		
 	if (show_specified_tags)
 	{
@@ -349,7 +757,14 @@ int callback(RULE* rule, void* data)
     		printf("] ");
     	}
 		
-		printf("%s\n", (char*) data);
+		if (target->scanner != NULL && yr_get_record_number(target->scanner) > 0)
+		{
+		    printf("%s:%lu@0x%lx\n", target->name, (unsigned long) yr_get_record_number(target->scanner), (unsigned long) yr_get_record_offset(target->scanner));
+		}
+		else
+		{
+		    printf("%s\n", target->name);
+		}
 		
 		/* show matched strings */
 		
@@ -395,21 +810,97 @@ int callback(RULE* rule, void* data)
         count++;
 	
 	if (limit != 0 && count >= limit)
-        return CALLBACK_ABORT;
+        result = CALLBACK_ABORT;
+        
+    pthread_mutex_unlock(&output_lock);
 	
-    return CALLBACK_CONTINUE;
+    return result;
+}
+
+/* 
+    Parses a record delimiter, which can be a single character, one of the
+    escape sequences \n, \r, \t and \0 or a byte in hex like 0x1e. Returns
+    -1 if the delimiter is not valid.
+*/
+
+int parse_delimiter(const char* str)
+{
+    char* end;
+    long value;
+    
+    if (strlen(str) == 1)
+        return (unsigned char) str[0];
+        
+    if (str[0] == '\\' && strlen(str) == 2)
+    {
+        switch (str[1])
+        {
+            case 'n':   return '\n';
+            case 'r':   return '\r';
+            case 't':   return '\t';
+            case '0':   return '\0';
+            case '\\':  return '\\';
+        }
+        
+        return -1;
+    }
+    
+    if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X'))
+    {
+        value = strtol(str, &end, 16);
+        
+        if (*end == '\0' && value >= 0 && value <= 255)
+            return (int) value;
+    }
+    
+    return -1;
+}
+
+/*
+    Parses a process region filter: any of the letters r, w, x, s (shared) and
+    a (anonymous), which the regions must all have, optionally followed by a 
+    colon and a string their paths must contain.
+*/
+
+int parse_region_filter(char* str)
+{
+    char* colon = strchr(str, ':');
+    
+    if (colon != NULL)
+    {
+        *colon = '\0';
+        region_path = colon + 1;
+    }
+    
+    region_flags = REGION_FLAGS_READ;
+    
+    for (; *str != '\0'; str++)
+    {
+        switch (*str)
+        {
+            case 'r':   region_flags |= REGION_FLAGS_READ; break;
+            case 'w':   region_flags |= REGION_FLAGS_WRITE; break;
+            case 'x':   region_flags |= REGION_FLAGS_EXECUTE; break;
+            case 's':   region_flags |= REGION_FLAGS_SHARED; break;
+            case 'a':   region_flags |= REGION_FLAGS_ANONYMOUS; break;
+            default:    return FALSE;
+        }
+    }
+    
+    return TRUE;
 }
 
 int process_cmd_line(YARA_CONTEXT* context, int argc, char const* argv[])
 {
     char* equal_sign;
-    char* value;
 	char c;	
 	TAG* tag;
     IDENTIFIER* identifier;
+    EXTERNAL* external;
+    EXCLUDED_DIR* excluded;
 	opterr = 0;
  
-	while ((c = getopt (argc, (char**) argv, "rnsvgmLl:t:i:d:fc:C")) != -1)
+	while ((c = getopt (argc, (char**) argv, "rnsvgmLD:R:P:aN:T:M:X:B:l:t:i:d:x:fk:c:p:j:C")) != -1)
 	{
 		switch (c)
 	    {
@@ -438,11 +929,71 @@ int process_cmd_line(YARA_CONTEXT* context, int argc, char const* argv[])
     			break;
 
             case 'L':
-                scan_by_line = TRUE;
+                record_delimiter = '\n';
+                break;
+                
+            case 'D':
+                record_delimiter = parse_delimiter(optarg);
+                
+                if (record_delimiter == -1)
+                {
+                    fprintf(stderr, "invalid record delimiter: %s\n", optarg);
+                    return 0;
+                }
+                
+                break;
+                
+            case 'R':
+                record_size = strtoul(optarg, NULL, 0);
+                
+                if (record_size == 0)
+                {
+                    fprintf(stderr, "invalid record size: %s\n", optarg);
+                    return 0;
+                }
+                
+                break;
+                
+            case 'P':
+                if (!parse_region_filter(optarg))
+                {
+                    fprintf(stderr, "invalid region filter: %s\n", optarg);
+                    return 0;
+                }
+                
+                break;
+                
+            case 'a':
+                scan_all_processes = TRUE;
+                break;
+                
+            case 'N':
+                scan_all_processes = TRUE;
+                process_name = optarg;
+                break;
+                
+            case 'T':
+                process_timeout = atoi(optarg);
+                break;
+                
+            case 'M':
+                process_memory_limit = strtoul(optarg, NULL, 0);
+                break;
+                
+            case 'X':
+                max_string_matches = strtoul(optarg, NULL, 0);
+                break;
+                
+            case 'B':
+                match_memory_limit = strtoul(optarg, NULL, 0);
                 break;
 
 			case 'f':
-    			context->fast_match = TRUE;
+    			fast_match = TRUE;
+    			break;
+    			
+			case 'k':
+    			result_cache_path = optarg;
     			break;
 		
 		   	case 't':
@@ -493,24 +1044,44 @@ int process_cmd_line(YARA_CONTEXT* context, int argc, char const* argv[])
 		        {
 		            *equal_sign = '\0';
 		            
-		            value = equal_sign + 1;
+		            external = malloc(sizeof(EXTERNAL));
 		            
-		            if (is_numeric(value))
-		            {		                
-		                yr_define_integer_variable(context, optarg, atol(value));
-		            }
-		            else if (strcmp(value, "true") == 0  || strcmp(value, "false") == 0)
+		            if (external != NULL)
 		            {
-		                yr_define_boolean_variable(context, optarg, strcmp(value, "true") == 0);
+		                external->name = optarg;
+		                external->value = equal_sign + 1;
+		                external->next = external_variables;
+		                external_variables = external;
 		            }
 		            else
 		            {
-		                yr_define_string_variable(context, optarg, value);
-		            }	            
+		                fprintf (stderr, "Not enough memory.\n");
+		                return 0;
+		            }
 		        }
 
 		        break;
 		        
+		    case 'x':
+		    
+		        excluded = malloc(sizeof(EXCLUDED_DIR));
+		        
+		        if (excluded != NULL)
+		        {
+		            strip_trailing_separators(optarg);
+		            
+		            excluded->path = optarg;
+		            excluded->next = excluded_dirs_list;
+		            excluded_dirs_list = excluded;
+		        }
+		        else
+		        {
+		            fprintf (stderr, "Not enough memory.\n");
+		            return 0;
+		        }
+		        
+		        break;
+		        
 		    case 'l':	    
                 limit = atoi(optarg);
                 break;
@@ -518,6 +1089,26 @@ int process_cmd_line(YARA_CONTEXT* context, int argc, char const* argv[])
             case 'c':
                 thread_count = atoi(optarg);
                 break;
+                
+            case 'p':
+                scan_threads = atoi(optarg);
+                
+                if (scan_threads < 1)
+                    scan_threads = 1;
+                else if (scan_threads > MAX_SCAN_THREADS)
+                    scan_threads = MAX_SCAN_THREADS;
+                    
+                break;
+                
+            case 'j':
+                compile_threads = atoi(optarg);
+                
+                if (compile_threads < 1)
+                    compile_threads = 1;
+                else if (compile_threads > MAX_COMPILE_THREADS)
+                    compile_threads = MAX_COMPILE_THREADS;
+                    
+                break;
 
             case 'C':
                 compile_only = TRUE;
@@ -554,13 +1145,704 @@ void report_error(const char* file_name, int line_number, const char* error_mess
     fprintf(stderr, "%s:%d: %s\n", file_name, line_number, error_message);
 }
 
+/* 
+    Warnings about matches not kept, name is NULL when scanning processes in 
+    a batch, as the callback doesn't know which one is being scanned.
+*/
+
+void print_warning(int warning, STRING* string, const char* name)
+{
+    pthread_mutex_lock(&output_lock);
+    
+    if (name != NULL)
+        fprintf(stderr, "%s: ", name);
+        
+    switch (warning)
+    {
+        case WARNING_TOO_MANY_MATCHES:
+            fprintf(stderr, "warning: string %s in rule %s has too many matches, only the first %u were kept\n", 
+                    string->identifier, string->rule->identifier, max_string_matches);
+            break;
+        case WARNING_MATCH_MEMORY_EXHAUSTED:
+            fprintf(stderr, "warning: matches use too much memory, some of them were not kept\n");
+            break;
+    }
+    
+    pthread_mutex_unlock(&output_lock);
+}
+
+void report_warning(int warning, STRING* string, void* data)
+{
+    SCAN_TARGET* target = (SCAN_TARGET*) data;
+    
+    print_warning(warning, string, target->name);
+}
+
+void report_process_warning(int warning, STRING* string, void* data)
+{
+    print_warning(warning, string, NULL);
+}
+
+/* 
+    Defines the variables given with -d in the context, it must be done before
+    compiling the rules.
+*/
+
+void define_external_variables(YARA_CONTEXT* context)
+{
+    EXTERNAL* external = external_variables;
+    
+    while (external != NULL)
+    {
+        if (is_numeric(external->value))
+        {		                
+            yr_define_integer_variable(context, external->name, atol(external->value));
+        }
+        else if (strcmp(external->value, "true") == 0  || strcmp(external->value, "false") == 0)
+        {
+            yr_define_boolean_variable(context, external->name, strcmp(external->value, "true") == 0);
+        }
+        else
+        {
+            yr_define_string_variable(context, external->name, external->value);
+        }
+        
+        external = external->next;
+    }
+}
+
+/*
+    Compiles a rule file into context, returns the number of errors or -1 if
+    the file couldn't be opened.
+*/
+
+int compile_rule_file(YARA_CONTEXT* context, const char* file_name)
+{
+    FILE* rule_file;
+    int errors;
+    
+    rule_file = fopen(file_name, "r");
+    
+    if (rule_file == NULL)
+        return -1;
+        
+    yr_push_file_name(context, file_name);
+    
+    errors = yr_compile_file(rule_file, context);
+    
+    yr_pop_file_name(context);
+    fclose(rule_file);
+    
+    return errors;
+}
+
+/*
+    With -j each rule file is compiled alone in a context of its own by a 
+    pool of threads. The results are merged afterwards in the order of the 
+    files, so rules end up exactly as if compiled one file after another.
+*/
+
+typedef struct _COMPILE_JOB
+{
+    const char*     file_name;
+    int             opened;
+    YARA_CONTEXT*   context;        /* NULL if it didn't compile alone */
+    
+} COMPILE_JOB;
+
+
+typedef struct _COMPILE_QUEUE
+{
+    COMPILE_JOB*    jobs;
+    int             jobs_count;
+    int             next_job;
+    pthread_mutex_t lock;
+    
+} COMPILE_QUEUE;
+
+
+void* compiling_thread(void* param)
+{
+    COMPILE_QUEUE* queue = (COMPILE_QUEUE*) param;
+    COMPILE_JOB* job;
+    YARA_CONTEXT* context;
+    int errors;
+    
+    while (TRUE)
+    {
+        pthread_mutex_lock(&queue->lock);
+        
+        job = (queue->next_job < queue->jobs_count) ? &queue->jobs[queue->next_job++] : NULL;
+        
+        pthread_mutex_unlock(&queue->lock);
+        
+        if (job == NULL)
+            break;
+            
+        context = yr_create_context();
+        
+        if (context == NULL)
+            continue;
+        
+        context->fast_match = fast_match;
+        define_external_variables(context);
+        
+        errors = compile_rule_file(context, job->file_name);
+        
+        job->opened = (errors != -1);
+        
+        if (errors == 0)
+            job->context = context;
+        else
+            yr_destroy_context(context);
+    }
+    
+    return NULL;
+}
+
+/*
+    Compiles the rule files argv[first_rule_file] to argv[last_rule_file - 1]
+    into context. Files that didn't compile alone, because of errors or 
+    because they use rules from previous files, or that can't be merged are 
+    compiled again in context, which reports their errors as usual. Files 
+    that can't be opened are reported and skipped, they make compile_only 
+    runs fail. Returns FALSE if compilation failed.
+*/
+
+int compile_rule_files(YARA_CONTEXT* context, int first_rule_file, int last_rule_file, char const* argv[])
+{
+    COMPILE_QUEUE queue;
+    pthread_t threads[MAX_COMPILE_THREADS];
+    
+    int threads_count = 0;
+    int result = TRUE;
+    int merge_result;
+    int errors, i;
+    
+    char message[256];
+    
+    queue.jobs_count = last_rule_file - first_rule_file;
+    queue.next_job = 0;
+    
+    if (queue.jobs_count <= 0)
+        return TRUE;
+    
+    queue.jobs = (COMPILE_JOB*) malloc(queue.jobs_count * sizeof(COMPILE_JOB));
+    
+    if (queue.jobs == NULL)
+        return FALSE;
+        
+    for (i = 0; i < queue.jobs_count; i++)
+    {
+        queue.jobs[i].file_name = argv[first_rule_file + i];
+        queue.jobs[i].opened = TRUE;
+        queue.jobs[i].context = NULL;
+    }
+    
+    /* with a single thread or file everything is compiled directly in context */
+    
+    if (compile_threads > 1 && queue.jobs_count > 1)
+    {
+        pthread_mutex_init(&queue.lock, NULL);
+        
+        while (threads_count < compile_threads - 1 && threads_count < queue.jobs_count - 1)
+        {
+            if (pthread_create(&threads[threads_count], NULL, compiling_thread, &queue) != 0)
+                break;
+                
+            threads_count++;
+        }
+        
+        compiling_thread(&queue);
+        
+        for (i = 0; i < threads_count; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        
+        pthread_mutex_destroy(&queue.lock);
+    }
+    
+    for (i = 0; i < queue.jobs_count; i++)
+    {
+        errors = 0;
+        
+        if (!result)
+        {
+            /* an earlier file failed, just free the rest */
+        }
+        else if (!queue.jobs[i].opened)
+        {
+            errors = -1;
+        }
+        else if (queue.jobs[i].context == NULL)
+        {
+            errors = compile_rule_file(context, queue.jobs[i].file_name);
+        }
+        else
+        {
+            merge_result = yr_merge_context(context, queue.jobs[i].context);
+            
+            if (merge_result == ERROR_DUPLICATE_RULE_IDENTIFIER || 
+                merge_result == ERROR_AMBIGUOUS_IDENTIFIER)
+            {
+                /* nothing was moved, compiling it in context does the right thing */
+                
+                errors = compile_rule_file(context, queue.jobs[i].file_name);
+            }
+            else if (merge_result != ERROR_SUCCESS)
+            {
+                /* some rules may have been moved already, it can't be compiled again */
+                
+                yr_get_error_message(context, message, sizeof(message));
+                fprintf(stderr, "%s: %s\n", queue.jobs[i].file_name, message);
+                errors = 1;
+            }
+        }
+        
+        if (errors == -1)
+        {
+            fprintf(stderr, "could not open file: %s\n", queue.jobs[i].file_name);
+            
+            if (compile_only)
+                result = FALSE;
+        }
+        else if (errors > 0)
+        {
+            result = FALSE;
+        }
+        
+        if (queue.jobs[i].context != NULL)
+            yr_destroy_context(queue.jobs[i].context);
+    }
+    
+    free(queue.jobs);
+    
+    return result;
+}
+
+/*
+    Takes out of the context the rules that -t or -i keep from being printed,
+    unless they are needed by the ones printed. As in callback, the tags are 
+    ignored when identifiers are given. Nothing is taken out with -l, which 
+    counts the matches of every rule.
+*/
+
+int select_rules(YARA_CONTEXT* context)
+{
+    TAG* tag;
+    IDENTIFIER* identifier;
+    const char** names;
+    int names_count = 0;
+    int result;
+    
+    if ((!show_specified_tags && !show_specified_rules) || limit != 0)
+        return ERROR_SUCCESS;
+    
+    if (show_specified_rules)
+    {
+        for (identifier = specified_rules_list; identifier != NULL; identifier = identifier->next)
+            names_count++;
+    }
+    else
+    {
+        for (tag = specified_tags_list; tag != NULL; tag = tag->next)
+            names_count++;
+    }
+    
+    names = (const char**) malloc((names_count + 1) * sizeof(char*));
+    
+    if (names == NULL)
+        return ERROR_INSUFICIENT_MEMORY;
+        
+    names_count = 0;
+    
+    if (show_specified_rules)
+    {
+        for (identifier = specified_rules_list; identifier != NULL; identifier = identifier->next)
+            names[names_count++] = identifier->name;
+            
+        names[names_count] = NULL;
+        result = yr_select_rules(context, NULL, names, NULL);
+    }
+    else
+    {
+        for (tag = specified_tags_list; tag != NULL; tag = tag->next)
+            names[names_count++] = tag->identifier;
+            
+        names[names_count] = NULL;
+        result = yr_select_rules(context, names, NULL, NULL);
+    }
+    
+    free(names);
+    
+    return result;
+}
+
+void* scanning_thread(void* param)
+{
+    YARA_SCANNER* scanner = (YARA_SCANNER*) param;
+    SCAN_TARGET target;
+    char* path;
+    int fd;
+    
+    target.scanner = scanner;
+    
+    while ((path = file_queue_get(&fd)) != NULL)
+    {
+        target.name = path;
+        
+#ifndef WIN32
+        if (fd != -1)
+            yr_scanner_scan_fd(fd, path, scanner, callback, &target);
+        else
+#endif
+            yr_scanner_scan_file(path, scanner, callback, &target);
+            
+        free(path);
+    }
+    
+    return NULL;
+}
+
+/*
+    Scans a directory with scan_threads threads, all of them sharing the 
+    rules of the context, each one with a scanner of its own. The first 
+    scanner is the caller's and is used to scan the directory alone if no 
+    thread can be started.
+*/
+
+void scan_dir_parallel(const char* dir, YARA_SCANNER* scanner, YARA_CONTEXT* context)
+{
+    YARA_SCANNER* scanners[MAX_SCAN_THREADS];
+    pthread_t threads[MAX_SCAN_THREADS];
+    int scanners_count;
+    int threads_count = 0;
+    int i;
+    
+    scanners[0] = scanner;
+    
+    for (scanners_count = 1; scanners_count < scan_threads; scanners_count++)
+    {
+        scanners[scanners_count] = yr_create_scanner(context);
+        
+        if (scanners[scanners_count] == NULL)
+            break;
+    }
+    
+    file_queue_init();
+    
+    for (i = 0; i < scanners_count; i++)
+    {
+        if (pthread_create(&threads[i], NULL, scanning_thread, scanners[i]) != 0)
+            break;
+            
+        threads_count++;
+    }
+    
+    if (threads_count > 0)
+    {
+        scan_dir(dir, recursive_search, scanner, callback);
+    }
+    
+    file_queue_finish();
+    
+    for (i = 0; i < threads_count; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    
+    file_queue_destroy();
+    
+    if (threads_count == 0)
+    {
+        scan_dir(dir, recursive_search, scanner, callback);
+    }
+    
+    for (i = 1; i < scanners_count; i++)
+    {
+        yr_destroy_scanner(scanners[i]);
+    }
+}
+
+/*
+    Process ids are collected into an array grown as needed, the caller frees
+    it when done.
+*/
+
+int add_pid(int** pids, int* pids_count, int* capacity, int pid)
+{
+    int* new_pids;
+    
+    if (*pids_count == *capacity)
+    {
+        new_pids = (int*) realloc(*pids, (*capacity + 256) * sizeof(int));
+        
+        if (new_pids == NULL)
+            return FALSE;
+            
+        *pids = new_pids;
+        *capacity += 256;
+    }
+    
+    (*pids)[(*pids_count)++] = pid;
+    
+    return TRUE;
+}
+
+int is_pid_list(const char* str)
+{
+    if (!isdigit(*str))
+        return FALSE;
+        
+    while (*str)
+    {
+        if (!isdigit(*str) && !(*str == ',' && isdigit(str[1])))
+            return FALSE;
+            
+        str++;
+    }
+    
+    return TRUE;
+}
+
+int parse_pid_list(const char* str, int** pids, int* pids_count)
+{
+    int capacity = 0;
+    
+    *pids = NULL;
+    *pids_count = 0;
+    
+    while (*str)
+    {
+        if (!add_pid(pids, pids_count, &capacity, atoi(str)))
+            return FALSE;
+            
+        while (isdigit(*str))
+            str++;
+            
+        if (*str == ',')
+            str++;
+    }
+    
+    return TRUE;
+}
+
+/*
+    Lists the running processes whose name contains the given one, or all of
+    them if it's NULL. The process running yara is left out.
+*/
+
+#ifdef WIN32
+
+int list_processes(const char* name, int** pids, int* pids_count)
+{
+    HANDLE snapshot;
+    PROCESSENTRY32 entry;
+    int capacity = 0;
+    int result = TRUE;
+    
+    *pids = NULL;
+    *pids_count = 0;
+    
+    snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+    
+    if (snapshot == INVALID_HANDLE_VALUE)
+        return FALSE;
+        
+    entry.dwSize = sizeof(entry);
+    
+    if (Process32First(snapshot, &entry))
+    {
+        do
+        {
+            if (entry.th32ProcessID == GetCurrentProcessId() || entry.th32ProcessID == 0)
+                continue;
+                
+            if (name != NULL && strstr(entry.szExeFile, name) == NULL)
+                continue;
+                
+            result = add_pid(pids, pids_count, &capacity, entry.th32ProcessID);
+            
+        } while (result && Process32Next(snapshot, &entry));
+    }
+    
+    CloseHandle(snapshot);
+    
+    return result;
+}
+
+#else
+
+int list_processes(const char* name, int** pids, int* pids_count)
+{
+    DIR* dp;
+    struct dirent* de;
+    FILE* comm;
+    char path[64];
+    char comm_name[256];
+    int capacity = 0;
+    int result = TRUE;
+    int pid;
+    
+    *pids = NULL;
+    *pids_count = 0;
+    
+    dp = opendir("/proc");
+    
+    if (dp == NULL)
+        return FALSE;
+        
+    while (result && (de = readdir(dp)) != NULL)
+    {
+        if (!is_numeric(de->d_name))
+            continue;
+            
+        pid = atoi(de->d_name);
+        
+        if (pid == getpid())
+            continue;
+            
+        if (name != NULL)
+        {
+            snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+            
+            comm = fopen(path, "r");
+            
+            /* the process could be gone already */
+            
+            if (comm == NULL)
+                continue;
+                
+            if (fgets(comm_name, sizeof(comm_name), comm) == NULL)
+                comm_name[0] = '\0';
+                
+            fclose(comm);
+            
+            if (strstr(comm_name, name) == NULL)
+                continue;
+        }
+        
+        result = add_pid(pids, pids_count, &capacity, pid);
+    }
+    
+    closedir(dp);
+    
+    return result;
+}
+
+#endif
+
+void report_process_error(const char* name, int result)
+{
+    switch (result)
+    {
+        case ERROR_SUCCESS:
+            break;
+        case ERROR_COULD_NOT_ATTACH_TO_PROCESS:
+            fprintf(stderr, "%s: can not attach to process (try running as root)\n", name);
+            break;
+        case ERROR_INSUFICIENT_MEMORY:
+            fprintf(stderr, "%s: not enough memory\n", name);
+            break;
+        case ERROR_SCAN_TIMEOUT:
+            fprintf(stderr, "%s: scan timed out\n", name);
+            break;
+        case ERROR_MEMORY_LIMIT_EXCEEDED:
+            fprintf(stderr, "%s: memory limit exceeded\n", name);
+            break;
+        default:
+            fprintf(stderr, "%s: internal error: %d\n", name, result);
+            break;     
+    }
+}
+
+int process_callback(RULE* rule, int item_index, void* data)
+{
+    SCAN_TARGET* targets = (SCAN_TARGET*) data;
+    
+    return callback(rule, &targets[item_index]);
+}
+
+/*
+    Scans several processes at once with yr_scan_batch, using up to 
+    scan_threads workers like scan_dir_parallel does. Processes that can't
+    be attached to are only reported when they were given explicitly, when 
+    scanning all processes many of them are expected to be off limits.
+*/
+
+void scan_processes(int* pids, int pids_count, YARA_CONTEXT* context)
+{
+    YARA_SCAN_ITEM* items;
+    SCAN_TARGET* targets;
+    char* names;
+    int i;
+    
+    items = (YARA_SCAN_ITEM*) malloc(pids_count * sizeof(YARA_SCAN_ITEM));
+    targets = (SCAN_TARGET*) malloc(pids_count * sizeof(SCAN_TARGET));
+    names = (char*) malloc(pids_count * 16);
+    
+    if (items == NULL || targets == NULL || names == NULL)
+    {
+        fprintf(stderr, "not enough memory\n");
+        free(items);
+        free(targets);
+        free(names);
+        return;
+    }
+    
+    for (i = 0; i < pids_count; i++)
+    {
+        snprintf(names + i * 16, 16, "%d", pids[i]);
+        
+        items[i].type = SCAN_ITEM_TYPE_PROCESS;
+        items[i].file_path = NULL;
+        items[i].data = NULL;
+        items[i].size = 0;
+        items[i].pid = pids[i];
+        
+        targets[i].name = names + i * 16;
+        targets[i].scanner = NULL;
+    }
+    
+    /* 
+        warnings receive the targets array, its first item is the process 
+        being scanned only when there is just one
+    */
+    
+    if (pids_count > 1)
+        context->warning_function = report_process_warning;
+    
+    yr_scan_batch(items, pids_count, context, scan_threads, process_callback, targets);
+    
+    context->warning_function = report_warning;
+    
+    for (i = 0; i < pids_count; i++)
+    {
+        if (items[i].result != ERROR_COULD_NOT_ATTACH_TO_PROCESS || !scan_all_processes)
+            report_process_error(targets[i].name, items[i].result);
+    }
+    
+    free(items);
+    free(targets);
+    free(names);
+}
+
 int main(int argc, char const* argv[])
 {
 	int i, pid, errors;
+	int last_rule_file;
+	int* pids;
+	int pids_count;
 	YARA_CONTEXT* context;
-	FILE* rule_file;
+	YARA_SCANNER* scanner;
 	TAG* tag;
 	TAG* next_tag;
+	EXTERNAL* external;
+	EXTERNAL* next_external;
+	EXCLUDED_DIR* excluded;
+	EXCLUDED_DIR* next_excluded;
+	SCAN_TARGET target;
 	
 	yr_init();
 			
@@ -575,42 +1857,38 @@ int main(int argc, char const* argv[])
 		return 0;
 	}	
 		
-	if (argc == 1 || ((optind == argc) && (! compile_only)))
+	if (argc == 1 || ((optind == argc) && (! compile_only) && (! scan_all_processes)))
 	{
 	    yr_destroy_context(context);
 		show_help();
 		return 0;
 	}
+	
+	/* the last argument is the file or process to scan, if any */
+	
+	last_rule_file = (compile_only || scan_all_processes) ? argc : argc - 1;
 
 	context->error_report_function = report_error;	
+	context->fast_match = fast_match;
+	context->record_delimiter = record_delimiter;
+	context->record_size = record_size;
+	context->region_flags = region_flags;
+	context->region_path = region_path;
+	context->process_timeout = process_timeout;
+	context->process_memory_limit = process_memory_limit;
+	context->max_string_matches = max_string_matches;
+	context->match_memory_limit = match_memory_limit;
+	context->warning_function = report_warning;
+	
+	define_external_variables(context);
 			
-	for (i = optind; i < (compile_only ? argc : argc - 1); i++)
+	if (!compile_rule_files(context, optind, last_rule_file, argv))
 	{
-		rule_file = fopen(argv[i], "r");
-		
-		if (rule_file != NULL)
-		{
-			yr_push_file_name(context, argv[i]);
-			            			
-			errors = yr_compile_file(rule_file, context);
-			
-			fclose(rule_file);
-			
-			if (errors) /* errors during compilation */
-			{
-				yr_destroy_context(context);				
-				return 2;
-			}
-		}
-		else
-		{
-			fprintf(stderr, "could not open file: %s\n", argv[i]);
-            if (compile_only)
-                return 2;
-		}
+		yr_destroy_context(context);				
+		return 2;
 	}
 
-	if (optind == (compile_only ? argc : argc - 1))  /* no rule files, read rules from stdin */
+	if (optind == last_rule_file)  /* no rule files, read rules from stdin */
 	{
 		yr_push_file_name(context, "stdin");
 		
@@ -628,35 +1906,103 @@ int main(int argc, char const* argv[])
         printf("syntax check OK\n");
         return 0;
     }
-			
-	if (is_numeric(argv[argc - 1]))
+    
+    if (select_rules(context) != ERROR_SUCCESS)
     {
-        pid = atoi(argv[argc - 1]);
-
-        switch (i = yr_scan_proc(pid, context, callback, (void*) argv[argc - 1]))
+        fprintf(stderr, "Not enough memory.\n");
+        yr_destroy_context(context);
+        return 0;
+    }
+    
+    /* 
+        cached results don't include matching strings, and scanning line by 
+        line produces results for each line instead of the whole file
+    */
+    
+    if (result_cache_path != NULL && (show_strings || IS_RECORD_MODE(context)))
+    {
+        fprintf(stderr, "result cache can't be used with -s, -L, -D or -R, ignoring it\n");
+        result_cache_path = NULL;
+    }
+    
+    if (result_cache_path != NULL)
+    {
+        switch (i = yr_open_result_cache(context, result_cache_path))
         {
             case ERROR_SUCCESS:
                 break;
-            case ERROR_COULD_NOT_ATTACH_TO_PROCESS:
-                fprintf(stderr, "can not attach to process (try running as root)\n");
-                break;
-            case ERROR_INSUFICIENT_MEMORY:
-                fprintf(stderr, "not enough memory\n");
+            case ERROR_UNCACHEABLE_RULES:
+                fprintf(stderr, "rules using external variables can't be cached, ignoring result cache\n");
+                result_cache_path = NULL;
                 break;
             default:
-                fprintf(stderr, "internal error: %d\n", i);
-                break;     
+                fprintf(stderr, "could not open result cache: %s\n", result_cache_path);
+                result_cache_path = NULL;
+                break;
         }
     }
+    
+    scanner = yr_create_scanner(context);
+    
+    if (scanner == NULL)
+    {
+        fprintf(stderr, "Not enough memory.\n");
+        yr_destroy_context(context);
+        return 0;
+    }
+			
+	if (scan_all_processes)
+	{
+	    if (list_processes(process_name, &pids, &pids_count))
+	    {
+	        if (pids_count > 0)
+	            scan_processes(pids, pids_count, context);
+	    }
+	    else
+	    {
+	        fprintf(stderr, "can not list processes\n");
+	    }
+	    
+	    free(pids);
+	}
+	else if (is_numeric(argv[argc - 1]))
+    {
+        pid = atoi(argv[argc - 1]);
+
+        target.name = argv[argc - 1];
+        target.scanner = scanner;
+        
+        report_process_error(argv[argc - 1], yr_scanner_scan_proc(pid, scanner, callback, &target));
+    }
+    else if (is_pid_list(argv[argc - 1]))
+    {
+        if (parse_pid_list(argv[argc - 1], &pids, &pids_count))
+            scan_processes(pids, pids_count, context);
+        else
+            fprintf(stderr, "not enough memory\n");
+            
+        free(pids);
+    }
 	else if (is_directory(argv[argc - 1]))
 	{
-		scan_dir(argv[argc - 1], recursive_search, context, callback);
+	    if (scan_threads > 1)
+	    {
+	        scan_dir_parallel(argv[argc - 1], scanner, context);
+	    }
+	    else
+	    {
+		    scan_dir(argv[argc - 1], recursive_search, scanner, callback);
+		}
 	}
 	else		
 	{
-		yr_scan_file(argv[argc - 1], context, callback, (void*) argv[argc - 1]);
+        target.name = argv[argc - 1];
+        target.scanner = scanner;
+        
+		yr_scanner_scan_file(argv[argc - 1], scanner, callback, &target);
 	}
 	
+	yr_destroy_scanner(scanner);
 	yr_destroy_context(context);
 	
 	/* free tag list allocated by process_cmd_line */
@@ -670,6 +2016,28 @@ int main(int argc, char const* argv[])
 		tag = next_tag;
 	}
 	
+	/* free external variables list allocated by process_cmd_line */
+	
+	external = external_variables;
+	
+	while(external != NULL)
+	{
+		next_external = external->next;
+		free(external);
+		external = next_external;
+	}
+	
+	/* free excluded directories list allocated by process_cmd_line */
+	
+	excluded = excluded_dirs_list;
+	
+	while(excluded != NULL)
+	{
+		next_excluded = excluded->next;
+		free(excluded);
+		excluded = next_excluded;
+	}
+	
 	return 1;
 }
 